@@ -0,0 +1,326 @@
+// benchmark.cpp - encoder throughput and per-stage cost on synthetic and real content at several
+// resolutions, subsamplings, qualities and thread counts, with OpenCV's VideoWriter (MJPG) as reference.
+//
+// jcodec_bench [-n frames] [-quick] [-direct] [-streams n] [image ...]
+//   -n frames  frames per run (default 30)
+//   -quick     1920x1080, H2V2 and quality 80 only
+//   -direct    write through a direct_sink (O_DIRECT, io_uring) instead of stdio
+//   -streams n then n 640x480 streams at once, on one MjpegRecorder and on threads of their own
+//              (SetThreads(2): two encoder workers and a writer thread per stream)
+//   image      real content, scaled to every resolution (default: 1920x1080.jpg if it exists)
+//
+// fps and MB/s (of BGR input) cover Write and Close, file I/O included. The stage columns are
+// time stamp counter cycles per pixel from a second run with params::m_stage_timing_flag, summed over
+// all threads (with more threads than CPUs, time a thread spends preempted is counted as well).
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/videoio.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "timer.hpp"
+#include "mjpegwriter.hpp"
+
+using namespace cv;
+using namespace std;
+
+static char OUT_FILE[] = "bench.avi";
+static const int VARIANTS = 4;
+static jcodec::file_sink *sink = 0;
+
+struct content
+{
+    string name;
+    Mat image; // empty for synthetic content
+};
+
+struct result
+{
+    double fps, mbps, bpp;
+    double cycles[jcodec::STAGE_COUNT]; // per pixel
+};
+
+static long long file_size(const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    long long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+// Gradients, a moving sine pattern, sharp edges and noise: neither flat nor pure noise,
+// so every stage sees realistic work. Frame f is shifted so consecutive frames differ.
+static Mat synthetic_frame(Size size, int f)
+{
+    Mat m(size, CV_8UC3);
+    unsigned seed = 12345u + f;
+    for (int y = 0; y < size.height; y++)
+    {
+        uchar *p = m.ptr(y);
+        for (int x = 0; x < size.width; x++, p += 3)
+        {
+            seed = seed * 1103515245u + 12345u;
+            int noise = (int)((seed >> 16) & 15) - 8;
+            int edge = (((x + f * 8) / 64 + y / 64) & 1) ? 40 : -40;
+            double wave = 60 * sin((x + f * 8) * 0.02) * cos(y * 0.015);
+            p[0] = saturate_cast<uchar>(128 + wave + edge + noise);
+            p[1] = saturate_cast<uchar>(y * 255 / size.height + noise);
+            p[2] = saturate_cast<uchar>(x * 255 / size.width - edge / 2 + noise);
+        }
+    }
+    return m;
+}
+
+static void make_frames(const content &c, Size size, vector<Mat> &frames)
+{
+    frames.clear();
+    for (int i = 0; i < VARIANTS; i++)
+    {
+        if (c.image.empty())
+            frames.push_back(synthetic_frame(size, i));
+        else
+        {
+            Mat m;
+            resize(c.image, m, size, 0, 0, INTER_AREA);
+            frames.push_back(m);
+        }
+    }
+}
+
+static bool run_jcodec(const vector<Mat> &frames, int nframes, const jcodec::params &p, int threads, bool timing, result &r)
+{
+    jcodec::MjpegWriter w;
+    jcodec::params q = p;
+    q.m_stage_timing_flag = timing;
+    w.SetThreads(threads);
+    w.SetSink(sink);
+    if (w.Open(OUT_FILE, (uchar)30, frames[0].size(), q) < 0)
+        return false;
+    timer t;
+    t.start();
+    for (int i = 0; i < nframes; i++)
+        if (w.Write(frames[i % frames.size()]) < 0)
+            return false;
+    if (w.Close() < 0)
+        return false;
+    t.stop();
+
+    const double pixels = (double)frames[0].total() * nframes;
+    if (timing)
+    {
+        unsigned long long cycles[jcodec::STAGE_COUNT];
+        w.GetStageCycles(cycles);
+        for (int i = 0; i < jcodec::STAGE_COUNT; i++)
+            r.cycles[i] = cycles[i] / pixels;
+    }
+    else
+    {
+        const double secs = t.get_elapsed_secs();
+        r.fps = nframes / secs;
+        r.mbps = pixels * 3 / secs / 1e6;
+        r.bpp = file_size(OUT_FILE) * 8.0 / pixels;
+    }
+    return true;
+}
+
+// n streams written round-robin from one thread, on the threads of recorder or (0) on the smallest pipeline of
+// their own each: two encoder workers and a writer thread (SetThreads(2); 1 would encode on the calling thread,
+// 0 start a worker per CPU for every stream). r.fps and r.mbps are the totals over all streams.
+static bool run_streams(const vector<Mat> &frames, int nframes, int n, jcodec::MjpegRecorder *recorder, result &r)
+{
+    vector<jcodec::MjpegWriter*> w(n);
+    jcodec::params p;
+    p.m_quality = 80;
+    bool ok = true;
+    timer t;
+    t.start();
+    for (int s = 0; s < n; s++)
+    {
+        char name[32];
+        sprintf(name, "bench%d.avi", s);
+        w[s] = new jcodec::MjpegWriter();
+        if (recorder)
+            w[s]->SetRecorder(recorder);
+        else
+            w[s]->SetThreads(2);
+        ok = ok && (w[s]->Open(name, (uchar)30, frames[0].size(), p) >= 0);
+    }
+    for (int i = 0; i < nframes && ok; i++)
+        for (int s = 0; s < n && ok; s++)
+            ok = w[s]->Write(frames[(i + s) % frames.size()]) >= 0;
+    for (int s = 0; s < n; s++)
+    {
+        char name[32];
+        sprintf(name, "bench%d.avi", s);
+        ok = (w[s]->Close() >= 0) && ok;
+        delete w[s];
+        remove(name);
+    }
+    t.stop();
+
+    const double pixels = (double)frames[0].total() * nframes * n, secs = t.get_elapsed_secs();
+    r.fps = nframes * n / secs;
+    r.mbps = pixels * 3 / secs / 1e6;
+    r.bpp = 0;
+    return ok;
+}
+
+static bool run_opencv(const vector<Mat> &frames, int nframes, int quality, result &r)
+{
+    VideoWriter w;
+    if (!w.open(OUT_FILE, VideoWriter::fourcc('M', 'J', 'P', 'G'), 30.0, frames[0].size(), true))
+        return false;
+    w.set(VIDEOWRITER_PROP_QUALITY, quality);
+    timer t;
+    t.start();
+    for (int i = 0; i < nframes; i++)
+        w.write(frames[i % frames.size()]);
+    w.release();
+    t.stop();
+
+    const double pixels = (double)frames[0].total() * nframes, secs = t.get_elapsed_secs();
+    r.fps = nframes / secs;
+    r.mbps = pixels * 3 / secs / 1e6;
+    r.bpp = file_size(OUT_FILE) * 8.0 / pixels;
+    return true;
+}
+
+static void print_row(const string &name, Size size, const char *sub, int quality, const char *threads, const result &r, bool stages)
+{
+    char res[32];
+    sprintf(res, "%dx%d", size.width, size.height);
+    printf("%-12s %-10s %-5s %3d %4s %8.1f %8.1f %6.2f", name.c_str(), res, sub, quality, threads, r.fps, r.mbps, r.bpp);
+    if (stages)
+    {
+        double total = 0;
+        for (int i = 0; i < jcodec::STAGE_COUNT; i++)
+        {
+            printf(" %7.2f", r.cycles[i]);
+            total += r.cycles[i];
+        }
+        printf(" %7.2f", total);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    int nframes = 30, streams = 0;
+    bool quick = false;
+    jcodec::direct_sink direct;
+    vector<content> contents(1);
+    contents[0].name = "synthetic";
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc))
+            nframes = max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "-quick"))
+            quick = true;
+        else if (!strcmp(argv[i], "-direct"))
+            sink = &direct;
+        else if (!strcmp(argv[i], "-streams") && (i + 1 < argc))
+            streams = max(atoi(argv[++i]), 1);
+        else
+        {
+            content c;
+            c.name = argv[i];
+            c.image = imread(argv[i]);
+            if (c.image.empty())
+            {
+                printf("cannot read %s\n", argv[i]);
+                return 1;
+            }
+            contents.push_back(c);
+        }
+    }
+    if (contents.size() == 1)
+    {
+        content c;
+        c.name = "1920x1080.jpg";
+        c.image = imread(c.name);
+        if (!c.image.empty())
+            contents.push_back(c);
+    }
+
+    const Size all_sizes[] = { Size(640, 480), Size(1280, 720), Size(1920, 1080), Size(3840, 2160) };
+    const jcodec::subsampling_t all_subs[] = { jcodec::Y_ONLY, jcodec::H1V1, jcodec::H2V1, jcodec::H2V2 };
+    const char *sub_names[] = { "Y", "H1V1", "H2V1", "H2V2" };
+    const int all_qualities[] = { 50, 80, 95 };
+    vector<Size> sizes(all_sizes, all_sizes + 4);
+    vector<jcodec::subsampling_t> subs(all_subs, all_subs + 4);
+    vector<int> qualities(all_qualities, all_qualities + 3);
+    if (quick)
+    {
+        sizes.assign(1, Size(1920, 1080));
+        subs.assign(1, jcodec::H2V2);
+        qualities.assign(1, 80);
+    }
+    char all_threads[16];
+    sprintf(all_threads, "%d", getNumberOfCPUs());
+
+    printf("%d frames per run; stage columns in cycles per pixel\n", nframes);
+    printf("%-12s %-10s %-5s %3s %4s %8s %8s %6s %7s %7s %7s %7s %7s %7s\n", "content", "size", "sub", "q", "thr",
+        "fps", "MB/s", "bpp", "convert", "dct", "quant", "entropy", "io", "total");
+    for (size_t c = 0; c < contents.size(); c++)
+    {
+        for (size_t s = 0; s < sizes.size(); s++)
+        {
+            vector<Mat> frames;
+            make_frames(contents[c], sizes[s], frames);
+            for (size_t q = 0; q < qualities.size(); q++)
+            {
+                for (size_t k = 0; k < subs.size(); k++)
+                {
+                    jcodec::params p;
+                    p.m_quality = qualities[q];
+                    p.m_subsampling = subs[k];
+                    for (int mt = 0; mt < 2; mt++)
+                    {
+                        // 1: encoded on the caller's thread; 0: one encoder thread per CPU
+                        result r;
+                        if (!run_jcodec(frames, nframes, p, mt ? 0 : 1, false, r) ||
+                            !run_jcodec(frames, nframes, p, mt ? 0 : 1, true, r))
+                        {
+                            printf("jcodec failed\n");
+                            return 1;
+                        }
+                        print_row(contents[c].name, sizes[s], sub_names[subs[k]], qualities[q], mt ? all_threads : "1", r, true);
+                    }
+                }
+                // OpenCV's built-in MJPEG encoder always codes colour as 4:2:0
+                result r;
+                if (run_opencv(frames, nframes, qualities[q], r))
+                    print_row(contents[c].name, sizes[s], "cv", qualities[q], "cv", r, false);
+                else
+                    printf("%-12s opencv VideoWriter (MJPG) unavailable\n", contents[c].name.c_str());
+            }
+        }
+    }
+    remove(OUT_FILE);
+
+    if (streams)
+    {
+        // the 'thr' column: rec - one MjpegRecorder (a worker per CPU), own - 3 threads of its own for every stream
+        vector<Mat> frames;
+        make_frames(contents.back(), Size(640, 480), frames);
+        jcodec::MjpegRecorder recorder;
+        char name[32];
+        sprintf(name, "%d streams", streams);
+        for (int own = 0; own < 2; own++)
+        {
+            result r;
+            if (!run_streams(frames, nframes, streams, own ? 0 : &recorder, r))
+            {
+                printf("jcodec failed\n");
+                return 1;
+            }
+            print_row(name, Size(640, 480), "H2V2", 80, own ? "own" : "rec", r, false);
+        }
+    }
+    return 0;
+}
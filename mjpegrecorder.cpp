@@ -0,0 +1,242 @@
+#include "mjpegwriter.hpp"
+#include "opencv2/core/utility.hpp"
+
+namespace jcodec{
+
+    MjpegRecorder::MjpegRecorder(int nthreads, size_t memory_limit) : pending(0), stop(false),
+        memoryLimit(memory_limit), memoryUsed(0)
+    {
+        int n = nthreads > 0 ? nthreads : getNumberOfCPUs();
+        for (int i = 0; i < n; i++)
+            workers.push_back(new Worker());
+        for (int i = 0; i < n; i++)
+            workers[i]->thread = std::thread(&MjpegRecorder::WorkLoop, this, i);
+    }
+
+    MjpegRecorder::~MjpegRecorder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stop = true;
+        }
+        workQueued.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i]->thread.join();
+            delete workers[i];
+        }
+        while (!freeSlots.empty())
+        {
+            delete freeSlots.front();
+            freeSlots.pop_front();
+        }
+    }
+
+    size_t MjpegRecorder::GetMemoryUsed()
+    {
+        std::lock_guard<std::mutex> lock(slotMutex);
+        return memoryUsed;
+    }
+
+    // Open: the stream joins the thread serving the fewest streams, level with the frames taken there lately
+    // (a stream starts with neither a debt nor a credit of thread time).
+    void MjpegRecorder::AddStream(MjpegWriter *w, int priority)
+    {
+        // each count is read under its own thread's lock; another Open may change it right after, which
+        // only makes the choice a little less even
+        int home = 0;
+        size_t fewest = 0;
+        for (int i = 0; i < (int)workers.size(); i++)
+        {
+            std::lock_guard<std::mutex> lock(workers[i]->mutex);
+            if (!i || (workers[i]->streams.size() < fewest))
+            {
+                home = i;
+                fewest = workers[i]->streams.size();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(slotMutex);
+            w->recInFlight = 0;
+        }
+        Worker *h = workers[home];
+        std::lock_guard<std::mutex> lock(h->mutex);
+        h->streams.push_back(w);
+        w->recHome = home;
+        w->recQueued = 0;
+        w->recBusy = 0;
+        w->recPass = h->vtime;
+        w->recStride = 1.0 / priority;
+    }
+
+    // Close, once every frame is written: waits for the threads still inside the stream.
+    void MjpegRecorder::RemoveStream(MjpegWriter *w)
+    {
+        Worker *h = workers[w->recHome];
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock(h->mutex);
+                if (!w->recBusy)
+                {
+                    for (size_t i = 0; i < h->streams.size(); i++)
+                        if (h->streams[i] == w)
+                        {
+                            h->streams.erase(h->streams.begin() + i);
+                            break;
+                        }
+                    h->queued -= w->recQueued;
+                    pending -= w->recQueued;
+                    w->recQueued = 0;
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // A frame of w was queued (called without any writer lock held).
+    void MjpegRecorder::FrameQueued(MjpegWriter *w)
+    {
+        Worker *h = workers[w->recHome];
+        {
+            std::lock_guard<std::mutex> lock(h->mutex);
+            // an idle stream does not save up thread time for later
+            if (!w->recQueued++)
+                w->recPass = std::max(w->recPass, h->vtime);
+            h->queued++;
+        }
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        pending++;
+        workQueued.notify_one();
+    }
+
+    // The stream of w's that is furthest behind (lowest pass) with a frame queued, charged for the frame; 0 if none.
+    MjpegWriter *MjpegRecorder::TakeFrom(Worker *w)
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        MjpegWriter *best = 0;
+        for (size_t i = 0; i < w->streams.size(); i++)
+        {
+            MjpegWriter *s = w->streams[i];
+            if (s->recQueued && (!best || (s->recPass < best->recPass)))
+                best = s;
+        }
+        if (!best)
+            return 0;
+        best->recQueued--;
+        best->recBusy++;
+        w->queued--;
+        pending--;
+        w->vtime = best->recPass;
+        best->recPass += best->recStride;
+        return best;
+    }
+
+    // Thread id's own streams first, then those of the thread with the most frames waiting.
+    MjpegWriter *MjpegRecorder::TakeFrame(int id)
+    {
+        MjpegWriter *w = workers[id]->queued ? TakeFrom(workers[id]) : 0;
+        while (!w && pending)
+        {
+            Worker *busiest = 0;
+            int most = 0;
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                int queued = workers[i]->queued;
+                if (queued > most)
+                {
+                    most = queued;
+                    busiest = workers[i];
+                }
+            }
+            if (!busiest)
+                break;
+            w = TakeFrom(busiest);
+        }
+        return w;
+    }
+
+    void MjpegRecorder::WorkLoop(int id)
+    {
+        for (;;)
+        {
+            MjpegWriter *w = TakeFrame(id);
+            if (w)
+            {
+                w->EncodeQueued();
+                std::lock_guard<std::mutex> lock(workers[w->recHome]->mutex);
+                w->recBusy--;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            while (!stop && !pending)
+                workQueued.wait(lock);
+            if (stop)
+                break;
+        }
+    }
+
+    // A slot of bytes for a new frame of w, within w's frame queue (MjpegWriter::SetQueue, 0 - no cap of its own)
+    // and the memory limit. With wait, blocks until one is free and returns the ticks it waited in stall;
+    // otherwise returns 0 at once when there is none.
+    MjpegWriter::FrameJob *MjpegRecorder::AcquireSlot(MjpegWriter *w, size_t bytes, bool wait, int64 &stall)
+    {
+        std::unique_lock<std::mutex> lock(slotMutex);
+        int64 t = 0;
+        for (;;)
+        {
+            MjpegWriter::FrameJob *job = 0;
+            if (!w->queueFrames || (w->recInFlight < w->queueFrames))
+                job = TakeSlot(bytes);
+            if (job)
+            {
+                w->recInFlight++;
+                if (t)
+                    stall = getTickCount() - t;
+                return job;
+            }
+            if (!wait)
+                return 0;
+            if (!t)
+                t = getTickCount();
+            slotFreed.wait(lock);
+        }
+    }
+
+    // A free slot of at least bytes, or a new one if it fits in the memory limit once the spare slots are
+    // freed (slotMutex held). A single slot is allowed even if it alone exceeds the limit.
+    MjpegWriter::FrameJob *MjpegRecorder::TakeSlot(size_t bytes)
+    {
+        for (size_t i = 0; i < freeSlots.size(); i++)
+            if (freeSlots[i]->cost >= bytes)
+            {
+                MjpegWriter::FrameJob *job = freeSlots[i];
+                freeSlots.erase(freeSlots.begin() + i);
+                return job;
+            }
+        while (!freeSlots.empty() && (memoryUsed + bytes > memoryLimit))
+        {
+            memoryUsed -= freeSlots.front()->cost;
+            delete freeSlots.front();
+            freeSlots.pop_front();
+        }
+        if (memoryUsed && (memoryUsed + bytes > memoryLimit))
+            return 0;
+        MjpegWriter::FrameJob *job = new MjpegWriter::FrameJob();
+        job->cost = bytes;
+        memoryUsed += bytes;
+        return job;
+    }
+
+    // A frame of w is written (called with w's jobsMutex held).
+    void MjpegRecorder::ReleaseSlot(MjpegWriter *w, MjpegWriter::FrameJob *job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(slotMutex);
+            w->recInFlight--;
+            freeSlots.push_back(job);
+        }
+        slotFreed.notify_all();
+    }
+}
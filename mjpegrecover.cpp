@@ -0,0 +1,396 @@
+#include "mjpegwriter.hpp"
+#include <stdio.h>
+#include <limits.h>
+#if defined(WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#endif
+
+namespace jcodec{
+
+#define fourCC(a,b,c,d) ( (int) ((uchar(d)<<24) | (uchar(c)<<16) | (uchar(b)<<8) | uchar(a)) )
+
+    static const int SUPER_INDEX_TYPE = 4;                 // wLongsPerEntry 4, AVI_INDEX_OF_INDEXES
+    static const int STD_INDEX_TYPE = 2 | (0x01 << 24);   // wLongsPerEntry 2, AVI_INDEX_OF_CHUNKS
+    static const int AVIIF_KEYFRAME = 0x10;
+
+    // The file being repaired: positioned reads, and writes of only what differs, so a file
+    // that needs no repair is not written at all.
+    class avi_file
+    {
+    public:
+        avi_file() : m_file(0), m_size(0), m_ok(true) { }
+        ~avi_file() { close(); }
+
+        bool open(const char *name)
+        {
+            if (!(m_file = fopen(name, "rb+")) || seek(0, SEEK_END))
+                return false;
+#if defined(WIN32)
+            m_size = _ftelli64(m_file);
+#else
+            m_size = (long long)ftello(m_file);
+#endif
+            return m_size >= 0;
+        }
+
+        bool close()
+        {
+            if (m_file && fclose(m_file))
+                m_ok = false;
+            m_file = 0;
+            return m_ok;
+        }
+
+        long long size() const { return m_size; }
+
+        bool read(long long pos, void *pBuf, size_t len)
+        {
+            return (pos >= 0) && (pos + (long long)len <= m_size) && !seek(pos, SEEK_SET) && (fread(pBuf, 1, len, m_file) == len);
+        }
+
+        int get_int(long long pos)
+        {
+            int value = 0;
+            read(pos, &value, sizeof(value));
+            return value;
+        }
+
+        void write(long long pos, const void *pBuf, size_t len)
+        {
+            if (seek(pos, SEEK_SET) || (fwrite(pBuf, 1, len, m_file) != len))
+                m_ok = false;
+            m_size = std::max(m_size, pos + (long long)len);
+        }
+
+        void patch(long long pos, int value)
+        {
+            if (get_int(pos) != value)
+                write(pos, &value, sizeof(value));
+        }
+
+        void truncate(long long size)
+        {
+            if (size == m_size)
+                return;
+            fflush(m_file);
+#if defined(WIN32)
+            if (_chsize_s(_fileno(m_file), size))
+#else
+            if (ftruncate(fileno(m_file), (off_t)size))
+#endif
+                m_ok = false;
+            m_size = size;
+        }
+
+    private:
+        int seek(long long pos, int origin)
+        {
+#if defined(WIN32)
+            return _fseeki64(m_file, pos, origin);
+#else
+            return fseeko(m_file, (off_t)pos, origin);
+#endif
+        }
+
+        FILE *m_file;
+        long long m_size;
+        bool m_ok;
+    };
+
+    // A standard index ('ix00') chunk: its position, size with the chunk header, base ('movi' of its RIFF) and frames
+    struct std_index
+    {
+        long long pos, base;
+        int size, frames;
+    };
+
+    static bool read_std_index(avi_file &f, long long pos, std_index &ix)
+    {
+        int h[8];
+        if (!f.read(pos, h, sizeof(h)) || (h[0] != fourCC('i', 'x', '0', '0')) || (h[2] != STD_INDEX_TYPE) ||
+            (h[3] < 0) || (h[1] != 24 + 8 * h[3]) || (pos + 8 + h[1] > f.size()))
+            return false;
+        ix.pos = pos;
+        ix.size = h[1] + 8;
+        ix.frames = h[3];
+        ix.base = (long long)(unsigned)h[5] | ((long long)h[6] << 32);
+        return true;
+    }
+
+    // The frames of a RIFF as far as they were found, and how it ends
+    struct riff_part
+    {
+        long long riff, movi, end;
+        vector<long long> offsets;      // of the frame chunks, only kept for the last RIFF
+        vector<int> sizes;
+        std_index ix;                   // the last 'ix00', complete if it has all the frames
+        bool idx1;
+
+        riff_part(long long riff_pos, long long movi_pos) : riff(riff_pos), movi(movi_pos), end(0), idx1(false)
+        {
+            ix.pos = 0;
+            ix.frames = -1;
+        }
+
+        // Everything EndRiff writes is there
+        bool closed() const
+        {
+            return !sizes.empty() && (ix.frames == (int)sizes.size()) && (riff || idx1);
+        }
+    };
+
+    int recover_avi(const char *name, recover_info *info)
+    {
+        avi_file f;
+        if (!f.open(name))
+            return -1;
+        const long long fileSize = f.size();
+
+        // header: the fields Close writes, found by walking hdrl (LISTs are entered, other chunks skipped)
+        long long avih = 0, strh = 0, indx = 0, dmlh = 0, movi0 = 0;
+        int hdr[3];
+        if (!f.read(0, hdr, sizeof(hdr)) || (hdr[0] != fourCC('R', 'I', 'F', 'F')) || (hdr[2] != fourCC('A', 'V', 'I', ' ')) ||
+            !f.read(12, hdr, sizeof(hdr)) || (hdr[0] != fourCC('L', 'I', 'S', 'T')) || (hdr[2] != fourCC('h', 'd', 'r', 'l')))
+            return -3;
+        const long long hdrlEnd = 20 + (long long)(unsigned)hdr[1];
+        for (long long pos = 24; pos + 8 <= hdrlEnd; )
+        {
+            if (!f.read(pos, hdr, 8))
+                return -3;
+            if (hdr[0] == fourCC('L', 'I', 'S', 'T'))
+            {
+                pos += 12;
+                continue;
+            }
+            if (hdr[0] == fourCC('a', 'v', 'i', 'h'))
+                avih = pos + 8;
+            else if ((hdr[0] == fourCC('s', 't', 'r', 'h')) && !strh)
+                strh = pos + 8;
+            else if ((hdr[0] == fourCC('i', 'n', 'd', 'x')) && !indx)
+                indx = pos + 8;
+            else if (hdr[0] == fourCC('d', 'm', 'l', 'h'))
+                dmlh = pos + 8;
+            pos += 8 + (long long)(unsigned)hdr[1] + (hdr[1] & 1);
+        }
+        for (long long pos = hdrlEnd; !movi0 && f.read(pos, hdr, sizeof(hdr)); pos += 8 + (long long)(unsigned)hdr[1] + (hdr[1] & 1))
+        {
+            if ((hdr[0] == fourCC('L', 'I', 'S', 'T')) && (hdr[2] == fourCC('m', 'o', 'v', 'i')))
+                movi0 = pos + 8;
+            else if (hdr[0] != fourCC('J', 'U', 'N', 'K'))
+                break;
+        }
+        if (!avih || !strh || !indx || !dmlh || !movi0 || (f.get_int(indx) != SUPER_INDEX_TYPE))
+            return -3;
+        const int slots = (f.get_int(indx - 4) - 24) / 16;
+        const int scale = f.get_int(strh + 20), fps = scale > 0 ? f.get_int(strh + 24) / scale : 0;
+
+        // the indexes of the last checkpoint: every RIFF before the one it was in is complete
+        vector<std_index> kept;
+        vector<int> sizes;              // of all frames, for dwMaxBytesPerSec
+        long long riff0Frames = -1, indexed = 0;
+        const int inUse = std::min(std::max(f.get_int(indx + 4), 0), slots);
+        for (int i = 0; i < inUse; i++)
+        {
+            std_index ix;
+            int e[4];
+            if (!f.read(indx + 24 + i * 16, e, sizeof(e)) || !read_std_index(f, (long long)(unsigned)e[0] | ((long long)e[1] << 32), ix) ||
+                (ix.frames != e[3]) || (!kept.empty() && (ix.base < kept.back().base)))
+                break;
+            kept.push_back(ix);
+        }
+        const long long base = kept.empty() ? movi0 : kept.back().base;
+        riff_part cur(base == movi0 ? 0 : base - 20, base);
+        if (cur.riff && ((f.get_int(cur.riff) != fourCC('R', 'I', 'F', 'F')) || (f.get_int(cur.riff + 8) != fourCC('A', 'V', 'I', 'X'))))
+            return -3;
+        long long start = base + 4;
+        for (size_t i = 0; i < kept.size(); i++)
+        {
+            vector<int> e(2 * (size_t)kept[i].frames + 1);
+            if (kept[i].frames && !f.read(kept[i].pos + 32, &e[0], (size_t)kept[i].frames * 8))
+                return -1;
+            for (int k = 0; k < kept[i].frames; k++)
+            {
+                sizes.push_back(e[2 * k + 1] & INT_MAX);
+                if (kept[i].base == base)
+                {
+                    cur.offsets.push_back(kept[i].base + (unsigned)e[2 * k] - 8);
+                    cur.sizes.push_back(sizes.back());
+                }
+            }
+            if (kept[i].base == movi0)
+                riff0Frames = std::max(riff0Frames, 0LL) + kept[i].frames;
+            indexed += kept[i].frames;
+        }
+        if (!kept.empty())
+        {
+            cur.ix = kept.back();
+            start = cur.ix.pos + cur.ix.size;
+        }
+        while (!kept.empty() && (kept.back().base == base))
+            kept.pop_back();
+        sizes.resize(sizes.size() - cur.sizes.size());
+        if (cur.riff)
+            riff0Frames = std::max(riff0Frames, 0LL);
+
+        // what was written after it, up to the first chunk that is not complete
+        vector<riff_part> done;
+        long long pos = start;
+        while (pos + 8 <= fileSize)
+        {
+            int ck[6];
+            if (!f.read(pos, ck, 8))
+                break;
+            const long long end = pos + 8 + (long long)(unsigned)ck[1];
+            if (ck[0] == fourCC('0', '0', 'd', 'c'))
+            {
+                unsigned short soi = 0, eoi = 0;
+                if ((ck[1] < 4) || (end > fileSize) || !f.read(pos + 8, &soi, 2) || !f.read(end - 2, &eoi, 2) ||
+                    (soi != 0xD8FF) || (eoi != 0xD9FF))
+                    break;
+                cur.offsets.push_back(pos);
+                cur.sizes.push_back(ck[1]);
+                pos = end + (ck[1] & 1);
+            }
+            else if (ck[0] == fourCC('i', 'x', '0', '0'))
+            {
+                std_index ix;
+                if (!read_std_index(f, pos, ix) || (ix.base != cur.movi))
+                    break;
+                cur.ix = ix;
+                pos = end;
+            }
+            else if ((ck[0] == fourCC('i', 'd', 'x', '1')) && !cur.riff && !cur.idx1)
+            {
+                if ((cur.ix.frames != (int)cur.sizes.size()) || (ck[1] != 16 * (int)cur.sizes.size()) || (end > fileSize))
+                    break;
+                cur.idx1 = true;
+                pos = end;
+            }
+            else if (ck[0] == fourCC('R', 'I', 'F', 'F'))
+            {
+                if (!cur.closed() || !f.read(pos, ck, sizeof(ck)) || (ck[2] != fourCC('A', 'V', 'I', 'X')) ||
+                    (ck[3] != fourCC('L', 'I', 'S', 'T')) || (ck[5] != fourCC('m', 'o', 'v', 'i')))
+                    break;
+                cur.end = pos;
+                if (!cur.riff)
+                    riff0Frames = cur.sizes.size();
+                sizes.insert(sizes.end(), cur.sizes.begin(), cur.sizes.end());
+                done.push_back(cur);
+                done.back().offsets.clear();
+                cur = riff_part(pos, pos + 20);
+                pos += 24;
+            }
+            else
+                break;
+        }
+        const long long scanned = pos - start;
+
+        // a RIFF that got no frame is dropped, the one before it is complete
+        if (cur.sizes.empty() && cur.riff && !done.empty())
+        {
+            pos = cur.riff;
+            cur = done.back();
+            done.pop_back();
+            sizes.resize(sizes.size() - cur.sizes.size());
+        }
+        if (cur.sizes.empty())
+            return -2;
+        sizes.insert(sizes.end(), cur.sizes.begin(), cur.sizes.end());
+        if (!cur.riff)
+            riff0Frames = cur.sizes.size();
+
+        // the last RIFF: cut after its last frame and given its index (and idx1), unless it is complete
+        long long cut = pos;
+        if (!cur.closed())
+        {
+            cut = cur.offsets.back() + 8 + cur.sizes.back() + (cur.sizes.back() & 1);
+            vector<int> buf;
+            buf.push_back(fourCC('i', 'x', '0', '0'));
+            buf.push_back(24 + 8 * (int)cur.sizes.size());
+            buf.push_back(STD_INDEX_TYPE);
+            buf.push_back((int)cur.sizes.size());
+            buf.push_back(fourCC('0', '0', 'd', 'c'));
+            buf.push_back((int)cur.movi);
+            buf.push_back((int)(cur.movi >> 32));
+            buf.push_back(0);
+            for (size_t i = 0; i < cur.sizes.size(); i++)
+            {
+                buf.push_back((int)(cur.offsets[i] + 8 - cur.movi));
+                buf.push_back(cur.sizes[i]);
+            }
+            cur.ix.pos = cut;
+            cur.ix.size = (int)buf.size() * 4;
+            cur.ix.frames = (int)cur.sizes.size();
+            if (!cur.riff)
+            {
+                buf.push_back(fourCC('i', 'd', 'x', '1'));
+                buf.push_back(16 * (int)cur.sizes.size());
+                for (size_t i = 0; i < cur.sizes.size(); i++)
+                {
+                    buf.push_back(fourCC('0', '0', 'd', 'c'));
+                    buf.push_back(AVIIF_KEYFRAME);
+                    buf.push_back((int)(cur.offsets[i] - cur.movi));
+                    buf.push_back(cur.sizes[i]);
+                }
+            }
+            f.truncate(cut);
+            f.write(cut, &buf[0], buf.size() * 4);
+            pos = cut + (long long)buf.size() * 4;
+        }
+        else
+            f.truncate(pos);
+        cur.end = pos;
+        done.push_back(cur);
+
+        // sizes of the RIFFs and 'movi' lists found, and their indexes in the super index slots left
+        int entries = (int)kept.size(), riffs = (int)done.size();
+        for (size_t i = 0; i < kept.size(); i++)
+            riffs += !i || (kept[i].base != kept[i - 1].base);
+        for (size_t i = 0; i < done.size(); i++)
+        {
+            f.patch(done[i].movi - 4, (int)(done[i].ix.pos + done[i].ix.size - done[i].movi));
+            f.patch(done[i].riff + 4, (int)(done[i].end - done[i].riff - 8));
+            if (entries < slots)
+            {
+                const long long entry = indx + 24 + entries * 16;
+                f.patch(entry, (int)done[i].ix.pos);
+                f.patch(entry + 4, (int)(done[i].ix.pos >> 32));
+                f.patch(entry + 8, done[i].ix.size);
+                f.patch(entry + 12, done[i].ix.frames);
+                entries++;
+            }
+        }
+        f.patch(indx + 4, entries);
+
+        // header counts as FinishWriteAVI writes them, and the peak rate over fps frames as MjpegWriter::TrackRate
+        const int frames = (int)sizes.size();
+        long long window = 0, maxBytesPerSec = 0;
+        for (int i = 0; i < frames; i++)
+        {
+            window += sizes[i] + 8;
+            if (i >= fps)
+                window -= sizes[i - fps] + 8;
+            if (i + 1 >= fps)
+                maxBytesPerSec = std::max(maxBytesPerSec, window);
+        }
+        if (!maxBytesPerSec && fps > 0)
+            maxBytesPerSec = window * fps / frames;
+        f.patch(avih + 4, (int)std::min(maxBytesPerSec, (long long)INT_MAX));
+        f.patch(avih + 16, (int)riff0Frames);
+        f.patch(strh + 32, frames);
+        f.patch(dmlh, frames);
+
+        if (info)
+        {
+            info->frames = frames;
+            info->indexed_frames = indexed;
+            info->scanned_bytes = scanned;
+            info->cut_bytes = fileSize - cut;
+            info->riffs = riffs;
+        }
+        return f.close() ? 1 : -1;
+    }
+}
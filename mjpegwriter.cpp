@@ -1,7 +1,36 @@
 
 #include "mjpegwriter.hpp"
+#include "mjpegwriter_simd.hpp"
 #include "opencv2/core/utility.hpp"
+#include <math.h>
+#include <limits.h>
 #include <smmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#if defined(WIN32)
+#include <malloc.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#endif
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_OFF_SQES) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 namespace jcodec{
 
@@ -20,26 +49,163 @@ namespace jcodec{
     static const int AVI_BITS_PER_PIXEL = 24;
     static const int AVI_BIPLANES = 1;
     static const int JUNK_SEEK = 4096;
+    static const long long AVI_RIFF_LIMIT = 1 << 30;   // RIFF 'AVI ' and 'AVIX' segments are rolled over at 1 GB at most (SetRiffLimit)
+    static const int ODML_INDX_ENTRIES = 2048;          // super index slots reserved in the header (one per RIFF)
+    static const int AVI_INDEX_OF_INDEXES = 0x00;
+    static const int AVI_INDEX_OF_CHUNKS = 0x01;
     static const int AVIIF_KEYFRAME = 0x10;
-    static const int MAX_BYTES_PER_SEC = 15552000;
+    static const int RC_MAX_RETRIES = 3;                // encodes of a frame over the size cap, after the first
+    static const int RC_MAX_SCALE = 5000;               // params::m_quant_scale range
     static const int SUG_BUFFER_SIZE = 1048576;
+    static const unsigned long long HUFF_COUNT_LIMIT = 1 << 20;     // symbols per shared table: codes stay under 32 bits
+    static const size_t STAGE_BUFFER_SIZE = 8 << 20;
+    static const size_t STAGE_ALIGN = 4096;
+
+    // CPU time stamp counter, the clock of the stage timing
+    static inline unsigned long long read_cycles()
+    {
+        return __rdtsc();
+    }
+
+    MjpegWriter::MjpegWriter() : NumOfChunks(10), sink(0), outSink(0), outformat(1), outfps(20), FrameNum(0),
+        ixFrames(0), riffIndxBase(0), riffLimit(AVI_RIFF_LIMIT), ckptFrames(0), ckptDurable(false), isOpen(false), nThreads(1), stopPipeline(false), pipelineFailed(false),
+        queueFrames(0), queuePolicy(QUEUE_BLOCK), droppedOldest(0), droppedNewest(0),
+        recorder(0), openRecorder(0), recorderPriority(1), headWriting(false),
+        recHome(0), recQueued(0), recInFlight(0), recBusy(0), recPass(0), recStride(1),
+        huffFrames(0), huffRolling(false), encoder(new jpeg_encoder()), statsEnabled(false), rcBitrate(0), rcMaxFrameBytes(0),
+        segMaxFrames(0), segMaxBytes(0), segMaxSeconds(0), segmented(false), segFrameLimit(0), segIndex(0),
+        segNextSink(0), segClosingSink(0), segStop(false), segFailed(false), segNextFailed(false)
+    {
+        encParams.m_quality = 80;
+        memset(stageCycles, 0, sizeof(stageCycles));
+    }
+
+    MjpegWriter::~MjpegWriter()
+    {
+        if (isOpen)
+            Close();
+        delete encoder;
+    }
+
+    void MjpegWriter::SetThreads(int nthreads)
+    {
+        nThreads = nthreads < 0 ? 1 : nthreads;
+    }
+
+    void MjpegWriter::SetStripes(int nstripes)
+    {
+        encParams.m_stripes = nstripes < 1 ? 1 : nstripes;
+    }
+
+    void MjpegWriter::SetRateControl(long long bitrate, int max_frame_bytes)
+    {
+        rcBitrate = bitrate < 0 ? 0 : bitrate;
+        rcMaxFrameBytes = max_frame_bytes < 0 ? 0 : max_frame_bytes;
+    }
+
+    void MjpegWriter::SetSink(file_sink *s)
+    {
+        sink = s;
+    }
+
+    void MjpegWriter::SetRecorder(MjpegRecorder *r, int priority)
+    {
+        recorder = r;
+        recorderPriority = priority < 1 ? 1 : priority;
+    }
 
-    MjpegWriter::MjpegWriter() : isOpen(false), outFile(0), outformat(1), outfps(20),
-        FrameNum(0), quality(80), NumOfChunks(10) {}
+    void MjpegWriter::SetSegments(int max_frames, long long max_bytes, double max_seconds, const segment_callback &done)
+    {
+        segMaxFrames = max_frames < 0 ? 0 : max_frames;
+        segMaxBytes = max_bytes < 0 ? 0 : max_bytes;
+        segMaxSeconds = max_seconds < 0 ? 0 : max_seconds;
+        segDone = done;
+    }
+
+    void MjpegWriter::SetCheckpoints(int nframes, bool durable)
+    {
+        ckptFrames = nframes < 0 ? 0 : nframes;
+        ckptDurable = durable;
+    }
+
+    void MjpegWriter::SetRiffLimit(long long max_bytes)
+    {
+        riffLimit = (max_bytes <= 0) || (max_bytes > AVI_RIFF_LIMIT) ? AVI_RIFF_LIMIT : max_bytes;
+    }
+
+    void MjpegWriter::SetQueue(int max_frames, queue_policy_t policy)
+    {
+        queueFrames = max_frames < 0 ? 0 : max_frames;
+        queuePolicy = policy;
+    }
+
+    void MjpegWriter::SetSharedHuffman(int nframes, bool rolling)
+    {
+        huffFrames = nframes < 0 ? 0 : nframes;
+        huffRolling = rolling;
+    }
 
     int MjpegWriter::Open(char* outfile, uchar fps, Size ImSize)
     {
-        tencoding = 0;
+        return Open(outfile, fps, ImSize, encParams);
+    }
+
+    int MjpegWriter::Open(char* outfile, uchar fps, Size ImSize, const params &p)
+    {
         if (isOpen) return -4;
         if (fps < 1) return -3;
-        if (!(outFile = fopen(outfile, "wb+")))
-            return -1;
+        if (!p.check()) return -5;
+        encParams = p;
+        memset(stageCycles, 0, sizeof(stageCycles));
+        encoder->reset_stage_cycles();
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            stats = writer_stats();
+            rcScale = p.quant_scale();
+            rcDebt = 0;
+            droppedOldest = droppedNewest = 0;
+        }
+        segmented = (segMaxFrames > 0) || (segMaxBytes > 0) || (segMaxSeconds > 0);
+        if (segmented)
+        {
+            int r = OpenSegments(outfile);
+            if (r < 0)
+                return r;
+            segFrameLimit = segMaxFrames;
+            if (segMaxSeconds > 0)
+            {
+                int n = std::max((int)ceil(segMaxSeconds * fps - 1e-6), 1);
+                segFrameLimit = segFrameLimit ? std::min(segFrameLimit, n) : n;
+            }
+        }
+        else
+        {
+            outSink = sink ? sink : &stdioSink;
+            if (!outSink->open(outfile))
+            {
+                outSink = 0;
+                return -1;
+            }
+        }
         outfps = fps;
         width = ImSize.width;
         height = ImSize.height;
 
-        StartWriteAVI();
-        WriteStreamHeader();
+        if (!stage.open(outSink, 0, STAGE_BUFFER_SIZE))
+        {
+            outSink->close();
+            outSink = 0;
+            if (segmented)
+                FreeSegmentSinks();
+            return -1;
+        }
+        huffPicked = huffSampled = huffVersion = encoderHuffVersion = 0;
+        huffCounts = huffman_counts();
+        encoder->set_huffman_tables(0);
+        StartFile();
+        StartPipeline();
+        if (segmented)
+            segThread = std::thread(&MjpegWriter::SegmentLoop, this);
 
         isOpen = true;
         outfileName = outfile;
@@ -48,39 +214,452 @@ namespace jcodec{
 
     int MjpegWriter::Close()
     {
-        if (outFile == 0) return -1;
+        if (!isOpen) return -1;
+        StopPipeline();
+        if (segmented)
+            StopSegments();
+        int result;
         if (FrameNum == 0)
         {
-            remove(outfileName);
-            isOpen = false;
-            if (fclose(outFile))
-                return -2;
-            return 1;
+            stage.close();
+            result = outSink->close() ? 1 : -2;
+            remove(segmented ? segName.c_str() : outfileName);
         }
-        printf("encoding time per frame = %.1fms\n", tencoding * 1000 / FrameNum / getTickFrequency());
-        EndWriteChunk(); // end LIST 'movi'
-        WriteIndex();
-        FinishWriteAVI();
-        if (fclose(outFile))
-            return -1;
+        else
+        {
+            unsigned long long io = stage.io_cycles();
+            FinishSegment();
+            bool staged = stage.close();
+            unsigned long long t = read_cycles();
+            bool closed = outSink->close(); // waits for the sink's writes in flight
+            stageCycles[STAGE_FILE_IO] += stage.io_cycles() - io + read_cycles() - t;
+            result = staged && closed ? 1 : -1;
+            if (segmented && segDone)
+                segDone(segName.c_str(), result);
+        }
+        outSink = 0;
         isOpen = false;
         FrameNum = 0;
+        if (segmented)
+        {
+            FreeSegmentSinks();
+            if ((segFailed || segNextFailed) && (result > 0))
+                result = -1;
+        }
+        return result;
+    }
+
+    // Segment file names: name itself if it has one %d conversion (flags and width allowed), otherwise
+    // name with "_%04d" before its extension. false for any other use of '%'.
+    static bool segment_pattern(const char *name, string &pattern)
+    {
+        string s(name);
+        size_t pct = s.find('%');
+        if (pct == string::npos)
+        {
+            size_t slash = s.find_last_of("/\\"), dot = s.rfind('.');
+            if ((dot == string::npos) || ((slash != string::npos) && (dot < slash)))
+                dot = s.size();
+            pattern = s.substr(0, dot) + "_%04d" + s.substr(dot);
+            return true;
+        }
+        size_t end = s.find_first_not_of("-+ #0123456789", pct + 1);
+        if ((end == string::npos) || (s[end] != 'd') || (s.find('%', end) != string::npos))
+            return false;
+        pattern = s;
+        return true;
+    }
+
+    // Open of a segmented recording: the name pattern, sinks for the current, the next and the closing
+    // segment, the second staging buffer and the file of segment 0. The segment thread starts once the
+    // file is set up.
+    int MjpegWriter::OpenSegments(const char *outfile)
+    {
+        if (!segment_pattern(outfile, segPattern))
+            return -5;
+        const file_sink *base = sink ? sink : &stdioSink;
+        for (int i = 0; i < 3; i++)
+        {
+            file_sink *s = base->clone();
+            if (!s)
+            {
+                FreeSegmentSinks();
+                return -5;
+            }
+            segSinks.push_back(s);
+        }
+        segSpare = segSinks;
+        if (!closingStage.open(0, 0, STAGE_BUFFER_SIZE))
+        {
+            FreeSegmentSinks();
+            return -1;
+        }
+        segIndex = 0;
+        segName = SegmentName(0);
+        segNextSink = segClosingSink = 0;
+        segStop = segFailed = segNextFailed = false;
+        outSink = segSpare.back();
+        segSpare.pop_back();
+        if (!outSink->open(segName.c_str()))
+        {
+            outSink = 0;
+            FreeSegmentSinks();
+            return -1;
+        }
         return 1;
     }
 
+    string MjpegWriter::SegmentName(int index)
+    {
+        vector<char> name(segPattern.size() + 32);
+        snprintf(&name[0], name.size(), segPattern.c_str(), index);
+        return string(&name[0]);
+    }
+
+    // Segment thread: opens the file of the next segment whenever none is waiting, and writes out and
+    // closes the previous segment after a switch.
+    void MjpegWriter::SegmentLoop()
+    {
+        std::unique_lock<std::mutex> lock(segMutex);
+        for (;;)
+        {
+            if (!segNextSink && !segNextFailed && !segStop)
+            {
+                file_sink *s = segSpare.back();
+                segSpare.pop_back();
+                string name = SegmentName(segIndex + 1);
+                lock.unlock();
+                bool opened = s->open(name.c_str());
+                lock.lock();
+                if (opened)
+                {
+                    segNextSink = s;
+                    segNextName = name;
+                }
+                else
+                {
+                    segSpare.push_back(s);
+                    segNextFailed = true;
+                }
+                segCond.notify_all();
+            }
+            else if (segClosingSink)
+            {
+                // set by NextSegment, which waits for it to be cleared before the next switch
+                lock.unlock();
+                bool staged = closingStage.close();
+                bool closed = segClosingSink->close();
+                if (segDone)
+                    segDone(segClosingName.c_str(), staged && closed ? 1 : -1);
+                lock.lock();
+                segFailed = segFailed || !staged || !closed;
+                segSpare.push_back(segClosingSink);
+                segClosingSink = 0;
+                segCond.notify_all();
+            }
+            else if (segStop)
+                break;
+            else
+                segCond.wait(lock);
+        }
+    }
+
+    // The next frame starts a new segment (called with a frame written at least).
+    bool MjpegWriter::SegmentFull()
+    {
+        return FrameNum && (((segFrameLimit > 0) && (FrameNum >= segFrameLimit)) || ((segMaxBytes > 0) && (stage.tell() >= segMaxBytes)));
+    }
+
+    // Switches to the file the segment thread opened ahead, at a frame boundary, on the thread that writes
+    // the frames. The finished segment's index and header counts go into its staging buffer, which is swapped
+    // for the spare one and written out and closed by the segment thread while the new segment fills up.
+    // Nothing of it is written here: the buffer is held (staging_stream::hold) and grows to take the index,
+    // 24 bytes a frame in the first RIFF and 8 in the others.
+    void MjpegWriter::NextSegment()
+    {
+        std::unique_lock<std::mutex> lock(segMutex);
+        // The one wait of the frame path: a segment filled up before the previous one was written out and
+        // closed, or before the next file was opened, i.e. the disk does not keep up with the frames. More
+        // closing buffers would only take memory until the disk stalls the frames all the same.
+        while (segClosingSink || (!segNextSink && !segNextFailed))
+            segCond.wait(lock);
+        if (!segNextSink)
+            return; // the next file could not be opened: the segment goes on and Close reports the failure
+        lock.unlock();
+        stage.hold();
+        FinishSegment();
+        lock.lock();
+        stage.swap(closingStage);
+        segClosingSink = outSink;
+        segClosingName = segName;
+        outSink = segNextSink;
+        segName = segNextName;
+        segNextSink = 0;
+        segIndex++;
+        segCond.notify_all();
+        lock.unlock();
+        stage.open(outSink, 0, STAGE_BUFFER_SIZE); // cannot fail: the buffer is reused
+        StartFile();
+    }
+
+    // Close: lets the segment thread finish closing the previous segment, then drops the file it opened ahead.
+    void MjpegWriter::StopSegments()
+    {
+        {
+            std::lock_guard<std::mutex> lock(segMutex);
+            segStop = true;
+        }
+        segCond.notify_all();
+        segThread.join();
+        if (segNextSink)
+        {
+            segNextSink->close();
+            remove(segNextName.c_str());
+            segNextSink = 0;
+        }
+    }
+
+    void MjpegWriter::FreeSegmentSinks()
+    {
+        for (size_t i = 0; i < segSinks.size(); i++)
+            delete segSinks[i];
+        segSinks.clear();
+        segSpare.clear();
+    }
+
     int MjpegWriter::Write(const Mat & Im)
+    {
+        return Write(Im, Rect(0, 0, Im.cols, Im.rows));
+    }
+
+    int MjpegWriter::Write(const Mat & Im, const Rect & roi)
+    {
+        if (!isOpen) return -1;
+        int format = ImageFormat(Im, roi);
+        if (format < 0)
+            return format;
+        // no copy: the ROI header keeps the parent's row stride
+        return WriteImage(Im(roi), format);
+    }
+
+    int MjpegWriter::Write(const Mat & Im, pixel_format_t format)
     {
         if (!isOpen) return -1;
-        if(!WriteFrame(Im))
+        if (!MatchesFormat(Im, format))
+            return -3;
+        return WriteImage(Im, format);
+    }
+
+    std::future<int> MjpegWriter::WriteAsync(const Mat & Im, const write_callback &done)
+    {
+        return WriteAsyncImage(Im, isOpen ? ImageFormat(Im, Rect(0, 0, Im.cols, Im.rows)) : -1, done);
+    }
+
+    std::future<int> MjpegWriter::WriteAsync(const Mat & Im, pixel_format_t format, const write_callback &done)
+    {
+        return WriteAsyncImage(Im, !isOpen ? -1 : MatchesFormat(Im, format) ? format : -3, done);
+    }
+
+    // Packed layout of Im for Write(Im, roi), or -3 if Im or roi do not fit the stream.
+    int MjpegWriter::ImageFormat(const Mat & Im, const Rect & roi)
+    {
+        int format = Im.channels() == 4 ? PF_BGRA : Im.channels() == 3 ? PF_BGR : PF_GRAY;
+        if (Im.depth() == CV_16U)
+            format |= PF_16BIT;
+        if (((Im.depth() != CV_8U) && (Im.depth() != CV_16U)) || (Im.channels() == 2) || (Im.channels() > 4) ||
+            (roi.width != width) || (roi.height != height) ||
+            (roi.x < 0) || (roi.y < 0) || (roi.x + roi.width > Im.cols) || (roi.y + roi.height > Im.rows))
+            return -3;
+        return format;
+    }
+
+    bool MjpegWriter::MatchesFormat(const Mat & Im, pixel_format_t format)
+    {
+        int type = CV_8UC1, rows = height;
+        switch (format)
+        {
+        case PF_GRAY: break;
+        case PF_BGR: type = CV_8UC3; break;
+        case PF_BGRA: case PF_RGBA: type = CV_8UC4; break;
+        case PF_GRAY16: type = CV_16UC1; break;
+        case PF_BGR16: type = CV_16UC3; break;
+        case PF_BGRA16: case PF_RGBA16: type = CV_16UC4; break;
+        case PF_YUYV: type = CV_8UC2; break;
+        case PF_I420:
+        case PF_NV12: rows = height * 3 / 2; break;
+        default: return false;
+        }
+        return (Im.type() == type) && (Im.cols == width) && (Im.rows == rows) && ((format != PF_I420) || Im.isContinuous());
+    }
+
+    static void complete_async(std::promise<int> &result, const write_callback &done, int code)
+    {
+        result.set_value(code);
+        if (done)
+            done(code);
+    }
+
+    std::future<int> MjpegWriter::WriteAsyncImage(const Mat & Im, int format, const write_callback &done)
+    {
+        std::promise<int> result;
+        std::future<int> f = result.get_future();
+        int r = format < 0 ? format : WriteImage(Im, format, &result, &done);
+        if (r != 1) // not queued, the promise is still here
+            complete_async(result, done, r);
+        return f;
+    }
+
+    // Queues frame in pipelined mode, or encodes and writes it right away. Asynchronous frames (result set)
+    // always go through the pipeline and take result and done along when queued (return value 1).
+    // Returns 0 if the frame was dropped.
+    int MjpegWriter::WriteImage(const Mat & frame, int format, std::promise<int> *result, const write_callback *done)
+    {
+        if (workers.empty() && !openRecorder)
+        {
+            if (!result)
+            {
+                if (!WriteFrame(frame, format))
+                    return -2;
+                return 1;
+            }
+            StartWorkers(1);
+        }
+
+        // Recorder mode: the slot comes out of the recorder's memory budget (no jobsMutex held,
+        // the recorder's threads need it to finish the frames that free slots)
+        FrameJob *slot = 0;
+        int64 stall = 0;
+        if (openRecorder)
+            slot = openRecorder->AcquireSlot(this, frame.total() * frame.elemSize() + std::max(width * height * 3, 1024),
+                queuePolicy == QUEUE_BLOCK, stall);
+
+        std::unique_lock<std::mutex> lock(jobsMutex);
+        if (stall && statsEnabled)
+            stats.io_stall_ms += stall * 1000. / getTickFrequency();
+        if ((queuePolicy == QUEUE_BLOCK) && !openRecorder)
+        {
+            if (freeJobs.empty() && statsEnabled)
+            {
+                int64 t = getTickCount();
+                while (freeJobs.empty() && !pipelineFailed)
+                    jobWritten.wait(lock);
+                stats.io_stall_ms += (getTickCount() - t) * 1000. / getTickFrequency();
+            }
+            while (freeJobs.empty() && !pipelineFailed)
+                jobWritten.wait(lock);
+        }
+        if (pipelineFailed)
+        {
+            if (slot)
+                openRecorder->ReleaseSlot(this, slot);
             return -2;
+        }
+        FrameJob *job;
+        std::promise<int> droppedResult;
+        write_callback droppedDone;
+        bool droppedAsync = false, replacesQueued = false;
+        if (slot)
+            job = slot;
+        else if (!freeJobs.empty())
+        {
+            job = freeJobs.front();
+            freeJobs.pop_front();
+        }
+        else if ((queuePolicy == QUEUE_DROP_OLDEST) && (job = DropJob()))
+        {
+            // its result is delivered once the new frame is queued, outside the lock
+            droppedOldest++;
+            replacesQueued = job->state == 0;
+            if ((droppedAsync = job->async))
+            {
+                droppedResult = std::move(job->result);
+                droppedDone.swap(job->done);
+                job->frame.release();
+            }
+            jobEncoded.notify_all(); // the writer may have been waiting for the dropped head
+        }
+        else
+        {
+            droppedNewest++;
+            return 0;
+        }
+        job->format = format;
+        job->async = result != 0;
+        if (result)
+        {
+            // WriteAsync: the frame is referenced, not copied
+            job->frame = frame;
+            job->result = std::move(*result);
+            job->done = *done;
+        }
+        else
+        {
+            lock.unlock();
+            // The caller may reuse its buffer as soon as Write returns, so the frame is copied
+            // into the job (the job's Mat is reused once it has the right size).
+            frame.copyTo(job->frame);
+            lock.lock();
+        }
+
+        job->state = 0;
+        jobs.push_back(job);
+        if (statsEnabled)
+            stats.queue_depth_max = std::max(stats.queue_depth_max, (int)jobs.size());
+        jobQueued.notify_one();
+        lock.unlock();
+        if (openRecorder && !replacesQueued) // a dropped queued frame was already announced
+            openRecorder->FrameQueued(this);
+        if (droppedAsync)
+            complete_async(droppedResult, droppedDone, 0);
         return 1;
     }
 
+    // Takes the oldest frame that no thread is working on out of the queue (jobsMutex held); 0 if there is none.
+    MjpegWriter::FrameJob *MjpegWriter::DropJob()
+    {
+        for (std::deque<FrameJob*>::iterator it = jobs.begin(); it != jobs.end(); ++it)
+            if (((*it)->state == 0) || ((*it)->state == 2))
+            {
+                FrameJob *job = *it;
+                jobs.erase(it);
+                return job;
+            }
+        return 0;
+    }
+
     bool MjpegWriter::isOpened()
     {
         return isOpen;
     }
 
+    // Headers of a new file (or segment) in the freshly opened staging buffer.
+    void MjpegWriter::StartFile()
+    {
+        riffNum = 0;
+        riffPointer = 0;
+        firstRiffFrames = 0;
+        indxEntries = riffIndxBase = 0;
+        ixFrames = 0;
+        FrameNum = 0;
+        rateWindow.clear();
+        rateWindowBytes = maxBytesPerSec = 0;
+        StartWriteAVI();
+        WriteStreamHeader();
+        // The whole file is built in the staging buffer; the header region up to the 'movi'
+        // list is also kept aside, so its counters are patched with one write at Close.
+        stage.keep_head((size_t)stage.tell());
+    }
+
+    // Ends the file (or segment): the index of the last RIFF, idx1 and the header counts.
+    void MjpegWriter::FinishSegment()
+    {
+        EndRiff();
+        FinishWriteAVI();
+        if (!maxBytesPerSec) // less than a second of frames
+            maxBytesPerSec = rateWindowBytes * outfps / (long long)rateWindow.size();
+        stage.patch(maxBytesPerSecPos, (int)std::min(maxBytesPerSec, (long long)INT_MAX));
+    }
+
     void MjpegWriter::StartWriteAVI()
     {
         StartWriteChunk(fourCC('R', 'I', 'F', 'F'));
@@ -90,10 +669,11 @@ namespace jcodec{
         PutInt(fourCC('a', 'v', 'i', 'h'));
         PutInt(AVIH_STRH_SIZE);
         PutInt((int)(NUM_MICROSEC_PER_SEC / outfps));
-        PutInt(MAX_BYTES_PER_SEC);
+        maxBytesPerSecPos = stage.tell();
+        PutInt(0);                                  // dwMaxBytesPerSec, measured by Close
         PutInt(0);
         PutInt(AVI_DWFLAG);
-        FrameNumIndexes.push_back(ftell(outFile));
+        FrameNumIndexes.push_back((int)stage.tell());
         PutInt(0);
         PutInt(0);
         PutInt(STREAMS);
@@ -121,7 +701,7 @@ namespace jcodec{
         PutInt(AVI_DWSCALE);
         PutInt(outfps);
         PutInt(0);
-        FrameNumIndexes.push_back(ftell(outFile));
+        FrameNumIndexes.push_back((int)stage.tell());
         PutInt(0);
         PutInt(SUG_BUFFER_SIZE);
         PutInt(AVI_DWQUALITY);
@@ -143,15 +723,28 @@ namespace jcodec{
         PutInt(0);
         PutInt(0);
         PutInt(0);
-        // Must be indx chunk
         EndWriteChunk(); // end strf
+
+        // OpenDML super index, one entry per 'ix00' chunk; the slots are reserved up front
+        StartWriteChunk(fourCC('i', 'n', 'd', 'x'));
+        PutShort(4);                                // wLongsPerEntry
+        PutShort(AVI_INDEX_OF_INDEXES << 8);        // bIndexSubType, bIndexType
+        indxPointer = stage.tell();
+        PutInt(0);                                  // nEntriesInUse
+        PutInt(fourCC('0', '0', 'd', 'c'));
+        PutInt(0);
+        PutInt(0);
+        PutInt(0);
+        vector<uchar> slots(ODML_INDX_ENTRIES * 16);
+        stage.put_buf(&slots[0], (int)slots.size());
+        EndWriteChunk(); // end indx
         EndWriteChunk(); // end strl
 
         // odml
         StartWriteChunk(fourCC('L', 'I', 'S', 'T'));
         PutInt(fourCC('o', 'd', 'm', 'l'));
         StartWriteChunk(fourCC('d', 'm', 'l', 'h'));
-        FrameNumIndexes.push_back(ftell(outFile));
+        FrameNumIndexes.push_back((int)stage.tell());
         PutInt(0);
         PutInt(0);
         EndWriteChunk(); // end dmlh
@@ -159,127 +752,1238 @@ namespace jcodec{
 
         EndWriteChunk(); // end hdrl
 
-        // JUNK
+        // JUNK up to the next JUNK_SEEK boundary
         StartWriteChunk(fourCC('J', 'U', 'N', 'K'));
-        fseek(outFile, JUNK_SEEK, SEEK_SET);
+        vector<uchar> junk((size_t)((stage.tell() + JUNK_SEEK - 1) / JUNK_SEEK * JUNK_SEEK - stage.tell()));
+        if (!junk.empty())
+            stage.put_buf(&junk[0], (int)junk.size());
         EndWriteChunk(); // end JUNK
         // movi
         StartWriteChunk(fourCC('L', 'I', 'S', 'T'));
-        moviPointer = ftell(outFile);
+        moviPointer = stage.tell();
         PutInt(fourCC('m', 'o', 'v', 'i'));
     }
-    
-    bool MjpegWriter::WriteFrame(const Mat & Im)
-    {
-        chunkPointer = ftell(outFile);
-        StartWriteChunk(fourCC('0', '0', 'd', 'c'));
-        // Frame data
-        void *pBuf = 0;
-        int pBufSize;
-        double t = (double)getTickCount();
-        if ((pBufSize = toJPGframe(Im.data, width, height, 12, pBuf)) < 0)
-            return false;
-        tencoding += (double)getTickCount() - t;
-        fwrite(pBuf, pBufSize, 1, outFile);
-        FrameOffset.push_back(chunkPointer - moviPointer);
-        FrameSize.push_back(ftell(outFile) - chunkPointer - 8);       // Size excludes '00dc' and size field
-        FrameNum++;
-        EndWriteChunk(); // end '00dc'
-        free(pBuf);
-        return true;
-    }
 
-    void MjpegWriter::WriteIndex()
+    // Closes the current RIFF: its 'ix00' goes at the end of the 'movi' list, and the first
+    // RIFF also gets the legacy idx1 for AVI 1.0 readers.
+    void MjpegWriter::EndRiff()
     {
-        // old style AVI index. Must be Open-DML index
-        StartWriteChunk(fourCC('i', 'd', 'x', '1'));
-        for (int i = 0; i < FrameNum; i++)
+        WriteODMLIndex(true);
+        EndWriteChunk(); // end LIST 'movi'
+        if (riffNum == 0)
         {
-            PutInt(fourCC('0', '0', 'd', 'c'));
-            PutInt(AVIIF_KEYFRAME);
-            PutInt(FrameOffset[i]);
-            PutInt(FrameSize[i]);
+            WriteIndex();
+            firstRiffFrames = (int)FrameSize.size();
         }
-        EndWriteChunk(); // End idx1
+        EndWriteChunk(); // end RIFF
+        FrameOffset.clear();
+        FrameSize.clear();
+        ixFrames = 0;
     }
 
-    void MjpegWriter::WriteODMLIndex()
+    void MjpegWriter::StartRiff()
     {
-        StartWriteChunk(fourCC('i', 'n', 'd', 'x'));
-        for (int i = 0; i < FrameNum; i++)
-        {
+        riffNum++;
+        riffPointer = stage.tell();
+        riffIndxBase = indxEntries;
+        StartWriteChunk(fourCC('R', 'I', 'F', 'F'));
+        PutInt(fourCC('A', 'V', 'I', 'X'));
+        StartWriteChunk(fourCC('L', 'I', 'S', 'T'));
+        moviPointer = stage.tell();
+        PutInt(fourCC('m', 'o', 'v', 'i'));
+    }
 
+    void MjpegWriter::StartFrameChunk()
+    {
+        if (segmented && SegmentFull())
+            NextSegment();
+        if (stage.tell() - riffPointer >= riffLimit)
+        {
+            EndRiff();
+            StartRiff();
         }
-        EndWriteChunk(); // End indx
+        chunkPointer = stage.tell();
+        stage.start_chunk(fourCC('0', '0', 'd', 'c'));
     }
 
-    void MjpegWriter::FinishWriteAVI()
+    void MjpegWriter::EndFrameChunk()
     {
-        // Record frames numbers to AVI Header
-        long curPointer = ftell(outFile);
-        while (!FrameNumIndexes.empty())
+        FrameOffset.push_back(chunkPointer);
+        FrameSize.push_back(stage.end_chunk());
+        TrackRate(FrameSize.back() + 8);
+        FrameNum++;
+        if (ckptFrames && !(FrameNum % ckptFrames))
+            Checkpoint();
+    }
+
+    // Peak data rate: the most bytes of any outfps consecutive frame chunks
+    void MjpegWriter::TrackRate(int size)
+    {
+        rateWindow.push_back(size);
+        rateWindowBytes += size;
+        if ((int)rateWindow.size() > outfps)
         {
-            fseek(outFile, FrameNumIndexes.back(), SEEK_SET);
-            PutInt(FrameNum);
-            FrameNumIndexes.pop_back();
+            rateWindowBytes -= rateWindow.front();
+            rateWindow.pop_front();
         }
-        fseek(outFile, curPointer, SEEK_SET);
-        EndWriteChunk(); // end RIFF
+        if ((int)rateWindow.size() == outfps)
+            maxBytesPerSec = std::max(maxBytesPerSec, rateWindowBytes);
     }
 
-    void MjpegWriter::PutInt(int elem)
+    // Quantization scale for the next frame, 0 without rate control (jobsMutex held)
+    int MjpegWriter::RateScale()
     {
-        fwrite(&elem, 1, sizeof(elem), outFile);
+        if (!rcBitrate && !rcMaxFrameBytes)
+            return 0;
+        return std::min(std::max((int)(rcScale + 0.5), 1), RC_MAX_SCALE);
     }
 
-    void MjpegWriter::PutShort(short elem)
+    // Scale to code a frame of size bytes at scale again so it fits max_bytes, 0 if it cannot get coarser.
+    // Size ~ scale^-a: a is measured from the previous attempt (prev_scale, prev_size) if there was one,
+    // otherwise guessed at 0.5. Content with little detail has a small a (headers and DC terms hardly
+    // shrink), so it is floored at 0.15 and the step overshoots by 5% rather than spend another encode.
+    static int CapRetryScale(int scale, int size, int max_bytes, int prev_scale, int prev_size)
     {
-        fwrite(&elem, 1, sizeof(elem), outFile);
+        if (scale >= RC_MAX_SCALE)
+            return 0;
+        double a = 0.5;
+        if (prev_scale && (prev_scale != scale) && (prev_size > size))
+            a = std::max(log((double)prev_size / size) / log((double)scale / prev_scale), 0.15);
+        double next = scale * pow((double)size / max_bytes, 1 / a) * 1.05 + 1;
+        return next < RC_MAX_SCALE ? (int)next : RC_MAX_SCALE;
     }
 
-    void MjpegWriter::StartWriteChunk(int fourcc)
+    // Feeds the final size of a frame coded at scale back into the rate control (jobsMutex held)
+    void MjpegWriter::RateUpdate(int scale, int size, bool reencoded)
     {
-        long fpos;
-        if (fourcc != 0)
+        if (!scale)
+            return;
+        if (reencoded && statsEnabled)
+            stats.reencoded++;
+        double next = rcScale;
+        if (rcBitrate)
         {
-            PutInt(fourcc);
-            fpos = ftell(outFile);
-            PutInt(0);
+            // aim the next frame at the per-frame budget, less a second's share of the bytes overspent
+            const double budget = rcBitrate / 8.0 / outfps;
+            rcDebt += size - budget;
+            double aim = std::min(std::max(budget - rcDebt / outfps, budget / 4), budget * 2);
+            next = scale * std::min(std::max(pow(size / aim, 0.75), 0.5), 2.0);
         }
         else
         {
-            fpos = ftell(outFile);
-            PutInt(0);
+            // cap only: aim at 90% of the cap so most frames fit the first time, but never finer
+            // than the quality asks for
+            const double base = encParams.quant_scale();
+            next = std::max(base, scale * std::min(std::max(pow(size / (0.9 * rcMaxFrameBytes), 0.75), 0.5), 2.0));
         }
-        AVIChunkSizeIndex.push_back((int)fpos);
+        if (rcMaxFrameBytes && reencoded)
+            next = std::max(next, (double)scale);
+        rcScale = std::min(std::max(next, 1.0), (double)RC_MAX_SCALE);
     }
-
-    void MjpegWriter::EndWriteChunk()
+    
+    bool MjpegWriter::WriteFrame(const Mat & Im, int format)
     {
-        if (!AVIChunkSizeIndex.empty())
+        // encode straight into the staging buffer, behind the chunk header
+        StartFrameChunk();
+        const bool timed = statsEnabled;
+        int64 t = timed ? getTickCount() : 0;
+        unsigned long long io = stage.io_cycles();
+        params p = encParams;
+        p.m_huff_stats_flag = HuffSampleFrame();
         {
-            long curPointer = ftell(outFile);
-            fseek(outFile, AVIChunkSizeIndex.back(), SEEK_SET);
-            int size = (int)(curPointer - (AVIChunkSizeIndex.back() + 4));
-            PutInt(size);
-            fseek(outFile, curPointer, SEEK_SET);
-            AVIChunkSizeIndex.pop_back();
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            p.m_quant_scale = RateScale();
+        }
+        HuffUpdateTables(*encoder, encoderHuffVersion);
+        bool reencoded = false;
+        for (int attempt = 0, prev_scale = 0, prev_size = 0; ; attempt++)
+        {
+            if (!encoder->compress_image(&stage, width, height, format, Im.data, p, (int)Im.step))
+            {
+                stage.cancel_chunk();
+                return false;
+            }
+            int size = (int)(stage.tell() - chunkPointer) - 8, scale = 0;
+            if (!rcMaxFrameBytes || (size <= rcMaxFrameBytes) || (attempt == RC_MAX_RETRIES) ||
+                !(scale = CapRetryScale(p.m_quant_scale, size, rcMaxFrameBytes, prev_scale, prev_size)))
+                break;
+            // over the cap: drop the frame from the staging buffer and code it again
+            stage.cancel_chunk();
+            stage.start_chunk(fourCC('0', '0', 'd', 'c'));
+            prev_scale = p.m_quant_scale;
+            prev_size = size;
+            p.m_quant_scale = scale;
+            reencoded = true;
         }
+        if (p.m_huff_stats_flag)
+            HuffAddSample(*encoder);
+        if (timed)
+            t = getTickCount() - t;
+        EndFrameChunk();
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        AddStageCycles(*encoder, stage.io_cycles() - io);
+        RateUpdate(p.m_quant_scale, FrameSize.back(), reencoded);
+        if (timed)
+            AddFrameStats((double)t, FrameSize.back());
+        return true;
     }
 
-    int MjpegWriter::toJPGframe(const uchar * data, uint width, uint height, int step, void *& pBuf)
+    // Adds a frame encoded in ticks to size bytes to the statistics (jobsMutex held).
+    void MjpegWriter::AddFrameStats(double ticks, int size)
     {
-        const int req_comps = 3; // request BGR image, if (BGRA) req_comps = 4; 
-        params param;
-        param.m_quality = quality;
-        param.m_subsampling = H2V2;
-        int buf_size = width * height * 3; // allocate a buffer that's hopefully big enough (this is way overkill for jpeg)
-        if (buf_size < 1024) buf_size = 1024;
-        pBuf = malloc(buf_size);
-        jpeg_encoder dst_image;
-        if (!dst_image.compress_image_to_jpeg_file_in_memory(pBuf, buf_size, width, height, req_comps, data, param))
-            return -1;
-        return buf_size;
+        const double us = ticks * 1e6 / getTickFrequency();
+        int bucket = 0;
+        while ((bucket < writer_stats::LATENCY_BUCKETS - 1) && (us >= (double)(2LL << bucket)))
+            bucket++;
+        stats.latency_hist[bucket]++;
+        stats.latency_avg_ms += (us / 1000 - stats.latency_avg_ms) / (double)(stats.frames + 1);
+        stats.latency_max_ms = std::max(stats.latency_max_ms, us / 1000);
+        stats.frames++;
+        stats.bytes += size;
+        stats.last_frame_bytes = size;
+        stats.bits_per_pixel = stats.bytes * 8.0 / ((double)stats.frames * width * height);
+    }
+
+    void MjpegWriter::EnableStats(bool enable)
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        if (enable && !statsEnabled)
+            stats = writer_stats();
+        statsEnabled = enable;
+    }
+
+    void MjpegWriter::GetStats(writer_stats &s)
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        s = stats;
+        memcpy(s.stage_cycles, stageCycles, sizeof(stageCycles));
+        s.queue_depth = (int)jobs.size();
+        s.dropped_oldest = droppedOldest;
+        s.dropped_newest = droppedNewest;
+        s.quant_scale = RateScale() ? RateScale() : encParams.quant_scale();
+    }
+
+    // Moves the stage cycles of enc into stageCycles (jobsMutex held). io cycles of staging buffer
+    // flushes made while enc wrote into it are file I/O, not entropy coding.
+    void MjpegWriter::AddStageCycles(jpeg_encoder &enc, unsigned long long io)
+    {
+        const unsigned long long *pCycles = enc.get_stage_cycles();
+        for (int i = 0; i < STAGE_COUNT; i++)
+            stageCycles[i] += pCycles[i];
+        if (encParams.m_stage_timing_flag)
+            stageCycles[STAGE_ENTROPY] -= std::min(io, pCycles[STAGE_ENTROPY]);
+        stageCycles[STAGE_FILE_IO] += io;
+        enc.reset_stage_cycles();
+    }
+
+    void MjpegWriter::GetStageCycles(unsigned long long cycles[STAGE_COUNT])
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        memcpy(cycles, stageCycles, sizeof(stageCycles));
+    }
+
+    bool MjpegWriter::HuffSampleFrame()
+    {
+        if ((huffFrames == 0) || (!huffRolling && (huffPicked >= huffFrames)))
+            return false;
+        huffPicked++;
+        return true;
+    }
+
+    // Halves the counts of every table of counts (a symbol seen keeps 1 at least) until it totals less than limit.
+    static void scale_huffman_counts(huffman_counts &counts, unsigned long long limit)
+    {
+        for (int t = 0; t < 4; t++)
+        {
+            for (;;)
+            {
+                unsigned long long total = 0;
+                for (int i = 0; i < 256; i++)
+                    total += counts.m_count[t][i];
+                if (total < limit)
+                    break;
+                for (int i = 0; i < 256; i++)
+                    if (counts.m_count[t][i])
+                        counts.m_count[t][i] = std::max(counts.m_count[t][i] >> 1, 1U);
+            }
+        }
+    }
+
+    void MjpegWriter::HuffAddSample(const jpeg_encoder &enc)
+    {
+        enc.add_huffman_counts(huffCounts);
+        // the sums over many large frames must not wrap
+        scale_huffman_counts(huffCounts, 1ULL << 31);
+        if (++huffSampled < huffFrames)
+            return;
+        // enough statistics: publish a new table set, the encoders pick it up before their next frame. Few
+        // enough symbols keep the code lengths optimize_huffman_table builds within MAX_HUFF_CODESIZE.
+        huffTables = huffCounts;
+        scale_huffman_counts(huffTables, HUFF_COUNT_LIMIT);
+        huffVersion++;
+        huffSampled = 0;
+        huffCounts = huffman_counts();
+    }
+
+    void MjpegWriter::HuffUpdateTables(jpeg_encoder &enc, int &version)
+    {
+        if (version == huffVersion)
+            return;
+        enc.set_huffman_tables(huffVersion ? &huffTables : 0);
+        version = huffVersion;
+    }
+
+    void MjpegWriter::WriteFrameData(const void *pBuf, int pBufSize)
+    {
+        StartFrameChunk();
+        stage.put_buf(pBuf, pBufSize);
+        EndFrameChunk();
+    }
+
+    // Recorder mode: the stream's encoders, reused by whichever thread picks one.
+    struct MjpegWriter::PoolEncoder
+    {
+        PoolEncoder() : huffVersion(0) { }
+        jpeg_encoder enc;
+        int huffVersion;
+    };
+
+    void MjpegWriter::StartPipeline()
+    {
+        stopPipeline = false;
+        pipelineFailed = false;
+        if (recorder)
+        {
+            openRecorder = recorder;
+            openRecorder->AddStream(this, recorderPriority);
+        }
+        else if (nThreads != 1)
+            StartWorkers(nThreads > 0 ? nThreads : getNumberOfCPUs());
+    }
+
+    void MjpegWriter::StartWorkers(int n)
+    {
+        // two frames in flight per worker keep the workers busy while the writer drains the head
+        int slots = queueFrames > 0 ? queueFrames : 2 * n;
+        for (int i = 0; i < slots; i++)
+            freeJobs.push_back(new FrameJob());
+        for (int i = 0; i < n; i++)
+            workers.push_back(std::thread(&MjpegWriter::EncodeLoop, this));
+        writer = std::thread(&MjpegWriter::WriteLoop, this);
+    }
+
+    void MjpegWriter::StopPipeline()
+    {
+        if (openRecorder)
+        {
+            {
+                std::unique_lock<std::mutex> lock(jobsMutex);
+                while (!jobs.empty())
+                    jobWritten.wait(lock);
+            }
+            openRecorder->RemoveStream(this);
+            openRecorder = 0;
+            while (!idleEncoders.empty())
+            {
+                delete idleEncoders.front();
+                idleEncoders.pop_front();
+            }
+            return;
+        }
+        if (workers.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            stopPipeline = true;
+        }
+        jobQueued.notify_all();
+        jobEncoded.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        writer.join();
+        workers.clear();
+        while (!freeJobs.empty())
+        {
+            delete freeJobs.front();
+            freeJobs.pop_front();
+        }
+    }
+
+    void MjpegWriter::EncodeLoop()
+    {
+        jpeg_encoder enc;
+        int huffVersionUsed = 0;
+        std::unique_lock<std::mutex> lock(jobsMutex);
+        for (;;)
+        {
+            FrameJob *job = NextQueuedJob();
+            if (!job)
+            {
+                if (stopPipeline)
+                    break;
+                jobQueued.wait(lock);
+                continue;
+            }
+            EncodeJob(job, enc, huffVersionUsed, lock);
+            jobEncoded.notify_all();
+        }
+    }
+
+    // Oldest frame waiting for an encoder (jobsMutex held), or 0.
+    MjpegWriter::FrameJob *MjpegWriter::NextQueuedJob()
+    {
+        for (size_t i = 0; i < jobs.size(); i++)
+            if (jobs[i]->state == 0)
+                return jobs[i];
+        return 0;
+    }
+
+    // Encodes job with enc, which has loaded the shared Huffman tables of version huffVersion.
+    // lock holds jobsMutex, except while encoding.
+    void MjpegWriter::EncodeJob(FrameJob *job, jpeg_encoder &enc, int &huffVersion, std::unique_lock<std::mutex> &lock)
+    {
+        params p = encParams;
+        job->state = 1;
+        p.m_huff_stats_flag = HuffSampleFrame();
+        p.m_quant_scale = RateScale();
+        HuffUpdateTables(enc, huffVersion);
+        lock.unlock();
+
+        const bool timed = statsEnabled;
+        int64 t = timed ? getTickCount() : 0;
+        int size = toJPGframe(enc, job->frame.data, width, height, job->format, (int)job->frame.step, p, job->buf);
+        bool reencoded = false;
+        for (int attempt = 0, scale, prev_scale = 0, prev_size = 0; (size > rcMaxFrameBytes) && rcMaxFrameBytes &&
+            (attempt < RC_MAX_RETRIES) && (scale = CapRetryScale(p.m_quant_scale, size, rcMaxFrameBytes, prev_scale, prev_size)); attempt++)
+        {
+            prev_scale = p.m_quant_scale;
+            prev_size = size;
+            p.m_quant_scale = scale;
+            reencoded = true;
+            size = toJPGframe(enc, job->frame.data, width, height, job->format, (int)job->frame.step, p, job->buf);
+        }
+        if (timed)
+            t = getTickCount() - t;
+
+        lock.lock();
+        if ((size >= 0) && p.m_huff_stats_flag)
+            HuffAddSample(enc);
+        AddStageCycles(enc, 0);
+        if (size >= 0)
+            RateUpdate(p.m_quant_scale, size, reencoded);
+        if (timed && (size >= 0))
+            AddFrameStats((double)t, size);
+        job->size = size;
+        job->state = size < 0 ? -1 : 2;
+    }
+
+    // Recorder thread: encodes the oldest queued frame, then writes the encoded frames at the head
+    // of the queue unless another thread is already at it. Returns false if no frame was queued.
+    bool MjpegWriter::EncodeQueued()
+    {
+        std::unique_lock<std::mutex> lock(jobsMutex);
+        FrameJob *job = NextQueuedJob();
+        if (!job)
+            return false;
+        PoolEncoder *e;
+        if (idleEncoders.empty())
+            e = new PoolEncoder();
+        else
+        {
+            e = idleEncoders.front();
+            idleEncoders.pop_front();
+        }
+        EncodeJob(job, e->enc, e->huffVersion, lock);
+        idleEncoders.push_back(e);
+        if (!headWriting)
+        {
+            headWriting = true;
+            while (!jobs.empty() && ((jobs.front()->state == 2) || (jobs.front()->state == -1)))
+                WriteHead(lock);
+            headWriting = false;
+        }
+        return true;
+    }
+
+    void MjpegWriter::WriteLoop()
+    {
+        std::unique_lock<std::mutex> lock(jobsMutex);
+        for (;;)
+        {
+            if (jobs.empty())
+            {
+                if (stopPipeline)
+                    break;
+                jobEncoded.wait(lock);
+                continue;
+            }
+            FrameJob *job = jobs.front();
+            if (job->state == 0 || job->state == 1)
+            {
+                jobEncoded.wait(lock);
+                continue;
+            }
+            WriteHead(lock);
+        }
+    }
+
+    // Writes the encoded (or failed) frame at the head of the queue and frees its slot.
+    // lock holds jobsMutex, except while writing and delivering a WriteAsync result.
+    void MjpegWriter::WriteHead(std::unique_lock<std::mutex> &lock)
+    {
+        FrameJob *job = jobs.front();
+        bool encoded = job->state == 2;
+        job->state = 3;
+        lock.unlock();
+
+        unsigned long long io = stage.io_cycles();
+        if (encoded)
+            WriteFrameData(&job->buf[0], job->size);
+        io = stage.io_cycles() - io;
+
+        lock.lock();
+        stageCycles[STAGE_FILE_IO] += io;
+        if (!encoded)
+            pipelineFailed = true;
+        jobs.pop_front();
+        std::promise<int> result;
+        write_callback done;
+        bool async = job->async;
+        if (async)
+        {
+            result = std::move(job->result);
+            done.swap(job->done);
+            job->frame.release();
+            job->async = false;
+        }
+        if (openRecorder)
+            openRecorder->ReleaseSlot(this, job);
+        else
+            freeJobs.push_back(job);
+        jobWritten.notify_all();
+        if (async)
+        {
+            lock.unlock();
+            complete_async(result, done, encoded ? 1 : -2);
+            lock.lock();
+        }
+    }
+
+    void MjpegWriter::WriteIndex()
+    {
+        // old style AVI index, covers the first RIFF only
+        StartWriteChunk(fourCC('i', 'd', 'x', '1'));
+        for (size_t i = 0; i < FrameSize.size(); i++)
+        {
+            PutInt(fourCC('0', '0', 'd', 'c'));
+            PutInt(AVIIF_KEYFRAME);
+            PutInt((int)(FrameOffset[i] - moviPointer));
+            PutInt(FrameSize[i]);
+        }
+        EndWriteChunk(); // End idx1
+    }
+
+    // Index of the frames of the current RIFF since the last checkpoint, or (whole) of all of them; a whole
+    // index replaces the ones of the checkpoints in the super index.
+    void MjpegWriter::WriteODMLIndex(bool whole)
+    {
+        if (whole)
+        {
+            ixFrames = 0;
+            indxEntries = riffIndxBase;
+        }
+        if (ixFrames == FrameSize.size())
+            return;
+        // standard index: 32-bit offsets of the chunk data relative to the 'movi' of this RIFF
+        long long ixPointer = stage.tell();
+        const int count = (int)(FrameSize.size() - ixFrames);
+        StartWriteChunk(fourCC('i', 'x', '0', '0'));
+        PutShort(2);                                // wLongsPerEntry
+        PutShort(AVI_INDEX_OF_CHUNKS << 8);         // bIndexSubType, bIndexType
+        PutInt(count);                              // nEntriesInUse
+        PutInt(fourCC('0', '0', 'd', 'c'));
+        PutInt64(moviPointer);                      // qwBaseOffset
+        PutInt(0);
+        for (size_t i = ixFrames; i < FrameSize.size(); i++)
+        {
+            PutInt((int)(FrameOffset[i] + 8 - moviPointer));
+            PutInt(FrameSize[i]);                   // bit 31 clear: key frame
+        }
+        EndWriteChunk(); // End ix00
+
+        // Register it in the super index. Once the reserved slots are used up, later
+        // segments are only reachable by scanning.
+        if (indxEntries < ODML_INDX_ENTRIES)
+        {
+            long long entry = indxPointer + 20 + indxEntries * 16;
+            stage.patch(entry, (int)ixPointer);
+            stage.patch(entry + 4, (int)(ixPointer >> 32));
+            stage.patch(entry + 8, (int)(stage.tell() - ixPointer));
+            stage.patch(entry + 12, count);
+            stage.patch(indxPointer, ++indxEntries);
+        }
+        ixFrames = FrameSize.size();
+    }
+
+    // Makes the file as written so far readable without Close: an index of the new frames, the header
+    // counts and the sizes of the open RIFF and 'movi' lists, all handed to the file. Only the idx1 of
+    // the first RIFF is missing, which recover_avi adds.
+    void MjpegWriter::Checkpoint()
+    {
+        // out of super index slots: one whole index for the RIFF instead of one per checkpoint
+        WriteODMLIndex(indxEntries >= ODML_INDX_ENTRIES && riffIndxBase < ODML_INDX_ENTRIES);
+        for (size_t i = 0; i < FrameNumIndexes.size(); i++)
+            stage.patch(FrameNumIndexes[i], i ? FrameNum : (riffNum ? firstRiffFrames : (int)FrameSize.size()));
+        for (size_t i = 0; i < AVIChunkSizeIndex.size(); i++)
+            stage.patch(AVIChunkSizeIndex[i], (int)(stage.tell() - (AVIChunkSizeIndex[i] + 4)));
+        long long rate = maxBytesPerSec ? maxBytesPerSec : rateWindowBytes * outfps / (long long)rateWindow.size();
+        stage.patch(maxBytesPerSecPos, (int)std::min(rate, (long long)INT_MAX));
+        stage.sync(ckptDurable);
+    }
+
+    void MjpegWriter::FinishWriteAVI()
+    {
+        // Record frames numbers to AVI Header; avih counts the frames of the first RIFF only,
+        // strh and dmlh count all of them
+        while (!FrameNumIndexes.empty())
+        {
+            stage.patch(FrameNumIndexes.back(), FrameNumIndexes.size() == 1 ? firstRiffFrames : FrameNum);
+            FrameNumIndexes.pop_back();
+        }
+    }
+
+    void MjpegWriter::PutInt(int elem)
+    {
+        stage.put_obj(elem);
+    }
+
+    void MjpegWriter::PutShort(short elem)
+    {
+        stage.put_obj(elem);
+    }
+
+    void MjpegWriter::PutInt64(long long elem)
+    {
+        stage.put_obj(elem);
+    }
+
+    void MjpegWriter::StartWriteChunk(int fourcc)
+    {
+        if (fourcc != 0)
+            PutInt(fourcc);
+        AVIChunkSizeIndex.push_back(stage.tell());
+        PutInt(0);
+    }
+
+    void MjpegWriter::EndWriteChunk()
+    {
+        if (!AVIChunkSizeIndex.empty())
+        {
+            int size = (int)(stage.tell() - (AVIChunkSizeIndex.back() + 4));
+            stage.patch(AVIChunkSizeIndex.back(), size);
+            AVIChunkSizeIndex.pop_back();
+        }
+    }
+
+    int MjpegWriter::toJPGframe(jpeg_encoder &enc, const uchar * data, uint width, uint height, int format, int step, const params &p, vector<uchar> &buf)
+    {
+        int buf_size = width * height * 3; // allocate a buffer that's hopefully big enough (this is way overkill for jpeg)
+        if (buf_size < 1024) buf_size = 1024;
+        buf.resize(buf_size);
+        void *pBuf = &buf[0];
+        if (!enc.compress_image_to_jpeg_file_in_memory(pBuf, buf_size, width, height, format, data, p, step))
+            return -1;
+        return buf_size;
+    }
+
+    static void *stage_malloc(size_t size)
+    {
+#if defined(WIN32)
+        return _aligned_malloc(size, STAGE_ALIGN);
+#else
+        void *p = 0;
+        return posix_memalign(&p, STAGE_ALIGN, size) ? 0 : p;
+#endif
+    }
+
+    static void stage_free(void *p)
+    {
+#if defined(WIN32)
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+#if !defined(WIN32)
+    // pwrite of all len bytes; false on any error
+    static bool write_all(int fd, const uchar *pBuf, size_t len, long long pos)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = pwrite(fd, pBuf + done, len - done, (off_t)(pos + (long long)done));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            done += (size_t)n;
+        }
+        return true;
+    }
+#endif
+
+    bool stdio_sink::open(const char *name)
+    {
+        close();
+        return (m_file = fopen(name, "wb+")) != 0;
+    }
+
+    bool stdio_sink::write(long long pos, const void *pBuf, size_t len)
+    {
+#if defined(WIN32)
+        bool ok = !_fseeki64(m_file, pos, SEEK_SET) && (fwrite(pBuf, 1, len, m_file) == len);
+        fflush(m_file);
+        return ok;
+#else
+        return write_all(fileno(m_file), static_cast<const uchar*>(pBuf), len, pos);
+#endif
+    }
+
+    bool stdio_sink::flush(bool durable)
+    {
+        // every write has gone to the file already (fflush on Windows)
+#if defined(WIN32)
+        return !durable || !_commit(_fileno(m_file));
+#else
+        return !durable || !fdatasync(fileno(m_file));
+#endif
+    }
+
+    bool stdio_sink::close()
+    {
+        if (!m_file)
+            return true;
+        bool ok = fclose(m_file) == 0;
+        m_file = 0;
+        return ok;
+    }
+
+#if defined(HAVE_IO_URING)
+    // Submission and completion rings of an io_uring instance, mapped straight from the kernel.
+    // Each block has its own iovec, which must stay valid until its write completes.
+    struct direct_sink::ring
+    {
+        int fd;
+        void *sq_ptr, *cq_ptr;
+        size_t sq_size, cq_size, sqes_size;
+        unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+        io_uring_sqe *sqes;
+        io_uring_cqe *cqes;
+        vector<iovec> iov;
+
+        ring() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)) { }
+
+        ~ring()
+        {
+            if (sqes != MAP_FAILED)
+                munmap(sqes, sqes_size);
+            if ((cq_ptr != MAP_FAILED) && (cq_ptr != sq_ptr))
+                munmap(cq_ptr, cq_size);
+            if (sq_ptr != MAP_FAILED)
+                munmap(sq_ptr, sq_size);
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+        bool setup(unsigned entries)
+        {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            if ((fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+                return false;
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single)
+                sq_size = cq_size = std::max(sq_size, cq_size);
+            sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sq_ptr == MAP_FAILED)
+                return false;
+            cq_ptr = single ? sq_ptr : mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+                return false;
+            sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+            if (sqes == MAP_FAILED)
+                return false;
+            uchar *sq = static_cast<uchar*>(sq_ptr), *cq = static_cast<uchar*>(cq_ptr);
+            sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+            cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+            iov.resize(entries);
+            return true;
+        }
+
+        // Queues the write of block and hands it to the kernel.
+        bool submit(int file, int block, uchar *pBuf, size_t len, long long pos)
+        {
+            unsigned tail = *sq_tail, index = tail & *sq_mask;
+            io_uring_sqe *sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            iov[block].iov_base = pBuf;
+            iov[block].iov_len = len;
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = file;
+            sqe->addr = (unsigned long long)(size_t)&iov[block];
+            sqe->len = 1;
+            sqe->off = (unsigned long long)pos;
+            sqe->user_data = (unsigned long long)block;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            long n;
+            while (((n = syscall(__NR_io_uring_enter, fd, 1, 0, 0, NULL, 0)) < 0) && (errno == EINTR)) { }
+            return n == 1;
+        }
+
+        // Waits for the next completion: the block and the bytes written (or -errno).
+        bool complete(int &block, int &res)
+        {
+            unsigned head = *cq_head;
+            while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+                if ((syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR))
+                    return false;
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            block = (int)cqe.user_data;
+            res = cqe.res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+    };
+#else
+    struct direct_sink::ring { };
+#endif
+
+    direct_sink::direct_sink(int depth, size_t block_size) : m_fd(-1), m_direct_fd(-1), m_depth(std::max(depth, 1)),
+        m_block_size((std::max(block_size, (size_t)1) + STAGE_ALIGN - 1) & ~(STAGE_ALIGN - 1)),
+        m_in_flight(0), m_cur(0), m_fill(0), m_block_pos(0), m_ring(0), m_ok(true) { }
+
+    direct_sink::~direct_sink()
+    {
+        close();
+        for (size_t i = 0; i < m_blocks.size(); i++)
+            stage_free(m_blocks[i]);
+    }
+
+    bool direct_sink::open(const char *name)
+    {
+#if defined(__linux__)
+        close();
+        while ((int)m_blocks.size() < m_depth)
+        {
+            uchar *pBlock = static_cast<uchar*>(stage_malloc(m_block_size));
+            if (!pBlock)
+                return false;
+            m_blocks.push_back(pBlock);
+        }
+        if ((m_fd = ::open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+            return false;
+        // where the filesystem has no O_DIRECT (tmpfs) the blocks go through the page cache as well
+        m_direct_fd = ::open(name, O_WRONLY | O_DIRECT);
+        m_pending.assign(m_depth, 0);
+        m_in_flight = m_cur = 0;
+        m_fill = 0;
+        m_block_pos = 0;
+        m_ok = true;
+#if defined(HAVE_IO_URING)
+        m_ring = new ring();
+        if (!m_ring->setup((unsigned)m_depth))
+        {
+            delete m_ring;
+            m_ring = 0;
+        }
+#endif
+        return true;
+#else
+        (void)name;
+        return false;
+#endif
+    }
+
+    // Writes out block, the current one, at m_block_pos.
+    void direct_sink::submit(int block)
+    {
+#if defined(__linux__)
+        int fd = m_direct_fd >= 0 ? m_direct_fd : m_fd;
+#if defined(HAVE_IO_URING)
+        if (m_ring)
+        {
+            if (m_ring->submit(fd, block, m_blocks[block], m_block_size, m_block_pos))
+            {
+                m_pending[block] = 1;
+                m_in_flight++;
+                return;
+            }
+            // the ring is unusable: finish what it has and write synchronously from now on
+            drain();
+            delete m_ring;
+            m_ring = 0;
+        }
+#endif
+        if (!write_all(fd, m_blocks[block], m_block_size, m_block_pos))
+            m_ok = false;
+#else
+        (void)block;
+#endif
+    }
+
+    // Waits for one write in flight to complete.
+    bool direct_sink::reap()
+    {
+#if defined(HAVE_IO_URING)
+        int block, res;
+        if (!m_ring || !m_in_flight)
+            return false;
+        if (!m_ring->complete(block, res))
+        {
+            // nothing more will complete: give the blocks up
+            m_ok = false;
+            m_pending.assign(m_depth, 0);
+            m_in_flight = 0;
+            return false;
+        }
+        if (res != (int)m_block_size)
+            m_ok = false;
+        m_pending[block] = 0;
+        m_in_flight--;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void direct_sink::drain()
+    {
+        while (m_in_flight && reap()) { }
+    }
+
+    bool direct_sink::write(long long pos, const void *pBuf, size_t len)
+    {
+#if defined(__linux__)
+        const uchar *p = static_cast<const uchar*>(pBuf);
+        const long long end = m_block_pos + (long long)m_fill;
+        if (pos > end)
+            return m_ok = false;
+        if (pos < end)
+        {
+            // Patch: bytes still in the current block are changed there, earlier ones are written
+            // through the page cache once no block is in flight, so no write can overtake it.
+            size_t n = (size_t)std::min((long long)len, end - pos);
+            if (pos < m_block_pos)
+            {
+                size_t before = (size_t)std::min((long long)n, m_block_pos - pos);
+                drain();
+                if (!write_all(m_fd, p, before, pos))
+                    m_ok = false;
+                if (before < n)
+                    memcpy(m_blocks[m_cur], p + before, n - before);
+            }
+            else
+                memcpy(m_blocks[m_cur] + (size_t)(pos - m_block_pos), p, n);
+            p += n;
+            len -= n;
+        }
+        while (len)
+        {
+            size_t n = std::min(len, m_block_size - m_fill);
+            memcpy(m_blocks[m_cur] + m_fill, p, n);
+            m_fill += n;
+            p += n;
+            len -= n;
+            if (m_fill == m_block_size)
+            {
+                submit(m_cur);
+                m_block_pos += (long long)m_block_size;
+                m_fill = 0;
+                m_cur = (m_cur + 1) % m_depth;
+                while (m_pending[m_cur] && reap()) { }
+            }
+        }
+        return m_ok;
+#else
+        (void)pos; (void)pBuf; (void)len;
+        return false;
+#endif
+    }
+
+    bool direct_sink::flush(bool durable)
+    {
+#if defined(__linux__)
+        if (m_fd < 0)
+            return false;
+        drain();
+        if (m_fill && !write_all(m_fd, m_blocks[m_cur], m_fill, m_block_pos))
+            m_ok = false;
+        if (durable && fdatasync(m_fd))
+            m_ok = false;
+        return m_ok;
+#else
+        (void)durable;
+        return false;
+#endif
+    }
+
+    bool direct_sink::close()
+    {
+#if defined(__linux__)
+        if (m_fd < 0)
+            return true;
+        drain();
+        if (m_fill)
+        {
+            if (m_direct_fd >= 0)
+            {
+                // O_DIRECT writes whole aligned blocks: pad the last one and cut the file back
+                size_t n = (m_fill + STAGE_ALIGN - 1) & ~(STAGE_ALIGN - 1);
+                memset(m_blocks[m_cur] + m_fill, 0, n - m_fill);
+                if (!write_all(m_direct_fd, m_blocks[m_cur], n, m_block_pos) || ftruncate(m_fd, (off_t)(m_block_pos + (long long)m_fill)))
+                    m_ok = false;
+            }
+            else if (!write_all(m_fd, m_blocks[m_cur], m_fill, m_block_pos))
+                m_ok = false;
+            m_fill = 0;
+        }
+        // the few pages the patches went through are not needed either
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (m_direct_fd >= 0)
+            ::close(m_direct_fd);
+        if (::close(m_fd))
+            m_ok = false;
+        m_fd = m_direct_fd = -1;
+#endif
+        delete m_ring;
+        m_ring = 0;
+        return m_ok;
+    }
+
+    staging_stream::staging_stream() : m_sink(0), m_buf(0), m_capacity(0), m_len(0), m_chunk(0), m_pos(0), m_head_size(0), m_head_dirty(false),
+        m_hold(false), m_ok(true), m_io_cycles(0) { }
+
+    staging_stream::~staging_stream()
+    {
+        stage_free(m_buf);
+    }
+
+    bool staging_stream::open(file_sink *sink, long long pos, size_t capacity)
+    {
+        close();
+        m_sink = sink;
+        m_pos = pos;
+        m_len = 0;
+        m_chunk = 0;
+        m_ok = true;
+        m_head.clear();
+        m_head_size = 0;
+        m_head_dirty = false;
+        m_patches.clear();
+        m_hold = false;
+        if (m_capacity < capacity)
+        {
+            stage_free(m_buf);
+            m_capacity = 0;
+            if (!(m_buf = static_cast<uchar*>(stage_malloc(capacity))))
+                return false;
+            m_capacity = capacity;
+        }
+        return true;
+    }
+
+    bool staging_stream::close()
+    {
+        if (m_sink)
+        {
+            flush(m_len);
+            // header region was patched after it left the buffer: rewrite it at once
+            if (m_head_dirty)
+                write_at(0, &m_head[0], m_head_size);
+            write_patches();
+            m_head.clear();
+        }
+        m_sink = 0;
+        m_hold = false;
+        return m_ok;
+    }
+
+    // Durable: the data goes to the disk first and the header region (counts, super index entries) only
+    // after it, so a power loss in between leaves the header of the previous checkpoint pointing at data
+    // that is there. The other patches are chunk sizes, which recover_avi works out itself.
+    bool staging_stream::sync(bool durable)
+    {
+        flush(m_len, durable);
+        if (m_head_dirty || !m_patches.empty())
+        {
+            if (durable)
+                flush_sink(true);
+            if (m_head_dirty)
+                write_at(0, &m_head[0], m_head_size);
+            m_head_dirty = false;
+            write_patches();
+        }
+        flush_sink(durable);
+        return m_ok;
+    }
+
+    void staging_stream::swap(staging_stream &other)
+    {
+        std::swap(m_sink, other.m_sink);
+        std::swap(m_buf, other.m_buf);
+        std::swap(m_capacity, other.m_capacity);
+        std::swap(m_len, other.m_len);
+        std::swap(m_chunk, other.m_chunk);
+        std::swap(m_pos, other.m_pos);
+        m_head.swap(other.m_head);
+        std::swap(m_head_size, other.m_head_size);
+        std::swap(m_head_dirty, other.m_head_dirty);
+        m_patches.swap(other.m_patches);
+        std::swap(m_hold, other.m_hold);
+        std::swap(m_ok, other.m_ok);
+    }
+
+    void staging_stream::write_at(long long pos, const uchar *pBuf, size_t len)
+    {
+        unsigned long long t = read_cycles();
+        if (!m_sink->write(pos, pBuf, len))
+            m_ok = false;
+        m_io_cycles += read_cycles() - t;
+    }
+
+    void staging_stream::write_patches()
+    {
+        for (size_t i = 0; i < m_patches.size(); i++)
+            write_at(m_patches[i].first, reinterpret_cast<const uchar*>(&m_patches[i].second), sizeof(int));
+        m_patches.clear();
+    }
+
+    void staging_stream::flush_sink(bool durable)
+    {
+        unsigned long long t = read_cycles();
+        if (!m_sink->flush(durable))
+            m_ok = false;
+        m_io_cycles += read_cycles() - t;
+    }
+
+    // Writes the first len staged bytes and moves the rest to the front of the buffer.
+    // hold_head: bytes of the header region are only copied aside, for the next write of the region.
+    bool staging_stream::flush(size_t len, bool hold_head)
+    {
+        size_t n = 0;
+        if (m_pos < (long long)m_head.size())
+        {
+            n = std::min(len, m_head.size() - (size_t)m_pos);
+            memcpy(&m_head[(size_t)m_pos], m_buf, n);
+            m_head_size = (size_t)m_pos + n;
+            if (hold_head && n)
+                m_head_dirty = true;
+        }
+        if (!hold_head)
+            write_at(m_pos, m_buf, len);
+        else if (len > n)
+            write_at(m_pos + (long long)n, m_buf + n, len - n);
+        m_pos += (long long)len;
+        m_len -= len;
+        if (m_len)
+            memmove(m_buf, m_buf + len, m_len);
+        m_chunk = m_chunk > len ? m_chunk - len : 0;
+        return m_ok;
+    }
+
+    void staging_stream::keep_head(size_t size)
+    {
+        m_head.assign(size, 0);
+    }
+
+    void staging_stream::patch(long long pos, int value)
+    {
+        if (pos >= m_pos)
+            memcpy(m_buf + (size_t)(pos - m_pos), &value, sizeof(value));
+        else if (pos + (long long)sizeof(value) <= (long long)m_head_size)
+        {
+            memcpy(&m_head[(size_t)pos], &value, sizeof(value));
+            m_head_dirty = true;
+        }
+        else if (m_hold)
+            m_patches.push_back(std::make_pair(pos, value));
+        else
+            write_at(pos, reinterpret_cast<const uchar*>(&value), sizeof(value));
+    }
+
+    void staging_stream::hold()
+    {
+        m_hold = true;
+    }
+
+    // Makes room for len more bytes: writes out all completed chunks first and grows
+    // the buffer only if a single open chunk does not fit (or anything is held).
+    bool staging_stream::reserve(size_t len)
+    {
+        if (m_len + len <= m_capacity)
+            return true;
+        if (!m_hold)
+            flush(m_chunk);
+        if (m_len + len <= m_capacity)
+            return true;
+        size_t capacity = m_capacity;
+        while (m_len + len > capacity)
+            capacity *= 2;
+        uchar *pBuf = static_cast<uchar*>(stage_malloc(capacity));
+        if (!pBuf)
+            return m_ok = false;
+        memcpy(pBuf, m_buf, m_len);
+        stage_free(m_buf);
+        m_buf = pBuf;
+        m_capacity = capacity;
+        return true;
+    }
+
+    bool staging_stream::put_buf(const void* pBuf, int len)
+    {
+        if (!reserve(len))
+            return false;
+        memcpy(m_buf + m_len, pBuf, len);
+        m_len += len;
+        return true;
+    }
+
+    void staging_stream::start_chunk(int fourcc)
+    {
+        // everything before the new chunk is complete and may be flushed
+        if (!m_hold && (m_len >= m_capacity / 2))
+            flush(m_len);
+        m_chunk = m_len;
+        int header[2] = { fourcc, 0 };
+        put_buf(header, sizeof(header));
+    }
+
+    int staging_stream::end_chunk()
+    {
+        int size = (int)(m_len - m_chunk - 8);
+        memcpy(m_buf + m_chunk + 4, &size, sizeof(size));
+        // RIFF chunks are word aligned; the pad byte is not counted in the size
+        if (size & 1)
+            put_obj(uchar(0));
+        m_chunk = m_len;
+        return size;
+    }
+
+    void staging_stream::cancel_chunk()
+    {
+        m_len = m_chunk;
     }
 
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
@@ -289,10 +1993,9 @@ namespace jcodec{
         static inline void jpge_free(void *p) { free(p); }
 
         // Various JPEG enums and tables.
-        enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+        enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
         enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
-        static uchar s_zag[64] = { 0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
         static short s_std_lum_quant[64] = { 16, 11, 12, 14, 12, 10, 16, 14, 13, 14, 18, 17, 16, 19, 24, 40, 26, 24, 22, 22, 24, 49, 35, 37, 29, 40, 58, 51, 61, 60, 57, 51, 56, 55, 64, 72, 92, 78, 64, 68, 87, 69, 55, 56, 80, 109, 81, 87, 95, 98, 103, 104, 103, 62, 77, 113, 121, 112, 100, 120, 92, 101, 103, 99 };
         static short s_std_croma_quant[64] = { 17, 18, 18, 24, 21, 24, 47, 26, 26, 47, 99, 66, 56, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99 };
         static uchar s_dc_lum_bits[17] = { 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
@@ -323,22 +2026,79 @@ namespace jcodec{
         // Low-level helper functions.
         template <class T> inline void clear_obj(T &obj) { memset(&obj, 0, sizeof(obj)); }
 
-        const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
+        static uchar clamp_table[1024];
+
+        // Filled once at startup, so encoders running on several threads never race on it.
+        static struct clamp_table_init
+        {
+            clamp_table_init()
+            {
+                for (int i = -256; i < 512; i++)
+                    clamp_table[i + 256] = (uchar)(i < 0 ? 0 : i > 255 ? 255 : i);
+            }
+        } s_clamp_table_init;
+
+        static inline uchar clamp(int i) { if (static_cast<uint>(i) > 255U) { i = clamp_table[(i)+256]; } return static_cast<uchar>(i); }
+
+        static const float MAX_M = (float)(1 << (15 - BITS));
+
+        static simd_level_t detect_simd_level()
+        {
+#if !SSE
+            return SIMD_SCALAR;
+#elif defined(_MSC_VER)
+            int regs[4];
+            __cpuid(regs, 0);
+            if (regs[0] < 7)
+                return SIMD_SSE2;
+            __cpuid(regs, 1);
+            // OSXSAVE and AVX, then the OS must save the YMM (and for AVX-512 the ZMM/opmask) state
+            if ((regs[2] & (3 << 27)) != (3 << 27))
+                return SIMD_SSE2;
+            unsigned long long xcr0 = _xgetbv(0);
+            if ((xcr0 & 6) != 6)
+                return SIMD_SSE2;
+            __cpuidex(regs, 7, 0);
+            if ((regs[1] & (1 << 16)) && (regs[1] & (1 << 30)) && ((xcr0 & 0xE0) == 0xE0))
+                return SIMD_AVX512;
+            return (regs[1] & (1 << 5)) ? SIMD_AVX2 : SIMD_SSE2;
+#elif defined(__GNUC__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+                return SIMD_AVX512;
+            if (__builtin_cpu_supports("avx2"))
+                return SIMD_AVX2;
+            return SIMD_SSE2;
+#else
+            return SIMD_SSE2;
+#endif
+        }
+
+        static simd_level_t s_simd_max = detect_simd_level();
+        static simd_level_t s_simd_level = SIMD_SCALAR;
+        // wide kernels of s_simd_level, 0 entries use the SSE2/scalar code below
+        static encoder_kernels s_kernels;
 
-        static uchar clamp_table[1024];
-        static bool init_clamp_table = false;
+        simd_level_t set_simd_level(simd_level_t level)
+        {
+            s_simd_level = JPGE_MIN(level, s_simd_max);
+            memset(&s_kernels, 0, sizeof(s_kernels));
+            if (s_simd_level >= SIMD_AVX2)
+                get_avx2_kernels(s_kernels);
+            if (s_simd_level >= SIMD_AVX512)
+                get_avx512_kernels(s_kernels);
+            return s_simd_level;
+        }
 
-        static inline uchar clamp(int i) { if (static_cast<uint>(i) > 255U) { i = clamp_table[(i)+256]; } return static_cast<uchar>(i); }
+        simd_level_t get_simd_level()
+        {
+            return s_simd_level;
+        }
 
-        static const int BITS = 10, SCALE = 1 << BITS;
-        static const float MAX_M = (float)(1 << (15 - BITS));
-        static const short m00 = static_cast<short>(-0.081f * SCALE), m01 = static_cast<short>(-0.419f * SCALE),
-            m02 = static_cast<short>(0.5f * SCALE), m10 = static_cast<short>(0.5f * SCALE),
-            m11 = static_cast<short>(-0.331f * SCALE), m12 = static_cast<short>(-0.169f * SCALE),
-            m20 = static_cast<short>(0.114f * SCALE), m21 = static_cast<short>(0.587f  * SCALE),
-            m22 = static_cast<short>(0.299f * SCALE);
-        static int m03 = static_cast<int>((128 + 0.5f) * SCALE), m13 = static_cast<int>((0.5f + 128) * SCALE),
-            m23 = static_cast<int>(0.5f * SCALE);
+        static struct simd_level_init
+        {
+            simd_level_init() { set_simd_level(s_simd_max); }
+        } s_simd_level_init;
 
         static void BGR_to_YCC(uchar *pDstY, uchar *pDstCb, uchar *pDstCr, const uchar *pSrc, int num_pixels)
         {
@@ -349,7 +2109,13 @@ namespace jcodec{
             __m128i z = _mm_setzero_si128(), t0, t1, t2, r0, r1, v0, v1, v2, v3;
             int x = 0;
 
+            if (s_kernels.bgr_to_ycc)
+            {
+                int n = s_kernels.bgr_to_ycc(pDstY, pDstCb, pDstCr, pSrc, num_pixels);
+                pDstY += n; pDstCb += n; pDstCr += n; x = n * 3;
+            }
 #if SSE
+            if (s_simd_level >= SIMD_SSE2)
             for (; x <= (num_pixels - 8) * 3; x += 8 * 3, pDstCr += 8, pDstCb += 8, pDstY += 8)
             {
                 v0 = _mm_loadl_epi64((const __m128i*)(pSrc + x));
@@ -451,21 +2217,258 @@ namespace jcodec{
         }
 
 
-        static void RGBA_to_YCC(uchar* pDst, const uchar *pSrc, int num_pixels)
+        // Luma only, for grayscale output: same arithmetic as the Y part of BGR_to_YCC.
+        static void BGR_to_Y(uchar *pDstY, const uchar *pSrc, int num_pixels)
+        {
+            __m128i m2 = _mm_setr_epi16(0, m20, m21, m22, m20, m21, m22, 0);
+            __m128i m3 = _mm_set1_epi32(m23);
+            __m128i z = _mm_setzero_si128(), t0, t1, t2, t3, v0, v1, v2, v3;
+            int x = 0;
+
+            if (s_kernels.bgr_to_y)
+            {
+                int n = s_kernels.bgr_to_y(pDstY, pSrc, num_pixels);
+                pDstY += n; x = n * 3;
+            }
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            for (; x <= (num_pixels - 8) * 3; x += 8 * 3, pDstY += 8)
+            {
+                v0 = _mm_loadl_epi64((const __m128i*)(pSrc + x));
+                v1 = _mm_loadl_epi64((const __m128i*)(pSrc + x + 8));
+                v2 = _mm_loadl_epi64((const __m128i*)(pSrc + x + 16));
+                v0 = _mm_unpacklo_epi8(v0, z); // b0 g0 r0 b1 g1 r1 b2 g2
+                v1 = _mm_unpacklo_epi8(v1, z); // r2 b3 g3 r3 b4 g4 r4 b5
+                v2 = _mm_unpacklo_epi8(v2, z); // g5 r5 b6 g6 r6 b7 g7 r7
+
+                v3 = _mm_srli_si128(v2, 2); // ? b6 g6 r6 b7 g7 r7 0
+                v2 = _mm_or_si128(_mm_slli_si128(v2, 10), _mm_srli_si128(v1, 6)); // ? b4 g4 r4 b5 g5 r5 ?
+                v1 = _mm_or_si128(_mm_slli_si128(v1, 6), _mm_srli_si128(v0, 10)); // ? b2 g2 r2 b3 g3 r3 ?
+                v0 = _mm_slli_si128(v0, 2); // 0 b0 g0 r0 b1 g1 r1 ?
+
+                // e0 f0 e1 f1 -> Y0 = e0 + f0, Y1 = e1 + f1
+                t0 = _mm_madd_epi16(v0, m2);
+                t1 = _mm_madd_epi16(v1, m2);
+                t2 = _mm_madd_epi16(v2, m2);
+                t3 = _mm_madd_epi16(v3, m2);
+                t0 = _mm_shuffle_epi32(_mm_add_epi32(t0, _mm_srli_epi64(t0, 32)), _MM_SHUFFLE(3, 1, 2, 0)); // Y0 Y1 ? ?
+                t1 = _mm_shuffle_epi32(_mm_add_epi32(t1, _mm_srli_epi64(t1, 32)), _MM_SHUFFLE(3, 1, 2, 0)); // Y2 Y3 ? ?
+                t2 = _mm_shuffle_epi32(_mm_add_epi32(t2, _mm_srli_epi64(t2, 32)), _MM_SHUFFLE(3, 1, 2, 0)); // Y4 Y5 ? ?
+                t3 = _mm_shuffle_epi32(_mm_add_epi32(t3, _mm_srli_epi64(t3, 32)), _MM_SHUFFLE(3, 1, 2, 0)); // Y6 Y7 ? ?
+                t0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi64(t0, t1), m3), BITS); // Y0 ... Y3
+                t2 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi64(t2, t3), m3), BITS); // Y4 ... Y7
+                t0 = _mm_packs_epi32(t0, t2);
+
+                _mm_storel_epi64((__m128i*)pDstY, _mm_packus_epi16(t0, t0));
+            }
+#endif
+            for (; x < num_pixels * 3; x += 3)
+            {
+                int v0 = pSrc[x], v1 = pSrc[x + 1], v2 = pSrc[x + 2];
+                *pDstY++ = static_cast<uchar>((m20*v0 + m21*v1 + m22*v2 + m23) >> BITS);
+            }
+        }
+
+#if SSE
+        // Sums of the dword pairs of a and b: (a0 + a1, a2 + a3, b0 + b1, b2 + b3)
+        static inline __m128i hadd_pairs(__m128i a, __m128i b)
+        {
+            __m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+            return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+        }
+
+        // One output channel of 8 four-byte pixels (unpacked to words in p0..p3, two pixels each)
+        static inline __m128i channel_4x2px(__m128i p0, __m128i p1, __m128i p2, __m128i p3, __m128i k, __m128i round)
+        {
+            __m128i lo = _mm_srai_epi32(_mm_add_epi32(hadd_pairs(_mm_madd_epi16(p0, k), _mm_madd_epi16(p1, k)), round), BITS);
+            __m128i hi = _mm_srai_epi32(_mm_add_epi32(hadd_pairs(_mm_madd_epi16(p2, k), _mm_madd_epi16(p3, k)), round), BITS);
+            __m128i v = _mm_packs_epi32(lo, hi);
+            return _mm_packus_epi16(v, v);
+        }
+#endif
+
+        // BGRA (or RGBA) to YCbCr with the arithmetic of BGR_to_YCC; alpha is ignored.
+        static void BGRA_to_YCC(uchar *pDstY, uchar *pDstCb, uchar *pDstCr, const uchar *pSrc, int num_pixels, bool rgba)
+        {
+            const int b = rgba ? 2 : 0, r = 2 - b;
+            int n = 0;
+            if (s_kernels.bgra_to_ycc)
+                n = s_kernels.bgra_to_ycc(pDstY, pDstCb, pDstCr, pSrc, num_pixels, rgba);
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                // word pairs (c0 c1 c2 0) with the blue coefficient at the position of blue
+                const __m128i k0 = rgba ? _mm_setr_epi16(m02, m01, m00, 0, m02, m01, m00, 0) : _mm_setr_epi16(m00, m01, m02, 0, m00, m01, m02, 0);
+                const __m128i k1 = rgba ? _mm_setr_epi16(m12, m11, m10, 0, m12, m11, m10, 0) : _mm_setr_epi16(m10, m11, m12, 0, m10, m11, m12, 0);
+                const __m128i k2 = rgba ? _mm_setr_epi16(m22, m21, m20, 0, m22, m21, m20, 0) : _mm_setr_epi16(m20, m21, m22, 0, m20, m21, m22, 0);
+                const __m128i r0 = _mm_set1_epi32(m03), r1 = _mm_set1_epi32(m13), r2 = _mm_set1_epi32(m23), z = _mm_setzero_si128();
+                for (; n <= num_pixels - 8; n += 8)
+                {
+                    __m128i a = _mm_loadu_si128((const __m128i*)(pSrc + n * 4)), c = _mm_loadu_si128((const __m128i*)(pSrc + n * 4 + 16));
+                    __m128i p0 = _mm_unpacklo_epi8(a, z), p1 = _mm_unpackhi_epi8(a, z), p2 = _mm_unpacklo_epi8(c, z), p3 = _mm_unpackhi_epi8(c, z);
+                    _mm_storel_epi64((__m128i*)(pDstCr + n), channel_4x2px(p0, p1, p2, p3, k0, r0));
+                    _mm_storel_epi64((__m128i*)(pDstCb + n), channel_4x2px(p0, p1, p2, p3, k1, r1));
+                    _mm_storel_epi64((__m128i*)(pDstY + n), channel_4x2px(p0, p1, p2, p3, k2, r2));
+                }
+            }
+#endif
+            for (pSrc += n * 4; n < num_pixels; n++, pSrc += 4)
+            {
+                int v0 = pSrc[b], v1 = pSrc[1], v2 = pSrc[r];
+                pDstCr[n] = clamp((m00*v0 + m01*v1 + m02*v2 + m03) >> BITS);
+                pDstCb[n] = clamp((m10*v0 + m11*v1 + m12*v2 + m13) >> BITS);
+                pDstY[n] = static_cast<uchar>((m20*v0 + m21*v1 + m22*v2 + m23) >> BITS);
+            }
+        }
+
+        static void BGRA_to_Y(uchar *pDstY, const uchar *pSrc, int num_pixels, bool rgba)
+        {
+            const int b = rgba ? 2 : 0, r = 2 - b;
+            int n = 0;
+            if (s_kernels.bgra_to_y)
+                n = s_kernels.bgra_to_y(pDstY, pSrc, num_pixels, rgba);
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                const __m128i k2 = rgba ? _mm_setr_epi16(m22, m21, m20, 0, m22, m21, m20, 0) : _mm_setr_epi16(m20, m21, m22, 0, m20, m21, m22, 0);
+                const __m128i r2 = _mm_set1_epi32(m23), z = _mm_setzero_si128();
+                for (; n <= num_pixels - 8; n += 8)
+                {
+                    __m128i a = _mm_loadu_si128((const __m128i*)(pSrc + n * 4)), c = _mm_loadu_si128((const __m128i*)(pSrc + n * 4 + 16));
+                    _mm_storel_epi64((__m128i*)(pDstY + n), channel_4x2px(_mm_unpacklo_epi8(a, z), _mm_unpackhi_epi8(a, z), _mm_unpacklo_epi8(c, z), _mm_unpackhi_epi8(c, z), k2, r2));
+                }
+            }
+#endif
+            for (pSrc += n * 4; n < num_pixels; n++, pSrc += 4)
+                pDstY[n] = static_cast<uchar>((m20*pSrc[b] + m21*pSrc[1] + m22*pSrc[r] + m23) >> BITS);
+        }
+
+        // Colour conversion of one row of a packed 8-bit format (PF_BGR, PF_BGRA or PF_RGBA)
+        static void color_to_YCC(int format, uchar *pDstY, uchar *pDstCb, uchar *pDstCr, const uchar *pSrc, int num_pixels)
+        {
+            if (format == PF_BGR)
+                BGR_to_YCC(pDstY, pDstCb, pDstCr, pSrc, num_pixels);
+            else
+                BGRA_to_YCC(pDstY, pDstCb, pDstCr, pSrc, num_pixels, format == PF_RGBA);
+        }
+
+        static void color_to_Y(int format, uchar *pDstY, const uchar *pSrc, int num_pixels)
+        {
+            if (format == PF_BGR)
+                BGR_to_Y(pDstY, pSrc, num_pixels);
+            else
+                BGRA_to_Y(pDstY, pSrc, num_pixels, format == PF_RGBA);
+        }
+
+        // 16-bit samples to 8 bits: v >> shift, saturated
+        static void reduce_depth(uchar *pDst, const ushort *pSrc, int n, int shift)
+        {
+            int i = 0;
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                // packus takes the words as signed, which would turn samples of 0x8000 and up into 0 when
+                // shift is 0 (depth 8): clamp them to 255 first, as x - max(x - 255, 0)
+                const __m128i sh = _mm_cvtsi32_si128(shift), max8 = _mm_set1_epi16(255);
+                for (; i <= n - 16; i += 16)
+                {
+                    __m128i a = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i)), sh);
+                    __m128i b = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i + 8)), sh);
+                    a = _mm_sub_epi16(a, _mm_subs_epu16(a, max8));
+                    b = _mm_sub_epi16(b, _mm_subs_epu16(b, max8));
+                    _mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(a, b));
+                }
+            }
+#endif
+            for (; i < n; i++)
+                pDst[i] = static_cast<uchar>(JPGE_MIN(pSrc[i] >> shift, 255));
+        }
+
+        // Even bytes of pSrc to pDst0 and odd bytes to pDst1, n of each: NV12 chroma, YUYV luma and chroma.
+        static void deinterleave_u8(uchar *pDst0, uchar *pDst1, const uchar *pSrc, int n)
+        {
+            int i = 0;
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                const __m128i mask = _mm_set1_epi16(255);
+                for (; i <= n - 16; i += 16, pSrc += 32)
+                {
+                    __m128i a = _mm_loadu_si128((const __m128i*)pSrc), b = _mm_loadu_si128((const __m128i*)(pSrc + 16));
+                    _mm_storeu_si128((__m128i*)(pDst0 + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+                    _mm_storeu_si128((__m128i*)(pDst1 + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+                }
+            }
+#endif
+            for (; i < n; i++, pSrc += 2)
+            {
+                pDst0[i] = pSrc[0]; pDst1[i] = pSrc[1];
+            }
+        }
+
+        // Each of the n samples of pSrc twice (half-width chroma to a full-width line)
+        static void upsample_h2(uchar *pDst, const uchar *pSrc, int n)
+        {
+            int i = 0;
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                for (; i <= n - 16; i += 16, pDst += 32)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i));
+                    _mm_storeu_si128((__m128i*)pDst, _mm_unpacklo_epi8(v, v));
+                    _mm_storeu_si128((__m128i*)(pDst + 16), _mm_unpackhi_epi8(v, v));
+                }
+            }
+#endif
+            for (; i < n; i++, pDst += 2)
+                pDst[0] = pDst[1] = pSrc[i];
+        }
+
+        // H2V2 chroma line `line` of an MCU row from the full-resolution rows pRow0 and pRow1 (n outputs),
+        // with the rounding bias of load_block_16_8 so both paths give the same samples.
+        static void downsample_rows_h2v2(uchar *pDst, const uchar *pRow0, const uchar *pRow1, int n, int line)
+        {
+            const int a = (line & 1) ? 2 : 0, b = 2 - a;
+            int i = 0;
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                const __m128i mask = _mm_set1_epi16(255), delta = _mm_setr_epi16(a, b, a, b, a, b, a, b);
+                for (; i <= n - 16; i += 16)
+                {
+                    __m128i r0 = _mm_loadu_si128((const __m128i*)(pRow0 + 2 * i)), r1 = _mm_loadu_si128((const __m128i*)(pRow1 + 2 * i));
+                    __m128i r2 = _mm_loadu_si128((const __m128i*)(pRow0 + 2 * i + 16)), r3 = _mm_loadu_si128((const __m128i*)(pRow1 + 2 * i + 16));
+                    __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(r0, mask), _mm_srli_epi16(r0, 8)), _mm_add_epi16(_mm_and_si128(r1, mask), _mm_srli_epi16(r1, 8)));
+                    __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(r2, mask), _mm_srli_epi16(r2, 8)), _mm_add_epi16(_mm_and_si128(r3, mask), _mm_srli_epi16(r3, 8)));
+                    s0 = _mm_srli_epi16(_mm_add_epi16(s0, delta), 2);
+                    s1 = _mm_srli_epi16(_mm_add_epi16(s1, delta), 2);
+                    _mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(s0, s1));
+                }
+            }
+#endif
+            for (; i < n; i++)
+                pDst[i] = (uchar)((pRow0[2 * i] + pRow0[2 * i + 1] + pRow1[2 * i] + pRow1[2 * i + 1] + ((i & 1) ? b : a)) >> 2);
+        }
+
+        // pDst = rounded average of pDst and pSrc (vertical chroma subsampling of 4:2:2 input)
+        static void average_u8(uchar *pDst, const uchar *pSrc, int n)
         {
-            for (; num_pixels; pDst += 3, pSrc += 4, num_pixels--)
+            int i = 0;
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
             {
-                const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
-                pDst[0] = static_cast<uchar>((r * YR + g * YG + b * YB + 32768) >> 16);
-                pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
-                pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+                for (; i <= n - 16; i += 16)
+                    _mm_storeu_si128((__m128i*)(pDst + i), _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(pDst + i)), _mm_loadu_si128((const __m128i*)(pSrc + i))));
             }
+#endif
+            for (; i < n; i++)
+                pDst[i] = (uchar)((pDst[i] + pSrc[i] + 1) >> 1);
         }
 
-        // Forward DCT - DCT derived from jfdctint.
-        enum { CONST_BITS = 13, ROW_BITS = 2 };
+        // Forward DCT - DCT derived from jfdctint (CONST_BITS and ROW_BITS are in mjpegwriter_simd.hpp).
 #define DCT_DESCALE(x, n) (((x) + (((int)1) << ((n) - 1))) >> (n))
-#define DCT_MUL(var, c) (static_cast<short>(var) * static_cast<int>(c))
+#define DCT_MUL(var, c) ((var) * static_cast<int>(c))
 #define DCT1D(s0, s1, s2, s3, s4, s5, s6, s7) \
     int t0 = s0 + s7, t7 = s0 - s7, t1 = s1 + s6, t6 = s1 - s6, t2 = s2 + s5, t5 = s2 - s5, t3 = s3 + s4, t4 = s3 - s4; \
     int t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2; \
@@ -482,30 +2485,211 @@ namespace jcodec{
     u3 += z5; u4 += z5; \
     s0 = t10 + t11; s1 = t7 + u1 + u4; s3 = t6 + u2 + u3; s4 = t10 - t11; s5 = t5 + u2 + u4; s7 = t4 + u1 + u3;
 
-        void jpeg_encoder::DCT2D(int comp)
+        static void DCT2D_scalar(short *pDst, const uchar *pSrc)
         {
-            int c, shift = 128;
-            int *q = m_sample_array;
-            uchar *q_uchar = m_sample_array_uchar;
+            int c, shift = 128, tmp[64];
+            int *q = tmp;
+            const uchar *q_uchar = pSrc;
             for (c = 7; c >= 0; c--, q += 8, q_uchar += 8)
             {
                 int s0 = (int)q_uchar[0] - shift, s1 = (int)q_uchar[1] - shift, s2 = (int)q_uchar[2] - shift, s3 = (int)q_uchar[3] - shift,
                     s4 = (int)q_uchar[4] - shift, s5 = (int)q_uchar[5] - shift, s6 = (int)q_uchar[6] - shift, s7 = (int)q_uchar[7] - shift;
                 DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
-                q[0] = s0 << ROW_BITS; q[1] = DCT_DESCALE(s1, CONST_BITS - ROW_BITS); q[2] = DCT_DESCALE(s2, CONST_BITS - ROW_BITS); q[3] = DCT_DESCALE(s3, CONST_BITS - ROW_BITS);
-                q[4] = s4 << ROW_BITS; q[5] = DCT_DESCALE(s5, CONST_BITS - ROW_BITS); q[6] = DCT_DESCALE(s6, CONST_BITS - ROW_BITS); q[7] = DCT_DESCALE(s7, CONST_BITS - ROW_BITS);
+                q[0] = s0 * (1 << ROW_BITS); q[1] = DCT_DESCALE(s1, CONST_BITS - ROW_BITS); q[2] = DCT_DESCALE(s2, CONST_BITS - ROW_BITS); q[3] = DCT_DESCALE(s3, CONST_BITS - ROW_BITS);
+                q[4] = s4 * (1 << ROW_BITS); q[5] = DCT_DESCALE(s5, CONST_BITS - ROW_BITS); q[6] = DCT_DESCALE(s6, CONST_BITS - ROW_BITS); q[7] = DCT_DESCALE(s7, CONST_BITS - ROW_BITS);
             }
-            for (q = m_sample_array, q_uchar = m_sample_array_uchar, c = 7; c >= 0; c--, q++, q_uchar++)
+            short *d = pDst;
+            for (q = tmp, c = 7; c >= 0; c--, q++, d++)
             {
                 int s0 = q[0 * 8], s1 = q[1 * 8], s2 = q[2 * 8], s3 = q[3 * 8], s4 = q[4 * 8], s5 = q[5 * 8], s6 = q[6 * 8], s7 = q[7 * 8];
                 DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
-                q[0 * 8] = DCT_DESCALE(s0, ROW_BITS + 3); q[1 * 8] = DCT_DESCALE(s1, CONST_BITS + ROW_BITS + 3); q[2 * 8] = DCT_DESCALE(s2, CONST_BITS + ROW_BITS + 3); q[3 * 8] = DCT_DESCALE(s3, CONST_BITS + ROW_BITS + 3);
-                q[4 * 8] = DCT_DESCALE(s4, ROW_BITS + 3); q[5 * 8] = DCT_DESCALE(s5, CONST_BITS + ROW_BITS + 3); q[6 * 8] = DCT_DESCALE(s6, CONST_BITS + ROW_BITS + 3); q[7 * 8] = DCT_DESCALE(s7, CONST_BITS + ROW_BITS + 3);
+                d[0 * 8] = (short)DCT_DESCALE(s0, ROW_BITS + 3); d[1 * 8] = (short)DCT_DESCALE(s1, CONST_BITS + ROW_BITS + 3); d[2 * 8] = (short)DCT_DESCALE(s2, CONST_BITS + ROW_BITS + 3); d[3 * 8] = (short)DCT_DESCALE(s3, CONST_BITS + ROW_BITS + 3);
+                d[4 * 8] = (short)DCT_DESCALE(s4, ROW_BITS + 3); d[5 * 8] = (short)DCT_DESCALE(s5, CONST_BITS + ROW_BITS + 3); d[6 * 8] = (short)DCT_DESCALE(s6, CONST_BITS + ROW_BITS + 3); d[7 * 8] = (short)DCT_DESCALE(s7, CONST_BITS + ROW_BITS + 3);
+            }
+        }
+
+#if SSE
+        // SSE2 version of DCT2D_scalar with the same results: 16-bit lanes, each product pair of DCT1D
+        // folded into one pmaddwd (the constants below are sums of the jfdctint ones), 32-bit descale.
+        static inline void transpose_8x8(__m128i *v)
+        {
+            __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]), a1 = _mm_unpackhi_epi16(v[0], v[1]);
+            __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]), a3 = _mm_unpackhi_epi16(v[2], v[3]);
+            __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]), a5 = _mm_unpackhi_epi16(v[4], v[5]);
+            __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]), a7 = _mm_unpackhi_epi16(v[6], v[7]);
+            __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+            __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+            __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+            __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+            v[0] = _mm_unpacklo_epi64(b0, b4); v[1] = _mm_unpackhi_epi64(b0, b4);
+            v[2] = _mm_unpacklo_epi64(b1, b5); v[3] = _mm_unpackhi_epi64(b1, b5);
+            v[4] = _mm_unpacklo_epi64(b2, b6); v[5] = _mm_unpackhi_epi64(b2, b6);
+            v[6] = _mm_unpacklo_epi64(b3, b7); v[7] = _mm_unpackhi_epi64(b3, b7);
+        }
+
+        // a * ka + b * kb (k = ka, kb pairs) plus add (lo and hi halves), descaled by shift and packed to 16 bits
+        static inline __m128i dct_madd(__m128i a, __m128i b, __m128i k, __m128i addlo, __m128i addhi, __m128i round, __m128i shift)
+        {
+            __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k), addlo);
+            __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k), addhi);
+            return _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(lo, round), shift), _mm_sra_epi32(_mm_add_epi32(hi, round), shift));
+        }
+
+        // DCT1D on 8 lanes; the row pass (cols = false) leaves ROW_BITS of extra precision, the column pass removes it.
+        static inline void DCT1D_sse2(__m128i *v, bool cols)
+        {
+            const __m128i z = _mm_setzero_si128();
+            const int n = cols ? CONST_BITS + ROW_BITS + 3 : CONST_BITS - ROW_BITS;
+            const __m128i round = _mm_set1_epi32(1 << (n - 1)), shift = _mm_cvtsi32_si128(n);
+            __m128i t0 = _mm_add_epi16(v[0], v[7]), t7 = _mm_sub_epi16(v[0], v[7]), t1 = _mm_add_epi16(v[1], v[6]), t6 = _mm_sub_epi16(v[1], v[6]);
+            __m128i t2 = _mm_add_epi16(v[2], v[5]), t5 = _mm_sub_epi16(v[2], v[5]), t3 = _mm_add_epi16(v[3], v[4]), t4 = _mm_sub_epi16(v[3], v[4]);
+            __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3), t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);
+
+            if (cols)
+            {
+                const __m128i r = _mm_set1_epi16(1 << (ROW_BITS + 2));
+                v[0] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(t10, t11), r), ROW_BITS + 3);
+                v[4] = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(t10, t11), r), ROW_BITS + 3);
             }
+            else
+            {
+                v[0] = _mm_slli_epi16(_mm_add_epi16(t10, t11), ROW_BITS);
+                v[4] = _mm_slli_epi16(_mm_sub_epi16(t10, t11), ROW_BITS);
+            }
+            v[2] = dct_madd(t12, t13, _mm_setr_epi16(4433, 10703, 4433, 10703, 4433, 10703, 4433, 10703), z, z, round, shift);
+            v[6] = dct_madd(t12, t13, _mm_setr_epi16(-10704, 4433, -10704, 4433, -10704, 4433, -10704, 4433), z, z, round, shift);
+
+            // z3 = (t4 + t6) * -16069 + z5, z4 = (t5 + t7) * -3196 + z5, z5 = (t4 + t5 + t6 + t7) * 9633
+            __m128i u3 = _mm_add_epi16(t4, t6), u4 = _mm_add_epi16(t5, t7);
+            const __m128i k3 = _mm_setr_epi16(-6436, 9633, -6436, 9633, -6436, 9633, -6436, 9633), k4 = _mm_setr_epi16(9633, 6437, 9633, 6437, 9633, 6437, 9633, 6437);
+            __m128i z3lo = _mm_madd_epi16(_mm_unpacklo_epi16(u3, u4), k3), z3hi = _mm_madd_epi16(_mm_unpackhi_epi16(u3, u4), k3);
+            __m128i z4lo = _mm_madd_epi16(_mm_unpacklo_epi16(u3, u4), k4), z4hi = _mm_madd_epi16(_mm_unpackhi_epi16(u3, u4), k4);
+            v[1] = dct_madd(t4, t7, _mm_setr_epi16(-7373, 4926, -7373, 4926, -7373, 4926, -7373, 4926), z4lo, z4hi, round, shift);
+            v[7] = dct_madd(t4, t7, _mm_setr_epi16(-4927, -7373, -4927, -7373, -4927, -7373, -4927, -7373), z3lo, z3hi, round, shift);
+            v[3] = dct_madd(t5, t6, _mm_setr_epi16(-20995, 4177, -20995, 4177, -20995, 4177, -20995, 4177), z3lo, z3hi, round, shift);
+            v[5] = dct_madd(t5, t6, _mm_setr_epi16(-4176, -20995, -4176, -20995, -4176, -20995, -4176, -20995), z4lo, z4hi, round, shift);
+        }
+
+        static void DCT2D_sse2(short *pDst, const uchar *pSrc)
+        {
+            const __m128i z = _mm_setzero_si128(), c128 = _mm_set1_epi16(128);
+            __m128i v[8];
+            for (int i = 0; i < 8; i++)
+                v[i] = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pSrc + i * 8)), z), c128);
+            transpose_8x8(v);
+            DCT1D_sse2(v, false);
+            transpose_8x8(v);
+            DCT1D_sse2(v, true);
+            for (int i = 0; i < 8; i++)
+                _mm_storeu_si128((__m128i*)(pDst + i * 8), v[i]);
+        }
+#endif
+
+        // Forward DCT of the blocks gathered for the current MCU, as many at once as the kernels allow.
+        void jpeg_encoder::DCT2D(int num_blocks)
+        {
+            int b = 0;
+            if (s_kernels.fdct_8x8_x4)
+                for (; b + 4 <= num_blocks; b += 4)
+                    s_kernels.fdct_8x8_x4(m_sample_array[b], m_sample_array_uchar[b]);
+            if (s_kernels.fdct_8x8_x2)
+                for (; b + 2 <= num_blocks; b += 2)
+                    s_kernels.fdct_8x8_x2(m_sample_array[b], m_sample_array_uchar[b]);
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                for (; b < num_blocks; b++)
+                    DCT2D_sse2(m_sample_array[b], m_sample_array_uchar[b]);
+                return;
+            }
+#endif
+            for (; b < num_blocks; b++)
+                DCT2D_scalar(m_sample_array[b], m_sample_array_uchar[b]);
         }
 
         struct sym_freq { uint m_key, m_sym_index; };
 
+        // Radix sorts sym_freq[] array by 32-bit key m_key. Returns ptr to sorted values.
+        static inline sym_freq* radix_sort_syms(uint num_syms, sym_freq* pSyms0, sym_freq* pSyms1)
+        {
+            const uint cMaxPasses = 4;
+            uint hist[256 * cMaxPasses]; clear_obj(hist);
+            for (uint i = 0; i < num_syms; i++)
+            {
+                uint freq = pSyms0[i].m_key;
+                hist[freq & 0xFF]++; hist[256 + ((freq >> 8) & 0xFF)]++; hist[256 * 2 + ((freq >> 16) & 0xFF)]++; hist[256 * 3 + ((freq >> 24) & 0xFF)]++;
+            }
+            sym_freq* pCur_syms = pSyms0, *pNew_syms = pSyms1;
+            uint total_passes = cMaxPasses;
+            while ((total_passes > 1) && (num_syms == hist[(total_passes - 1) * 256]))
+                total_passes--;
+            for (uint pass_shift = 0, pass = 0; pass < total_passes; pass++, pass_shift += 8)
+            {
+                const uint* pHist = &hist[pass << 8];
+                uint offsets[256], cur_ofs = 0;
+                for (uint i = 0; i < 256; i++)
+                {
+                    offsets[i] = cur_ofs; cur_ofs += pHist[i];
+                }
+                for (uint i = 0; i < num_syms; i++)
+                    pNew_syms[offsets[(pCur_syms[i].m_key >> pass_shift) & 0xFF]++] = pCur_syms[i];
+                sym_freq* t = pCur_syms; pCur_syms = pNew_syms; pNew_syms = t;
+            }
+            return pCur_syms;
+        }
+
+        // calculate_minimum_redundancy() originally written by: Alistair Moffat, alistair@cs.mu.oz.au, Jyrki Katajainen, jyrki@diku.dk, November 1996.
+        // In place: sorted frequencies in, code lengths out.
+        static void calculate_minimum_redundancy(sym_freq *A, int n)
+        {
+            int root, leaf, next, avbl, used, dpth;
+            if (n == 0) return;
+            else if (n == 1) { A[0].m_key = 1; return; }
+            A[0].m_key += A[1].m_key; root = 0; leaf = 2;
+            for (next = 1; next < n - 1; next++)
+            {
+                if (leaf >= n || A[root].m_key < A[leaf].m_key) { A[next].m_key = A[root].m_key; A[root++].m_key = next; }
+                else A[next].m_key = A[leaf++].m_key;
+                if (leaf >= n || (root < next && A[root].m_key < A[leaf].m_key)) { A[next].m_key += A[root].m_key; A[root++].m_key = next; }
+                else A[next].m_key += A[leaf++].m_key;
+            }
+            A[n - 2].m_key = 0;
+            for (next = n - 3; next >= 0; next--) A[next].m_key = A[A[next].m_key].m_key + 1;
+            avbl = 1; used = dpth = 0; root = n - 2; next = n - 1;
+            while (avbl > 0)
+            {
+                while (root >= 0 && (int)A[root].m_key == dpth) { used++; root--; }
+                while (avbl > used) { A[next--].m_key = dpth; avbl--; }
+                avbl = 2 * used; dpth++; used = 0;
+            }
+        }
+
+        // Limits canonical Huffman code table's max code size to max_code_size.
+        static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
+        {
+            if (code_list_len <= 1) return;
+
+            for (int i = max_code_size + 1; i <= MAX_HUFF_CODESIZE; i++)
+                pNum_codes[max_code_size] += pNum_codes[i];
+
+            uint total = 0;
+            for (int i = max_code_size; i > 0; i--)
+                total += (((uint)pNum_codes[i]) << (max_code_size - i));
+
+            while (total != (1UL << max_code_size))
+            {
+                pNum_codes[max_code_size]--;
+                for (int i = max_code_size - 1; i > 0; i--)
+                {
+                    if (pNum_codes[i])
+                    {
+                        pNum_codes[i]--; pNum_codes[i + 1] += 2; break;
+                    }
+                }
+                total--;
+            }
+        }
+
         // JPEG marker generation.
         void jpeg_encoder::emit_byte(uchar i)
         {
@@ -618,6 +2802,14 @@ namespace jcodec{
             emit_byte(0);
         }
 
+        // Emit restart interval (in MCUs)
+        void jpeg_encoder::emit_dri()
+        {
+            emit_marker(M_DRI);
+            emit_word(4);
+            emit_word(m_restart_interval);
+        }
+
         // Emit all markers at beginning of image file.
         void jpeg_encoder::emit_markers()
         {
@@ -626,6 +2818,8 @@ namespace jcodec{
             emit_dqt();
             emit_sof();
             emit_dhts();
+            if (m_restart_interval)
+                emit_dri();
             emit_sos();
         }
 
@@ -663,14 +2857,108 @@ namespace jcodec{
             }
         }
 
+        // Generates an optimized Huffman table (m_huff_bits/m_huff_val) from the symbol counts of m_huff_count.
+        void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
+        {
+            sym_freq syms0[MAX_HUFF_SYMBOLS], syms1[MAX_HUFF_SYMBOLS];
+            syms0[0].m_key = 1; syms0[0].m_sym_index = 0;  // dummy symbol, assures that no valid code contains all 1's
+            int num_used_syms = 1;
+            const uint *pSym_count = &m_huff_count[table_num][0];
+            for (int i = 0; i < table_len; i++)
+                if (pSym_count[i])
+                {
+                    syms0[num_used_syms].m_key = pSym_count[i]; syms0[num_used_syms++].m_sym_index = i + 1;
+                }
+            sym_freq* pSyms = radix_sort_syms(num_used_syms, syms0, syms1);
+            calculate_minimum_redundancy(pSyms, num_used_syms);
+
+            // Count the # of symbols of each code size.
+            int num_codes[1 + MAX_HUFF_CODESIZE]; clear_obj(num_codes);
+            for (int i = 0; i < num_used_syms; i++)
+                num_codes[pSyms[i].m_key]++;
+
+            const uint JPGE_CODE_SIZE_LIMIT = 16;
+            huffman_enforce_max_code_size(num_codes, num_used_syms, JPGE_CODE_SIZE_LIMIT);
+
+            // Compute m_huff_bits array, which contains the # of symbols per code size.
+            clear_obj(m_huff_bits[table_num]);
+            for (int i = 1; i <= (int)JPGE_CODE_SIZE_LIMIT; i++)
+                m_huff_bits[table_num][i] = static_cast<uchar>(num_codes[i]);
+
+            // Remove the dummy symbol added above, which must be in largest bucket.
+            for (int i = JPGE_CODE_SIZE_LIMIT; i >= 1; i--)
+            {
+                if (m_huff_bits[table_num][i])
+                {
+                    m_huff_bits[table_num][i]--; break;
+                }
+            }
+
+            // Compute the m_huff_val array, which contains the symbol indices sorted by code size (smallest to largest).
+            for (int i = num_used_syms - 1; i >= 1; i--)
+                m_huff_val[table_num][num_used_syms - 1 - i] = static_cast<uchar>(pSyms[i].m_sym_index - 1);
+        }
+
+        // Builds optimized tables (luma, and chroma if asked) from m_huff_count and their codes.
+        void jpeg_encoder::optimize_huffman_tables(bool chroma)
+        {
+            optimize_huffman_table(0 + 0, DC_LUM_CODES);
+            optimize_huffman_table(2 + 0, AC_LUM_CODES);
+            compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
+            compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
+            if (chroma)
+            {
+                optimize_huffman_table(0 + 1, DC_CHROMA_CODES);
+                optimize_huffman_table(2 + 1, AC_CHROMA_CODES);
+                compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
+                compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
+            }
+            m_huff_tables_std = false;
+        }
+
+        // Copies the Huffman tables (and their codes) of src.
+        void jpeg_encoder::copy_huffman_tables(const jpeg_encoder &src)
+        {
+            memcpy(m_huff_codes, src.m_huff_codes, sizeof(m_huff_codes));
+            memcpy(m_huff_code_sizes, src.m_huff_code_sizes, sizeof(m_huff_code_sizes));
+            memcpy(m_huff_bits, src.m_huff_bits, sizeof(m_huff_bits));
+            memcpy(m_huff_val, src.m_huff_val, sizeof(m_huff_val));
+            m_huff_tables_std = false;
+            m_huff_tables_fixed = true;
+        }
+
+        void jpeg_encoder::set_huffman_tables(const huffman_counts *counts)
+        {
+            if (!counts)
+            {
+                m_huff_tables_fixed = false;
+                m_huff_tables_std = false;
+                return;
+            }
+            memcpy(m_huff_count, counts->m_count, sizeof(m_huff_count));
+            // every symbol a baseline image can produce needs a code, also the ones not seen in counts
+            for (int t = 0; t < 2; t++)
+            for (int i = 0; i < DC_LUM_CODES; i++)
+                m_huff_count[t][i] = JPGE_MAX(m_huff_count[t][i], 1U);
+            for (int t = 2; t < 4; t++)
+            for (int i = 0; i < AC_LUM_CODES; i++)
+                if ((i == 0) || (i == 0xF0) || (((i & 15) >= 1) && ((i & 15) <= 10)))
+                    m_huff_count[t][i] = JPGE_MAX(m_huff_count[t][i], 1U);
+            optimize_huffman_tables(true);
+            m_huff_tables_fixed = true;
+        }
+
+        void jpeg_encoder::add_huffman_counts(huffman_counts &counts) const
+        {
+            for (int t = 0; t < 4; t++)
+            for (int i = 0; i < 256; i++)
+                counts.m_count[t][i] += m_huff_count[t][i];
+        }
+
         // Quantization table generation.
         void jpeg_encoder::compute_quant_table(int *pDst, short *pSrc)
         {
-            int q;
-            if (m_params.m_quality < 50)
-                q = 5000 / m_params.m_quality;
-            else
-                q = 200 - m_params.m_quality * 2;
+            const int q = m_params.quant_scale();
             for (int i = 0; i < 64; i++)
             {
                 int j = *pSrc++; j = (j * q + 50L) / 100L;
@@ -678,100 +2966,239 @@ namespace jcodec{
             }
         }
 
+        // Reciprocals replacing the division of load_quantized_coefficients. With x = |coefficient| + q / 2
+        // (x < 2^14 for any DCT output) and s = floor(log2(q)) + 1, the quotient x / q is exactly
+        // ((4x * m) >> 16) * 2^(16 - s) >> 16 for m = 2^(14 + s) / q + 1; both factors fit in 16 bits.
+        void jpeg_encoder::compute_quant_recip(ushort *pDst, const int *pSrc)
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                int q = pSrc[i], s = 0;
+                while ((1 << s) <= q)
+                    s++;
+                pDst[i] = static_cast<ushort>(q >> 1);
+                pDst[64 + i] = static_cast<ushort>((1 << (14 + s)) / q + 1);
+                pDst[128 + i] = static_cast<ushort>(1 << (16 - s));
+            }
+        }
+
         // Higher-level methods.
         void jpeg_encoder::first_pass_init()
         {
             m_bit_buffer = 0; m_bits_in = 0;
             memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
             m_mcu_y_ofs = 0;
+            m_mcu_blocks = 0;
             m_pass_num = 1;
         }
 
+        // Huffman codes must be ready (standard, optimized or fixed tables).
         bool jpeg_encoder::second_pass_init()
         {
-            compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
-            compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
-            if (m_num_components > 1)
-            {
-                compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
-                compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
-            }
             first_pass_init();
-            emit_markers();
+            if (!m_scan_only)
+                emit_markers();
             m_pass_num = 2;
             return true;
         }
 
-        bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+        bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_format)
         {
             m_num_components = 3;
-            m_comp_h_samp[0] = 2; m_comp_v_samp[0] = 2;
-            m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
-            m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
-            m_mcu_x = 16; m_mcu_y = 16;
+            switch (m_params.m_subsampling)
+            {
+            case Y_ONLY:
+                {
+                    m_num_components = 1;
+                    m_comp_h_samp[0] = 1; m_comp_v_samp[0] = 1;
+                    m_mcu_x = 8; m_mcu_y = 8;
+                    break;
+                }
+            case H1V1:
+                {
+                    m_comp_h_samp[0] = 1; m_comp_v_samp[0] = 1;
+                    m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
+                    m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
+                    m_mcu_x = 8; m_mcu_y = 8;
+                    break;
+                }
+            case H2V1:
+                {
+                    m_comp_h_samp[0] = 2; m_comp_v_samp[0] = 1;
+                    m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
+                    m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
+                    m_mcu_x = 16; m_mcu_y = 8;
+                    break;
+                }
+            case H2V2:
+                {
+                    m_comp_h_samp[0] = 2; m_comp_v_samp[0] = 2;
+                    m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
+                    m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
+                    m_mcu_x = 16; m_mcu_y = 16;
+                }
+            }
 
             m_image_x = p_x_res; m_image_y = p_y_res;
-            m_image_bpp = src_channels;
-            m_image_bpl = m_image_x * src_channels;
+            m_image_format = src_format;
+            const int format8 = src_format & ~PF_16BIT;
+            const int channels = (format8 == PF_YUYV) ? 2 : (format8 == PF_BGR) ? 3 : (format8 >= PF_BGRA) && (format8 <= PF_RGBA) ? 4 : 1;
+            m_image_bpp = (src_format & PF_16BIT) ? channels * 2 : channels;
+            m_image_bpl = m_image_x * m_image_bpp;
             m_image_x_mcu = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
             m_image_y_mcu = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
             m_image_bpl_xlt = m_image_x * m_num_components;
             m_image_bpl_mcu = m_image_x_mcu * m_num_components;
             m_mcus_per_row = m_image_x_mcu / m_mcu_x;
 
-            if (((m_mcu_linesY[0] = static_cast<uchar*>(jpge_malloc(m_image_x_mcu * m_mcu_y))) == 0) || 
-                ((m_mcu_linesCb[0] = static_cast<uchar*>(jpge_malloc(m_image_x_mcu * m_mcu_y))) == 0) ||
-                ((m_mcu_linesCr[0] = static_cast<uchar*>(jpge_malloc(m_image_x_mcu * m_mcu_y))) == 0)) return false;
-            for (int i = 1; i < m_mcu_y; i++)
+            // subsampled YUV goes straight into subsampled chroma lines, colour is subsampled while
+            // it is converted for H2V2
+            m_chroma_ds = (m_num_components == 3) && (m_comp_h_samp[0] == 2) &&
+                ((format8 >= PF_YUYV) || ((format8 != PF_GRAY) && (m_comp_v_samp[0] == 2)));
+            // YUYV chroma row, then the U and V halves of a split row;
+            // for BGR(A) the Cb and Cr rows of a row pair
+            if (format8 >= PF_YUYV)
+                m_src_line.resize(m_image_x * 2);
+            else if (m_chroma_ds)
+                m_src_line.resize(m_image_x_mcu * 4);
+            if (src_format & PF_16BIT)
+                m_src_row8.resize(m_image_x * channels);
+
+            // Whole MCU rows per stripe; the restart interval (a 16-bit MCU count) must cover exactly one stripe.
+            m_restart_interval = m_stripe_rows = 0;
+            int mcu_rows = m_image_y_mcu / m_mcu_y;
+            if ((m_params.m_stripes > 1) && (mcu_rows > 1) && (m_mcus_per_row <= 65535))
+            {
+                m_stripe_rows = JPGE_MIN((mcu_rows + m_params.m_stripes - 1) / m_params.m_stripes, 65535 / m_mcus_per_row);
+                m_restart_interval = m_stripe_rows * m_mcus_per_row;
+            }
+
+            // MCU line buffers survive between images of the same width. They always hold
+            // 16 lines so a change of subsampling does not need a new allocation.
+            if (m_mcu_lines_x != m_image_x_mcu)
             {
-                m_mcu_linesY[i] = m_mcu_linesY[i - 1] + m_image_x_mcu;
-                m_mcu_linesCb[i] = m_mcu_linesCb[i - 1] + m_image_x_mcu;
-                m_mcu_linesCr[i] = m_mcu_linesCr[i - 1] + m_image_x_mcu;
+                jpge_free(m_mcu_linesY[0]); jpge_free(m_mcu_linesCb[0]); jpge_free(m_mcu_linesCr[0]);
+                m_mcu_linesY[0] = m_mcu_linesCb[0] = m_mcu_linesCr[0] = 0;
+                m_mcu_lines_x = 0;
+                if (((m_mcu_linesY[0] = static_cast<uchar*>(jpge_malloc(m_image_x_mcu * 16))) == 0) || 
+                    ((m_mcu_linesCb[0] = static_cast<uchar*>(jpge_malloc(m_image_x_mcu * 16))) == 0) ||
+                    ((m_mcu_linesCr[0] = static_cast<uchar*>(jpge_malloc(m_image_x_mcu * 16))) == 0)) return false;
+                for (int i = 1; i < 16; i++)
+                {
+                    m_mcu_linesY[i] = m_mcu_linesY[i - 1] + m_image_x_mcu;
+                    m_mcu_linesCb[i] = m_mcu_linesCb[i - 1] + m_image_x_mcu;
+                    m_mcu_linesCr[i] = m_mcu_linesCr[i - 1] + m_image_x_mcu;
+                }
+                m_mcu_lines_x = m_image_x_mcu;
             }
 
-            compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-            compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+            if ((m_quant_scale != m_params.quant_scale()) || (m_quant_no_chroma_discrim != m_params.m_no_chroma_discrim_flag))
+            {
+                compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
+                compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+                compute_quant_recip(m_quant_recip[0], m_quantization_tables[0]);
+                compute_quant_recip(m_quant_recip[1], m_quantization_tables[1]);
+                m_quant_scale = m_params.quant_scale();
+                m_quant_no_chroma_discrim = m_params.m_no_chroma_discrim_flag;
+            }
 
             m_out_buf_left = JPGE_OUT_BUF_SIZE;
             m_pOut_buf = m_out_buf;
 
+            if (m_params.m_two_pass_flag || m_params.m_huff_stats_flag)
+                clear_obj(m_huff_count);
             if (m_params.m_two_pass_flag)
             {
-                clear_obj(m_huff_count);
+                // pass one only gathers symbol statistics; markers are emitted once the tables are optimized.
+                // The tables of set_huffman_tables are overwritten.
+                m_huff_tables_fixed = false;
                 first_pass_init();
             }
             else
             {
-                memcpy(m_huff_bits[0 + 0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0 + 0], s_dc_lum_val, DC_LUM_CODES);
-                memcpy(m_huff_bits[2 + 0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2 + 0], s_ac_lum_val, AC_LUM_CODES);
-                memcpy(m_huff_bits[0 + 1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0 + 1], s_dc_chroma_val, DC_CHROMA_CODES);
-                memcpy(m_huff_bits[2 + 1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2 + 1], s_ac_chroma_val, AC_CHROMA_CODES);
+                if (!m_huff_tables_std && !m_huff_tables_fixed)
+                {
+                    memcpy(m_huff_bits[0 + 0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0 + 0], s_dc_lum_val, DC_LUM_CODES);
+                    memcpy(m_huff_bits[2 + 0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2 + 0], s_ac_lum_val, AC_LUM_CODES);
+                    memcpy(m_huff_bits[0 + 1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0 + 1], s_dc_chroma_val, DC_CHROMA_CODES);
+                    memcpy(m_huff_bits[2 + 1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2 + 1], s_ac_chroma_val, AC_CHROMA_CODES);
+                    // chroma tables are built even for grayscale so the cached standard tables fit any later image
+                    compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
+                    compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
+                    compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
+                    compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
+                    m_huff_tables_std = true;
+                }
                 if (!second_pass_init()) return false;   // in effect, skip over the first pass
             }
             return m_all_stream_writes_succeeded;
         }
-        void jpeg_encoder::load_block_8_8(int x, int y)
+        void jpeg_encoder::load_block_8_8(int x, int y, int c)
         {
+            uchar **pSrc = (c == 0) ? m_mcu_linesY : (c == 1) ? m_mcu_linesCb : m_mcu_linesCr;
+            uchar *pDst = add_block(c);
 #if SSE
-            uchar *pDst = m_sample_array_uchar;
             x <<= 3;
             y <<= 3;
             __m128i str;
             for (int i = 0; i < 8; i++, pDst += 8)
             {
-                str = _mm_loadl_epi64((const __m128i*)(m_mcu_linesY[y + i] + x));
-                _mm_storel_epi64((__m128i*)pDst, str);
+                str = _mm_loadl_epi64((const __m128i*)(pSrc[y + i] + x));
+                _mm_storel_epi64((__m128i*)pDst, str);
+            }
+
+
+#else
+            x <<= 3;
+            y <<= 3;
+            const int n_bytes = 8;
+            for (int i = 0; i < 8; i++, pDst += 8)
+                memcpy(pDst, pSrc[y + i] + x, n_bytes);
+#endif
+        }
+        void jpeg_encoder::load_block_16_8_8(int x, int comp)
+        {
+            uchar *pSrc1, **pSrc;
+            x <<= 4;
+            int a = 0, b = 1;
+            if (comp == 1)
+                pSrc = m_mcu_linesCb;
+            else
+                pSrc = m_mcu_linesCr;
+            uchar *pDst = add_block(comp);
+            if (s_kernels.downsample_h2v1)
+            {
+                s_kernels.downsample_h2v1(pDst, pSrc, x >> 4);
+                return;
             }
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                __m128i r0, r1, res0, res1;
+                __m128i mask = _mm_set1_epi16(255), delta = _mm_setr_epi16(a, b, a, b, a, b, a, b);
 
-
-#else
-            uchar *pDst = m_sample_array_uchar;
-            x <<= 3;
-            y <<= 3;
-            const int n_bytes = 8;
-            for (int i = 0; i < 8; i++, pDst += 8)
-                memcpy(pDst, m_mcu_linesY[y + i] + x, n_bytes);
+                for (int i = 0; i < 8; i += 2, pDst += 16)
+                {
+                    r0 = _mm_loadu_si128((const __m128i*)(pSrc[i + 0] + x));
+                    r1 = _mm_loadu_si128((const __m128i*)(pSrc[i + 1] + x));
+                    res0 = _mm_add_epi16(_mm_and_si128(r0, mask), _mm_srli_epi16(r0, 8)); // u0+u1 u2+u3 ...
+                    res1 = _mm_add_epi16(_mm_and_si128(r1, mask), _mm_srli_epi16(r1, 8));
+                    res0 = _mm_srli_epi16(_mm_add_epi16(res0, delta), 1);
+                    res1 = _mm_srli_epi16(_mm_add_epi16(res1, delta), 1);
+
+                    _mm_storeu_si128((__m128i*)pDst, _mm_packus_epi16(res0, res1));
+                }
+                return;
+            }
 #endif
+            for (int i = 0; i < 8; i++, pDst += 8)
+            {
+                pSrc1 = pSrc[i] + x;
+                pDst[0] = (uchar)((pSrc1[0] + pSrc1[1] + a) >> 1); pDst[1] = (uchar)((pSrc1[2] + pSrc1[3] + b) >> 1);
+                pDst[2] = (uchar)((pSrc1[4] + pSrc1[5] + a) >> 1); pDst[3] = (uchar)((pSrc1[6] + pSrc1[7] + b) >> 1);
+                pDst[4] = (uchar)((pSrc1[8] + pSrc1[9] + a) >> 1); pDst[5] = (uchar)((pSrc1[10] + pSrc1[11] + b) >> 1);
+                pDst[6] = (uchar)((pSrc1[12] + pSrc1[13] + a) >> 1); pDst[7] = (uchar)((pSrc1[14] + pSrc1[15] + b) >> 1);
+            }
         }
         void jpeg_encoder::load_block_16_8(int x, int comp)
         {
@@ -782,40 +3209,49 @@ namespace jcodec{
                 pSrc = m_mcu_linesCb;
             else
                 pSrc = m_mcu_linesCr;
+            uchar *pDst = add_block(comp);
+            if (s_kernels.downsample_h2v2)
+            {
+                s_kernels.downsample_h2v2(pDst, pSrc, x >> 4);
+                return;
+            }
 #if SSE
-            uchar *pDst = m_sample_array_uchar;
-            __m128i r0, r1, a0, b0, a1, b1, res0, res1; 
-            __m128i z = _mm_setzero_si128(), mask = _mm_set1_epi16(255), delta = _mm_set1_epi16(2);
-
-            const int di = 4;
-            for (int i = 0; i < 16; i += di, pDst += di * 4)
+            if (s_simd_level >= SIMD_SSE2)
             {
-                pSrc1 = pSrc[i + 0] + x;
-                pSrc2 = pSrc[i + 1] + x;
-                r0 = _mm_loadu_si128((const __m128i*)pSrc1);
-                r1 = _mm_loadu_si128((const __m128i*)pSrc2);
-                a0 = _mm_and_si128(r0, mask); // u0 0 u2 0 u4 0 ...
-                b0 = _mm_srli_epi16(r0, 8); // u1 0 u3 0 u5 0 ...
-                a1 = _mm_and_si128(r1, mask); // u0' 0 u2' 0 u4' 0 ...
-                b1 = _mm_srli_epi16(r1, 8); // u1' 0 u3' 0 u5' 0 ...
-                res0 = _mm_add_epi16(_mm_add_epi16(a0, b0), _mm_add_epi16(a1, b1));
-                res0 = _mm_srli_epi16(_mm_add_epi16(res0, delta), 2);
-
-                pSrc1 = pSrc[i + 2] + x;
-                pSrc2 = pSrc[i + 3] + x;
-                r0 = _mm_loadu_si128((const __m128i*)pSrc1);
-                r1 = _mm_loadu_si128((const __m128i*)pSrc2);
-                a0 = _mm_and_si128(r0, mask); // u0 0 u2 0 u4 0 ...
-                b0 = _mm_srli_epi16(r0, 8); // u1 0 u3 0 u5 0 ...
-                a1 = _mm_and_si128(r1, mask); // u0' 0 u2' 0 u4' 0 ...
-                b1 = _mm_srli_epi16(r1, 8); // u1' 0 u3' 0 u5' 0 ...
-                res1 = _mm_add_epi16(_mm_add_epi16(a0, b0), _mm_add_epi16(a1, b1));
-                res1 = _mm_srli_epi16(_mm_add_epi16(res1, delta), 2);
+                __m128i r0, r1, a0, b0, a1, b1, res0, res1; 
+                // same bias as the scalar code: 0/2 alternating per pixel, flipped on odd rows
+                __m128i mask = _mm_set1_epi16(255), delta0 = _mm_setr_epi16(a, b, a, b, a, b, a, b), delta1 = _mm_setr_epi16(b, a, b, a, b, a, b, a);
+
+                const int di = 4;
+                for (int i = 0; i < 16; i += di, pDst += di * 4)
+                {
+                    pSrc1 = pSrc[i + 0] + x;
+                    pSrc2 = pSrc[i + 1] + x;
+                    r0 = _mm_loadu_si128((const __m128i*)pSrc1);
+                    r1 = _mm_loadu_si128((const __m128i*)pSrc2);
+                    a0 = _mm_and_si128(r0, mask); // u0 0 u2 0 u4 0 ...
+                    b0 = _mm_srli_epi16(r0, 8); // u1 0 u3 0 u5 0 ...
+                    a1 = _mm_and_si128(r1, mask); // u0' 0 u2' 0 u4' 0 ...
+                    b1 = _mm_srli_epi16(r1, 8); // u1' 0 u3' 0 u5' 0 ...
+                    res0 = _mm_add_epi16(_mm_add_epi16(a0, b0), _mm_add_epi16(a1, b1));
+                    res0 = _mm_srli_epi16(_mm_add_epi16(res0, delta0), 2);
+
+                    pSrc1 = pSrc[i + 2] + x;
+                    pSrc2 = pSrc[i + 3] + x;
+                    r0 = _mm_loadu_si128((const __m128i*)pSrc1);
+                    r1 = _mm_loadu_si128((const __m128i*)pSrc2);
+                    a0 = _mm_and_si128(r0, mask); // u0 0 u2 0 u4 0 ...
+                    b0 = _mm_srli_epi16(r0, 8); // u1 0 u3 0 u5 0 ...
+                    a1 = _mm_and_si128(r1, mask); // u0' 0 u2' 0 u4' 0 ...
+                    b1 = _mm_srli_epi16(r1, 8); // u1' 0 u3' 0 u5' 0 ...
+                    res1 = _mm_add_epi16(_mm_add_epi16(a0, b0), _mm_add_epi16(a1, b1));
+                    res1 = _mm_srli_epi16(_mm_add_epi16(res1, delta1), 2);
                 
-                _mm_storeu_si128((__m128i*)pDst, _mm_packus_epi16(res0, res1));
+                    _mm_storeu_si128((__m128i*)pDst, _mm_packus_epi16(res0, res1));
+                }
+                return;
             }
-#else
-            uchar *pDst = m_sample_array_uchar;
+#endif
             for (int i = 0; i < 16; i += 2, pDst += 8)
             {
                 pSrc1 = pSrc[i + 0] + x;
@@ -826,31 +3262,48 @@ namespace jcodec{
                 pDst[6] = (uchar)((pSrc1[12] + pSrc1[13] + pSrc2[12] + pSrc2[13] + a) >> 2); pDst[7] = (uchar)((pSrc1[14] + pSrc1[15] + pSrc2[14] + pSrc2[15] + b) >> 2);
                 int temp = a; a = b; b = temp;
             }
-#endif
         }
 
-        void jpeg_encoder::load_quantized_coefficients(int component_num)
+#if SSE
+        // Zig-zag gather into the lanes, then quantize 8 coefficients with the reciprocals
+        static void quantize_sse2(short *pDst, const short *pSrc, const ushort *pRecip)
+        {
+            for (int i = 0; i < 64; i += 8)
+            {
+                const uchar *z = s_zag + i;
+                __m128i v = _mm_setr_epi16(pSrc[z[0]], pSrc[z[1]], pSrc[z[2]], pSrc[z[3]], pSrc[z[4]], pSrc[z[5]], pSrc[z[6]], pSrc[z[7]]);
+                __m128i sign = _mm_srai_epi16(v, 15);
+                v = _mm_add_epi16(_mm_sub_epi16(_mm_xor_si128(v, sign), sign), _mm_loadu_si128((const __m128i*)(pRecip + i)));
+                v = _mm_mulhi_epu16(_mm_slli_epi16(v, 2), _mm_loadu_si128((const __m128i*)(pRecip + 64 + i)));
+                v = _mm_mulhi_epu16(v, _mm_loadu_si128((const __m128i*)(pRecip + 128 + i)));
+                _mm_storeu_si128((__m128i*)(pDst + i), _mm_sub_epi16(_mm_xor_si128(v, sign), sign));
+            }
+        }
+#endif
+
+        void jpeg_encoder::load_quantized_coefficients(int block_num)
         {
-            int *q = m_quantization_tables[component_num > 0];
+            const ushort *pRecip = m_quant_recip[m_mcu_block_comp[block_num] > 0];
+            const sample_array_t *pSrc = m_sample_array[block_num];
             short *pDst = m_coefficient_array;
+            if (s_kernels.quantize_8x8)
+            {
+                s_kernels.quantize_8x8(pDst, pSrc, pRecip);
+                return;
+            }
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                quantize_sse2(pDst, pSrc, pRecip);
+                return;
+            }
+#endif
             for (int i = 0; i < 64; i++)
             {
-                sample_array_t j = m_sample_array[s_zag[i]];
-                if (j < 0)
-                {
-                    if ((j = -j + (*q >> 1)) < *q)
-                        *pDst++ = 0;
-                    else
-                        *pDst++ = static_cast<short>(-(j / *q));
-                }
-                else
-                {
-                    if ((j = j + (*q >> 1)) < *q)
-                        *pDst++ = 0;
-                    else
-                        *pDst++ = static_cast<short>((j / *q));
-                }
-                q++;
+                int j = pSrc[s_zag[i]];
+                uint x = static_cast<uint>((j < 0 ? -j : j) + pRecip[i]) << 2;
+                int r = static_cast<int>((((x * pRecip[64 + i]) >> 16) * pRecip[128 + i]) >> 16);
+                *pDst++ = static_cast<short>(j < 0 ? -r : r);
             }
         }
 
@@ -862,23 +3315,145 @@ namespace jcodec{
             m_out_buf_left = JPGE_OUT_BUF_SIZE;
         }
 
+#define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
+
+        static inline int ctz64(unsigned long long x)
+        {
+#if defined(_MSC_VER) && defined(_M_X64)
+            unsigned long i;
+            _BitScanForward64(&i, x);
+            return (int)i;
+#elif defined(_MSC_VER)
+            unsigned long i;
+            if (_BitScanForward(&i, (unsigned long)x))
+                return (int)i;
+            _BitScanForward(&i, (unsigned long)(x >> 32));
+            return (int)i + 32;
+#else
+            return __builtin_ctzll(x);
+#endif
+        }
+
+        // Number of significant bits of x (0 for 0), i.e. the JPEG magnitude category
+        static inline int bit_length(uint x)
+        {
+#if defined(_MSC_VER)
+            unsigned long i;
+            return _BitScanReverse(&i, x) ? (int)i + 1 : 0;
+#else
+            return x ? 32 - __builtin_clz(x) : 0;
+#endif
+        }
+
+        // 8 bytes of entropy coded data, most significant first; 0xFF bytes get a stuffed zero.
+        void jpeg_encoder::put_bit_word(unsigned long long w)
+        {
+            if (m_out_buf_left < 16)
+                flush_output_buffer();
+            const unsigned long long ones = 0x0101010101010101ULL, x = ~w;
+            if (!((x - ones) & ~x & (ones << 7)))
+            {
+                // no 0xFF byte anywhere: store the word as is
+                for (int i = 0; i < 8; i++)
+                    m_pOut_buf[i] = (uchar)(w >> (56 - i * 8));
+                m_pOut_buf += 8;
+                m_out_buf_left -= 8;
+                return;
+            }
+            for (int i = 0; i < 8; i++)
+            {
+                uchar c = (uchar)(w >> (56 - i * 8));
+                *m_pOut_buf++ = c;
+                m_out_buf_left--;
+                if (c == 0xFF)
+                {
+                    *m_pOut_buf++ = 0;
+                    m_out_buf_left--;
+                }
+            }
+        }
+
+        // bits must not have bits set above len; len <= 32.
         void jpeg_encoder::put_bits(uint bits, uint len)
         {
-            m_bit_buffer |= ((uint)bits << (24 - (m_bits_in += len)));
+            if (m_bits_in + len < 64)
+            {
+                m_bit_buffer = (m_bit_buffer << len) | bits;
+                m_bits_in += len;
+                return;
+            }
+            // the buffer holds at least 32 bits here, so neither shift reaches 64
+            uint rest = m_bits_in + len - 64;
+            put_bit_word((m_bit_buffer << (len - rest)) | (bits >> rest));
+            m_bit_buffer = bits; // the bits above rest leave the buffer before the next word is taken
+            m_bits_in = rest;
+        }
+
+        // Write out the whole bytes still in the bit buffer (terminate_pass_two pads the last one with ones).
+        void jpeg_encoder::flush_bits()
+        {
             while (m_bits_in >= 8)
             {
-                uchar c;
-#define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
-                JPGE_PUT_BYTE(c = (uchar)((m_bit_buffer >> 16) & 0xFF));
+                uchar c = (uchar)(m_bit_buffer >> (m_bits_in - 8));
+                JPGE_PUT_BYTE(c);
                 if (c == 0xFF) JPGE_PUT_BYTE(0);
-                m_bit_buffer <<= 8;
                 m_bits_in -= 8;
             }
         }
 
+        // Bit i set for each nonzero coefficient i of m_coefficient_array (zig-zag order), the DC excluded.
+        unsigned long long jpeg_encoder::nonzero_ac_mask() const
+        {
+            unsigned long long mask = 0;
+#if SSE
+            if (s_simd_level >= SIMD_SSE2)
+            {
+                const __m128i z = _mm_setzero_si128();
+                for (int i = 0; i < 64; i += 16)
+                {
+                    __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(m_coefficient_array + i)), z);
+                    __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(m_coefficient_array + i + 8)), z);
+                    mask |= (unsigned long long)(uint)(~_mm_movemask_epi8(_mm_packs_epi16(a, b)) & 0xFFFF) << i;
+                }
+                return mask & ~1ULL;
+            }
+#endif
+            for (int i = 1; i < 64; i++)
+                if (m_coefficient_array[i])
+                    mask |= 1ULL << i;
+            return mask;
+        }
+
+        void jpeg_encoder::code_coefficients_pass_one(int component_num)
+        {
+            int i, last, run_len, temp1;
+            short *pSrc = m_coefficient_array;
+            uint *dc_count = component_num ? m_huff_count[0 + 1] : m_huff_count[0 + 0];
+            uint *ac_count = component_num ? m_huff_count[2 + 1] : m_huff_count[2 + 0];
+
+            temp1 = pSrc[0] - m_last_dc_val[component_num];
+            m_last_dc_val[component_num] = pSrc[0];
+            if (temp1 < 0) temp1 = -temp1;
+            dc_count[bit_length(temp1)]++;
+
+            // visit only the nonzero coefficients; the zero runs are the gaps between them
+            unsigned long long mask = nonzero_ac_mask();
+            for (last = 0; mask; mask &= mask - 1, last = i)
+            {
+                i = ctz64(mask);
+                for (run_len = i - last - 1; run_len >= 16; run_len -= 16)
+                    ac_count[0xF0]++;
+                temp1 = pSrc[i];
+                if (temp1 < 0) temp1 = -temp1;
+                ac_count[(run_len << 4) + bit_length(temp1)]++;
+            }
+            if (last != 63)
+                ac_count[0]++;
+        }
+
         void jpeg_encoder::code_coefficients_pass_two(int component_num)
         {
-            int i, j, run_len, nbits, temp1, temp2;
+            int i, last, run_len, nbits, temp1, temp2;
             short *pSrc = m_coefficient_array;
             uint *codes[2];
             uchar *code_sizes[2];
@@ -902,66 +3477,134 @@ namespace jcodec{
                 temp1 = -temp1; temp2--;
             }
 
-            nbits = 0;
-            while (temp1)
+            // each code goes out together with its value bits (at most 16 + 11 bits)
+            nbits = bit_length(temp1);
+            put_bits((codes[0][nbits] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[0][nbits] + nbits);
+
+            unsigned long long mask = nonzero_ac_mask();
+            for (last = 0; mask; mask &= mask - 1, last = i)
             {
-                nbits++; temp1 >>= 1;
+                i = ctz64(mask);
+                for (run_len = i - last - 1; run_len >= 16; run_len -= 16)
+                    put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
+                temp1 = temp2 = pSrc[i];
+                if (temp1 < 0)
+                {
+                    temp1 = -temp1; temp2--;
+                }
+                nbits = bit_length(temp1);
+                int j = (run_len << 4) + nbits;
+                put_bits((codes[1][j] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[1][j] + nbits);
             }
+            if (last != 63)
+                put_bits(codes[1][0], code_sizes[1][0]);
+        }
+
+        // Next free block of the MCU being loaded
+        uchar *jpeg_encoder::add_block(int component_num)
+        {
+            m_mcu_block_comp[m_mcu_blocks] = static_cast<uchar>(component_num);
+            return m_sample_array_uchar[m_mcu_blocks++];
+        }
 
-            put_bits(codes[0][nbits], code_sizes[0][nbits]);
-            if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
+        // Charges the cycles since the previous lap to stage
+        inline void jpeg_encoder::stage_lap(int stage)
+        {
+            if (m_stage_timing)
+            {
+                unsigned long long t = read_cycles();
+                m_stage_cycles[stage] += t - m_stage_mark;
+                m_stage_mark = t;
+            }
+        }
 
-            for (run_len = 0, i = 1; i < 64; i++)
+        // Transform all blocks of the MCU at once, then quantize and code them in order
+        void jpeg_encoder::code_mcu()
+        {
+            stage_lap(STAGE_CONVERT); // loading the rows and gathering the blocks
+            DCT2D(m_mcu_blocks);
+            stage_lap(STAGE_DCT);
+            for (int b = 0; b < m_mcu_blocks; b++)
             {
-                if ((temp1 = m_coefficient_array[i]) == 0)
-                    run_len++;
+                int component_num = m_mcu_block_comp[b];
+                load_quantized_coefficients(b);
+                stage_lap(STAGE_QUANTIZE);
+                if (m_pass_num == 1)
+                    code_coefficients_pass_one(component_num);
                 else
                 {
-                    while (run_len >= 16)
-                    {
-                        put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
-                        run_len -= 16;
-                    }
-                    if ((temp2 = temp1) < 0)
+                    if (m_params.m_huff_stats_flag)
                     {
-                        temp1 = -temp1;
-                        temp2--;
+                        // count the symbols of this block without disturbing the DC prediction of pass two
+                        int last_dc_val = m_last_dc_val[component_num];
+                        code_coefficients_pass_one(component_num);
+                        m_last_dc_val[component_num] = last_dc_val;
                     }
-                    nbits = 1;
-                    while (temp1 >>= 1)
-                        nbits++;
-                    j = (run_len << 4) + nbits;
-                    put_bits(codes[1][j], code_sizes[1][j]);
-                    put_bits(temp2 & ((1 << nbits) - 1), nbits);
-                    run_len = 0;
+                    code_coefficients_pass_two(component_num);
                 }
+                stage_lap(STAGE_ENTROPY);
             }
-            if (run_len)
-                put_bits(codes[1][0], code_sizes[1][0]);
-        }
-
-        void jpeg_encoder::code_block(int component_num)
-        {
-            DCT2D(component_num);
-            load_quantized_coefficients(component_num);
-            code_coefficients_pass_two(component_num);
+            m_mcu_blocks = 0;
         }
 
         void jpeg_encoder::process_mcu_row()
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
+            if (m_num_components == 1)
+            {
+                for (int i = 0; i < m_mcus_per_row; i++)
+                {
+                    load_block_8_8(i, 0, 0); code_mcu();
+                }
+            }
+            else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
+            {
+                for (int i = 0; i < m_mcus_per_row; i++)
+                {
+                    load_block_8_8(i, 0, 0); load_block_8_8(i, 0, 1); load_block_8_8(i, 0, 2); code_mcu();
+                }
+            }
+            else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
+            {
+                for (int i = 0; i < m_mcus_per_row; i++)
+                {
+                    load_block_8_8(i * 2 + 0, 0, 0); load_block_8_8(i * 2 + 1, 0, 0);
+                    if (m_chroma_ds)
+                    {
+                        load_block_8_8(i, 0, 1); load_block_8_8(i, 0, 2);
+                    }
+                    else
+                    {
+                        load_block_16_8_8(i, 1); load_block_16_8_8(i, 2);
+                    }
+                    code_mcu();
+                }
+            }
+            else
             {
-                load_block_8_8(i * 2 + 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0); code_block(0);
-                load_block_8_8(i * 2 + 0, 1); code_block(0); load_block_8_8(i * 2 + 1, 1); code_block(0);
-                load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
+                for (int i = 0; i < m_mcus_per_row; i++)
+                {
+                    load_block_8_8(i * 2 + 0, 0, 0); load_block_8_8(i * 2 + 1, 0, 0);
+                    load_block_8_8(i * 2 + 0, 1, 0); load_block_8_8(i * 2 + 1, 1, 0);
+                    if (m_chroma_ds)
+                    {
+                        load_block_8_8(i, 0, 1); load_block_8_8(i, 0, 2);
+                    }
+                    else
+                    {
+                        load_block_16_8(i, 1); load_block_16_8(i, 2);
+                    }
+                    code_mcu();
+                }
             }
         }
 
         bool jpeg_encoder::terminate_pass_two()
         {
             put_bits(0x7F, 7);
+            flush_bits();
             flush_output_buffer();
-            emit_marker(M_EOI);
+            if (!m_scan_only)
+                emit_marker(M_EOI);
             m_pass_num++; // purposely bump up m_pass_num, for debugging
             return true;
         }
@@ -972,41 +3615,117 @@ namespace jcodec{
             {
                 if (m_mcu_y_ofs < 16) // check here just to shut up static analysis
                 {
-                    for (int i = m_mcu_y_ofs; i < m_mcu_y; i++)
+                    int c_ofs = m_mcu_y_ofs, c_lines = m_mcu_y;
+                    if (m_chroma_ds && (m_mcu_y == 16))
                     {
+                        c_ofs = (m_mcu_y_ofs + 1) >> 1; c_lines = 8;
+                    }
+                    if (m_chroma_ds && ((m_image_format & ~PF_16BIT) < PF_YUYV))
+                    {
+                        // as if the last row were repeated: its chroma paired with itself, with the bias of each line
+                        const uchar *pCb = &m_src_line[((m_mcu_y_ofs - 1) & 1) * 2 * m_image_x_mcu], *pCr = pCb + m_image_x_mcu;
+                        for (int i = m_mcu_y_ofs >> 1; i < 8; i++)
+                        {
+                            downsample_rows_h2v2(m_mcu_linesCb[i], pCb, pCb, m_image_x_mcu >> 1, i);
+                            downsample_rows_h2v2(m_mcu_linesCr[i], pCr, pCr, m_image_x_mcu >> 1, i);
+                        }
+                        c_ofs = c_lines;
+                    }
+                    for (int i = m_mcu_y_ofs; i < m_mcu_y; i++)
                         memcpy(m_mcu_linesY[i], m_mcu_linesY[m_mcu_y_ofs - 1], m_image_x_mcu);
-                        memcpy(m_mcu_linesCb[i], m_mcu_linesCb[m_mcu_y_ofs - 1], m_image_x_mcu);
-                        memcpy(m_mcu_linesCr[i], m_mcu_linesCr[m_mcu_y_ofs - 1], m_image_x_mcu);
+                    for (int i = c_ofs; i < c_lines; i++)
+                    {
+                        memcpy(m_mcu_linesCb[i], m_mcu_linesCb[c_ofs - 1], m_image_x_mcu);
+                        memcpy(m_mcu_linesCr[i], m_mcu_linesCr[c_ofs - 1], m_image_x_mcu);
                     }
                 }
 
                 process_mcu_row();
             }
-                return terminate_pass_two();
+
+            if (m_pass_num == 1)
+            {
+                // stripe encoders only gather counts; the parent merges them and builds the tables
+                if (m_scan_only)
+                    return true;
+                optimize_huffman_tables(m_num_components > 1);
+                return second_pass_init();
+            }
+            return terminate_pass_two();
         }
 
-        void jpeg_encoder::load_mcu(const void *pSrc)
+        void jpeg_encoder::load_mcu(const uchar * const *pRows)
         {
-            const uchar* Psrc = reinterpret_cast<const uchar*>(pSrc);
+            const uchar* Psrc = pRows[0];
+            const int format = m_image_format & ~PF_16BIT;
 
             uchar* pDstY = m_mcu_linesY[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
             uchar* pDstCb = m_mcu_linesCb[m_mcu_y_ofs];
             uchar* pDstCr = m_mcu_linesCr[m_mcu_y_ofs];
 
-            //if (m_image_bpp == 4)
-            //    RGBA_to_YCC(pDst, Psrc, m_image_x);
-            //else
-            if (m_image_bpp == 3)
-                BGR_to_YCC(pDstY, pDstCb, pDstCr, Psrc, m_image_x);
+            if (m_image_format & PF_16BIT)
+            {
+                reduce_depth(&m_src_row8[0], reinterpret_cast<const ushort*>(Psrc), (int)m_src_row8.size(), m_params.m_src_depth - 8);
+                Psrc = &m_src_row8[0];
+            }
+
+            if ((format == PF_BGR) || (format == PF_BGRA) || (format == PF_RGBA))
+            {
+                if (m_num_components == 1)
+                    color_to_Y(format, pDstY, Psrc, m_image_x);
+                else if (m_chroma_ds)
+                {
+                    // H2V2: full-resolution chroma only lives in a two-row scratch that stays in L1,
+                    // each row pair is reduced to its chroma line as soon as the second row is converted
+                    uchar *pCb = &m_src_line[(m_mcu_y_ofs & 1) * 2 * m_image_x_mcu], *pCr = pCb + m_image_x_mcu;
+                    color_to_YCC(format, pDstY, pCb, pCr, Psrc, m_image_x);
+                    for (int i = m_image_x; i < m_image_x_mcu; i++)
+                    {
+                        pCb[i] = pCb[m_image_x - 1]; pCr[i] = pCr[m_image_x - 1];
+                    }
+                    if (m_mcu_y_ofs & 1)
+                    {
+                        const int line = m_mcu_y_ofs >> 1;
+                        downsample_rows_h2v2(m_mcu_linesCb[line], &m_src_line[0], pCb, m_image_x_mcu >> 1, line);
+                        downsample_rows_h2v2(m_mcu_linesCr[line], &m_src_line[m_image_x_mcu], pCr, m_image_x_mcu >> 1, line);
+                    }
+                }
+                else
+                    color_to_YCC(format, pDstY, pDstCb, pDstCr, Psrc, m_image_x);
+            }
+            else if (format == PF_YUYV)
+            {
+                uchar *pUV = &m_src_line[0];
+                deinterleave_u8(pDstY, pUV, Psrc, m_image_x);
+                if (m_num_components == 3)
+                    load_yuv_chroma(pUV, 0);
+            }
+            else
+            {
+                memcpy(pDstY, Psrc, m_image_x);
+                if (m_num_components == 3)
+                {
+                    if (format == PF_GRAY)
+                    {
+                        memset(pDstCb, 128, m_image_x);
+                        memset(pDstCr, 128, m_image_x);
+                    }
+                    else
+                        load_yuv_chroma(pRows[1], pRows[2]);
+                }
+            }
 
             // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
-            const uchar y = pDstY[m_image_x], cb = pDstCb[m_image_x], cr = pDstCr[m_image_x];
-            uchar *Y = m_mcu_linesY[m_mcu_y_ofs] + m_image_x;
-            uchar *Cb = m_mcu_linesY[m_mcu_y_ofs] + m_image_x;
-            uchar *Cr = m_mcu_linesY[m_mcu_y_ofs] + m_image_x;
+            const uchar y = pDstY[m_image_x - 1];
             for (int i = m_image_x; i < m_image_x_mcu; i++)
+                pDstY[i] = y;
+            if ((m_num_components == 3) && !m_chroma_ds)
             {
-                *Y++ = y; *Cb++ = cb; *Cr++ = cr;
+                const uchar cb = pDstCb[m_image_x - 1], cr = pDstCr[m_image_x - 1];
+                for (int i = m_image_x; i < m_image_x_mcu; i++)
+                {
+                    pDstCb[i] = cb; pDstCr[i] = cr;
+                }
             }
 
             if (++m_mcu_y_ofs == m_mcu_y)
@@ -1016,18 +3735,73 @@ namespace jcodec{
             }
         }
 
+        // Half-width chroma of the current row: separate U and V rows, or pV = 0 and interleaved UV in pU.
+        // With m_chroma_ds it is stored as is (4:2:0 rows once per row pair, 4:2:2 row pairs averaged
+        // for H2V2), otherwise it is widened to full resolution.
+        void jpeg_encoder::load_yuv_chroma(const uchar *pU, const uchar *pV)
+        {
+            const int n = m_image_x >> 1;
+            uchar *pTmpU = &m_src_line[m_image_x], *pTmpV = pTmpU + n;
+            if (!m_chroma_ds)
+            {
+                if (!pV)
+                {
+                    deinterleave_u8(pTmpU, pTmpV, pU, n);
+                    pU = pTmpU; pV = pTmpV;
+                }
+                upsample_h2(m_mcu_linesCb[m_mcu_y_ofs], pU, n);
+                upsample_h2(m_mcu_linesCr[m_mcu_y_ofs], pV, n);
+                return;
+            }
+
+            int line = m_mcu_y_ofs;
+            bool second_row = false;
+            if (m_mcu_y == 16)
+            {
+                line >>= 1;
+                second_row = (m_mcu_y_ofs & 1) != 0;
+                if (second_row && (m_image_format != PF_YUYV))
+                    return;
+            }
+            uchar *pCb = m_mcu_linesCb[line], *pCr = m_mcu_linesCr[line];
+            if (second_row)
+            {
+                deinterleave_u8(pTmpU, pTmpV, pU, n);
+                average_u8(pCb, pTmpU, n);
+                average_u8(pCr, pTmpV, n);
+            }
+            else if (pV)
+            {
+                memcpy(pCb, pU, n);
+                memcpy(pCr, pV, n);
+            }
+            else
+                deinterleave_u8(pCb, pCr, pU, n);
+            for (int i = n; i < (m_image_x_mcu >> 1); i++)
+            {
+                pCb[i] = pCb[n - 1]; pCr[i] = pCr[n - 1];
+            }
+        }
+
         void jpeg_encoder::clear()
         {
             m_mcu_linesY[0] = 0;
             m_mcu_linesCb[0] = 0;
             m_mcu_linesCr[0] = 0;
+            m_mcu_lines_x = 0;
+            m_mcu_blocks = 0;
+            m_quant_scale = -1;
+            m_quant_no_chroma_discrim = false;
+            m_huff_tables_std = false;
+            m_huff_tables_fixed = false;
             m_pass_num = 0;
             m_all_stream_writes_succeeded = true;
         }
 
-        jpeg_encoder::jpeg_encoder()
+        jpeg_encoder::jpeg_encoder() : m_scan_only(false), m_stage_timing(false), m_stage_mark(0)
         {
             clear();
+            reset_stage_cycles();
         }
 
         jpeg_encoder::~jpeg_encoder()
@@ -1035,13 +3809,27 @@ namespace jcodec{
             deinit();
         }
 
-        bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
+        bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_format, const params &comp_params)
         {
-            deinit();
-            if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+            m_pass_num = 0;
+            m_all_stream_writes_succeeded = true;
+            if (((!pStream) || (width < 1) || (height < 1)) || (!comp_params.check())) return false;
+            switch (src_format)
+            {
+            case PF_GRAY: case PF_BGR: case PF_BGRA: case PF_RGBA: break;
+            case PF_GRAY16: case PF_BGR16: case PF_BGRA16: case PF_RGBA16: break;
+            case PF_YUYV: if (width & 1) return false; break;
+            case PF_I420: case PF_NV12: if ((width | height) & 1) return false; break;
+            default: return false;
+            }
             m_pStream = pStream;
             m_params = comp_params;
-            return jpg_open(width, height, src_channels);
+            if (!jpg_open(width, height, src_format))
+                return false;
+            m_stage_timing = m_params.m_stage_timing_flag;
+            if (m_stage_timing)
+                m_stage_mark = read_cycles();
+            return true;
         }
 
         void jpeg_encoder::deinit()
@@ -1049,26 +3837,57 @@ namespace jcodec{
             jpge_free(m_mcu_linesY[0]);
             jpge_free(m_mcu_linesCb[0]);
             jpge_free(m_mcu_linesCr[0]);
+            for (size_t i = 0; i < m_stripe_encoders.size(); i++)
+                delete m_stripe_encoders[i];
+            m_stripe_encoders.clear();
+            m_stripe_bufs.clear();
+            m_stripe_sizes.clear();
             clear();
         }
 
         bool jpeg_encoder::process_scanline(const void* pScanline)
+        {
+            if ((m_image_format == PF_I420) || (m_image_format == PF_NV12)) return false;
+            const uchar *pRows[3] = { static_cast<const uchar*>(pScanline), 0, 0 };
+            return process_rows(pScanline ? pRows : 0);
+        }
+
+        // pRows: the row of each plane (see get_source_rows), 0 at the end of the image
+        bool jpeg_encoder::process_rows(const uchar * const *pRows)
         {
             if ((m_pass_num < 1) || (m_pass_num > 2)) return false;
             if (m_all_stream_writes_succeeded)
             {
-                if (!pScanline)
+                if (!pRows)
                 {
                     if (!process_end_of_image()) return false;
+                    stage_lap(STAGE_ENTROPY);
                 }
                 else
                 {
-                    load_mcu(pScanline);
+                    load_mcu(pRows);
                 }
             }
             return m_all_stream_writes_succeeded;
         }
 
+        // Row y of the planes of an image in m_image_format: [0] the packed or Y row,
+        // [1] and [2] the U and V rows of I420, [1] the UV row of NV12.
+        void jpeg_encoder::get_source_rows(const uchar *pImage_data, int step, int y, const uchar **pRows) const
+        {
+            pRows[0] = pImage_data + (size_t)y * step;
+            pRows[1] = pRows[2] = 0;
+            const uchar *pChroma = pImage_data + (size_t)m_image_y * step;
+            if (m_image_format == PF_I420)
+            {
+                const size_t uv_step = step / 2;
+                pRows[1] = pChroma + (y >> 1) * uv_step;
+                pRows[2] = pChroma + (m_image_y >> 1) * uv_step + (y >> 1) * uv_step;
+            }
+            else if (m_image_format == PF_NV12)
+                pRows[1] = pChroma + (size_t)(y >> 1) * step;
+        }
+
         // Higher level wrappers/examples (optional).
 #include <stdio.h>
 
@@ -1101,14 +3920,118 @@ namespace jcodec{
             }
         };
 
-        bool jpeg_encoder::compress_image_to_jpeg_file_in_memory(void *&pDstBuf, int &buf_size, int width, int height, int num_channels, const uchar *pImage_data, const params &comp_params)
+        // Encodes one stripe of MCU rows as a headerless entropy-coded segment with its own
+        // DC predictors and bit buffer. Stripe encoders and buffers belong to the parent and are reused.
+        class jpeg_encoder::stripe_encoder : public ParallelLoopBody
         {
-            if (!init_clamp_table)
+        public:
+            // pass 1 gathers symbol counts of each stripe, pass 2 codes it with the parent's tables
+            stripe_encoder(jpeg_encoder &parent, const uchar *pImage_data, int step, int pass) : m_parent(parent), m_pImage_data(pImage_data), m_step(step), m_pass(pass) { }
+
+            virtual void operator()(const Range &range) const
             {
-                for (int i = -256; i < 512; i++)
-                    clamp_table[i] = (uchar)(i < 0 ? 0 : i > 255 ? 255 : i);
+                const int rows = m_parent.m_stripe_rows * m_parent.m_mcu_y;
+                const int width = m_parent.m_image_x, format = m_parent.m_image_format;
+                params stripe_params = m_parent.m_params;
+                stripe_params.m_stripes = 1;
+                stripe_params.m_two_pass_flag = (m_pass == 1);
+                for (int i = range.start; i < range.end; i++)
+                {
+                    int y0 = i * rows, height = JPGE_MIN(rows, m_parent.m_image_y - y0);
+                    int buf_size = JPGE_MAX(width * height * 3, 1024);
+                    vector<uchar> &buf = m_parent.m_stripe_bufs[i];
+                    buf.resize(buf_size);
+                    memory_stream dst_stream(&buf[0], buf_size);
+
+                    jpeg_encoder &enc = *m_parent.m_stripe_encoders[i];
+                    if (m_pass == 2)
+                        enc.copy_huffman_tables(m_parent);
+                    bool ok = enc.init(&dst_stream, width, height, format, stripe_params);
+                    for (int y = 0; ok && (y < height); y++)
+                    {
+                        // plane offsets depend on the full image height, so the parent locates the rows
+                        const uchar *pRows[3];
+                        m_parent.get_source_rows(m_pImage_data, m_step, y0 + y, pRows);
+                        ok = enc.process_rows(pRows);
+                    }
+                    ok = ok && enc.process_rows(0);
+                    m_parent.m_stripe_sizes[i] = ok ? (int)dst_stream.get_size() : -1;
+                }
+            }
+
+        private:
+            jpeg_encoder &m_parent;
+            const uchar *m_pImage_data;
+            int m_step, m_pass;
+        };
+
+        // Sums the symbol counts of the stripe encoders into m_huff_count. Fails if a stripe failed.
+        bool jpeg_encoder::merge_stripe_counts(int num_stripes)
+        {
+            clear_obj(m_huff_count);
+            for (int i = 0; i < num_stripes; i++)
+            {
+                if (m_stripe_sizes[i] < 0)
+                    return false;
+                const uint *pCount = &m_stripe_encoders[i]->m_huff_count[0][0];
+                for (int j = 0; j < 4 * 256; j++)
+                    (&m_huff_count[0][0])[j] += pCount[j];
+            }
+            return true;
+        }
+
+        bool jpeg_encoder::encode_stripes(const uchar *pImage_data, int step)
+        {
+            const int rows = m_stripe_rows * m_mcu_y;
+            const int num_stripes = (m_image_y + rows - 1) / rows;
+            while ((int)m_stripe_encoders.size() < num_stripes)
+            {
+                m_stripe_encoders.push_back(new jpeg_encoder());
+                m_stripe_encoders.back()->m_scan_only = true;
             }
+            m_stripe_bufs.resize(JPGE_MAX((int)m_stripe_bufs.size(), num_stripes));
+            m_stripe_sizes.resize(m_stripe_bufs.size());
 
+            if (m_pass_num == 1)
+            {
+                // one table set must serve all restart intervals: sum the counts of every stripe
+                parallel_for_(Range(0, num_stripes), stripe_encoder(*this, pImage_data, step, 1));
+                if (!merge_stripe_counts(num_stripes))
+                    return false;
+                optimize_huffman_tables(m_num_components > 1);
+                if (!second_pass_init())
+                    return false;
+            }
+            parallel_for_(Range(0, num_stripes), stripe_encoder(*this, pImage_data, step, 2));
+            if (m_params.m_huff_stats_flag && !merge_stripe_counts(num_stripes))
+                return false;
+            if (m_stage_timing)
+            {
+                // the stripes' own work, not the wall time this thread waited for them
+                for (int i = 0; i < num_stripes; i++)
+                {
+                    for (int s = 0; s < STAGE_COUNT; s++)
+                        m_stage_cycles[s] += m_stripe_encoders[i]->m_stage_cycles[s];
+                    m_stripe_encoders[i]->reset_stage_cycles();
+                }
+                m_stage_mark = read_cycles();
+            }
+
+            for (int i = 0; i < num_stripes; i++)
+            {
+                if (m_stripe_sizes[i] < 0)
+                    return false;
+                m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(&m_stripe_bufs[i][0], m_stripe_sizes[i]);
+                if (i + 1 < num_stripes)
+                    emit_marker(M_RST0 + (i & 7));
+            }
+            emit_marker(M_EOI);
+            stage_lap(STAGE_ENTROPY);
+            return m_all_stream_writes_succeeded;
+        }
+
+        bool jpeg_encoder::compress_image_to_jpeg_file_in_memory(void *&pDstBuf, int &buf_size, int width, int height, int format, const uchar *pImage_data, const params &comp_params, int step)
+        {
             if ((!pDstBuf) || (!buf_size))
                 return false;
 
@@ -1116,23 +4039,39 @@ namespace jcodec{
 
             buf_size = 0;
 
-            if (!init(&dst_stream, width, height, num_channels, comp_params))
+            if (!compress_image(&dst_stream, width, height, format, pImage_data, comp_params, step))
+                return false;
+
+            buf_size = dst_stream.get_size();
+            return true;
+        }
+
+        bool jpeg_encoder::compress_image(output_stream *pStream, int width, int height, int format, const uchar *pImage_data, const params &comp_params, int step)
+        {
+            if (!init(pStream, width, height, format, comp_params))
+                return false;
+            if (step <= 0)
+                step = m_image_bpl;
+            if ((format == PF_I420) && (step & 1))
                 return false;
 
-            for (uint pass_index = 0; pass_index < get_total_passes(); pass_index++)
+            if (m_restart_interval)
+            {
+                if (!encode_stripes(pImage_data, step))
+                    return false;
+            }
+            else for (uint pass_index = 0; pass_index < get_total_passes(); pass_index++)
             {
                 for (int i = 0; i < height; i++)
                 {
-                    const uchar* pScanline = pImage_data + i * width * num_channels;
-                    if (!process_scanline(pScanline))
+                    const uchar *pRows[3];
+                    get_source_rows(pImage_data, step, i, pRows);
+                    if (!process_rows(pRows))
                         return false;
                 }
-                if (!process_scanline(0))
+                if (!process_rows(0))
                     return false;
             }
-            deinit();
-
-            buf_size = dst_stream.get_size();
             return true;
         }
 }
\ No newline at end of file
@@ -1,5 +1,12 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <deque>
 
 using namespace cv;
 using namespace std;
@@ -9,6 +16,29 @@ namespace jcodec
 
     enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
+    // Layouts of the source image. The packed 8-bit RGB layouts equal their channel count, so a channel
+    // count (1, 3 or 4) may be passed wherever a format is expected.
+    // PF_BGRA, PF_RGBA: four bytes per pixel (CV_8UC4), alpha is ignored.
+    // PF_16BIT | any of the packed RGB layouts: the same with 16-bit samples (CV_16UC1/3/4), reduced to
+    // 8 bits by dropping the low params::m_src_depth - 8 bits.
+    // PF_YUYV: packed 4:2:2, Y0 U Y1 V (CV_8UC2), even width.
+    // PF_I420, PF_NV12: 4:2:0 planes in one CV_8UC1 buffer of height * 3 / 2 rows, as cv::cvtColor takes them:
+    // the Y plane, then for I420 the U and V planes with rows of step / 2 bytes, for NV12 one interleaved
+    // UV plane with rows of step bytes. Even width and height.
+    enum pixel_format_t
+    {
+        PF_GRAY = 1, PF_BGR = 3, PF_BGRA = 4, PF_RGBA = 5, PF_YUYV = 16, PF_I420 = 17, PF_NV12 = 18,
+        PF_16BIT = 0x100, PF_GRAY16 = PF_GRAY | PF_16BIT, PF_BGR16 = PF_BGR | PF_16BIT,
+        PF_BGRA16 = PF_BGRA | PF_16BIT, PF_RGBA16 = PF_RGBA | PF_16BIT
+    };
+
+    // Instruction sets of the encoder kernels; the widest one the CPU supports is picked at startup.
+    enum simd_level_t { SIMD_SCALAR = 0, SIMD_SSE2 = 1, SIMD_AVX2 = 2, SIMD_AVX512 = 3 };
+    // Limits the kernels to level, e.g. SIMD_SCALAR to check the vector code against plain C.
+    // Returns the level in effect. Not thread safe: call it while no encoder is running.
+    simd_level_t set_simd_level(simd_level_t level);
+    simd_level_t get_simd_level();
+
     class output_stream
     {
     public:
@@ -17,14 +47,24 @@ namespace jcodec
         template<class T> inline bool put_obj(const T& obj) { return put_buf(&obj, sizeof(T)); }
     };
 
+    // Encoding stages timed with params::m_stage_timing_flag, in CPU cycles. STAGE_ENTROPY includes the
+    // headers and Huffman table building; STAGE_FILE_IO is only counted by MjpegWriter.
+    enum stage_t { STAGE_CONVERT = 0, STAGE_DCT, STAGE_QUANTIZE, STAGE_ENTROPY, STAGE_FILE_IO, STAGE_COUNT };
+
+    class jpeg_encoder;
+    class MjpegRecorder;
+
     struct params
     {
-        inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), block_size(16) { }
+        inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), block_size(16), m_stripes(1), m_huff_stats_flag(false), m_src_depth(16), m_stage_timing_flag(false), m_quant_scale(0) { }
 
         inline bool check() const
         {
             if ((m_quality < 1) || (m_quality > 100)) return false;
             if ((uint)m_subsampling > (uint)H2V2) return false;
+            if (m_stripes < 1) return false;
+            if ((m_src_depth < 8) || (m_src_depth > 16)) return false;
+            if ((m_quant_scale < 0) || (m_quant_scale > 5000)) return false;
             return true;
         }
 
@@ -42,111 +82,667 @@ namespace jcodec
         // If true, the Y quantization table is also used for the CbCr channels.
         bool m_no_chroma_discrim_flag;
 
+        // Two passes per image: the first one gathers symbol statistics, the second one codes
+        // with Huffman tables optimized for that image. Typically 5-10% smaller, about twice the CPU time.
         bool m_two_pass_flag;
+
+        // Number of horizontal stripes the image is split into. Stripes are separated by
+        // restart markers (DRI/RSTn), so each one has its own DC prediction and is
+        // entropy coded on its own thread. 1 = single scan without restart markers.
+        int m_stripes;
+
+        // Also counts the Huffman symbols while coding, for jpeg_encoder::add_huffman_counts().
+        bool m_huff_stats_flag;
+
+        // Significant bits of 16-bit source samples (PF_16BIT formats), 8-16: 10 or 12 for the
+        // output of most camera sensors, 16 for full-range data.
+        int m_src_depth;
+
+        // Sums the cycles spent in each stage_t, see jpeg_encoder::get_stage_cycles().
+        // Costs a few cycle counter reads per 8x8 block, so it is meant for profiling.
+        bool m_stage_timing_flag;
+
+        // Scale of the standard quantization tables in percent, 1-5000, instead of the one m_quality
+        // maps to (5000 / quality below 50, 200 - 2 * quality above); 0 = use m_quality.
+        // Finer than m_quality, for rate control.
+        int m_quant_scale;
+
+        inline int quant_scale() const
+        {
+            if (m_quant_scale)
+                return m_quant_scale;
+            return m_quality < 50 ? 5000 / m_quality : 200 - m_quality * 2;
+        }
+    };
+
+    // Snapshot of the statistics of an MjpegWriter (see MjpegWriter::EnableStats).
+    struct writer_stats
+    {
+        enum { LATENCY_BUCKETS = 24 };
+
+        writer_stats() { memset(this, 0, sizeof(*this)); }
+
+        long long frames;           // frames encoded
+        long long bytes;            // compressed bytes of those frames
+        int last_frame_bytes;
+        double bits_per_pixel;      // average over the frames
+        // Encode latency of a frame: bucket i counts the frames of [2^i, 2^(i+1)) microseconds
+        // (bucket 0 from 0, the last one without upper bound).
+        long long latency_hist[LATENCY_BUCKETS];
+        double latency_avg_ms, latency_max_ms;
+        // Cycles per stage_t, as GetStageCycles
+        unsigned long long stage_cycles[STAGE_COUNT];
+        // Pipelined mode: frames queued or being encoded and not written yet, now and at most.
+        int queue_depth, queue_depth_max;
+        // Time Write was blocked because every frame slot was taken: the encoders or the disk
+        // do not keep up and frames are about to be late.
+        double io_stall_ms;
+        // Rate control: quantization scale of the next frame (params::m_quant_scale) and the
+        // frames coded again because they exceeded the frame size cap.
+        int quant_scale;
+        long long reencoded;
+        // Frames thrown away because the frame queue was full (see MjpegWriter::SetQueue): queued or
+        // encoded frames replaced by newer ones, and new frames refused. Counted even with the statistics off.
+        long long dropped_oldest, dropped_newest;
+    };
+
+    // What a full frame queue does with the next frame (see MjpegWriter::SetQueue).
+    enum queue_policy_t { QUEUE_BLOCK = 0, QUEUE_DROP_OLDEST = 1, QUEUE_DROP_NEWEST = 2 };
+
+    // Completion of an asynchronously written frame: 1 - written, 0 - dropped, -2 - encoding failed.
+    typedef std::function<void(int result)> write_callback;
+
+    // Completion of a segment file of a segmented recording (see MjpegWriter::SetSegments):
+    // its name and 1, or -1 if writing or closing it failed.
+    typedef std::function<void(const char *name, int result)> segment_callback;
+
+    // Huffman symbol counts: [0] luma DC, [1] chroma DC, [2] luma AC, [3] chroma AC.
+    struct huffman_counts
+    {
+        inline huffman_counts() { memset(m_count, 0, sizeof(m_count)); }
+        uint m_count[4][256];
+    };
+
+    // Destination of the AVI file bytes. The staging buffer hands it large batches that append to the
+    // data written so far, and a few small patches of bytes written earlier (chunk sizes, the header).
+    class file_sink
+    {
+    public:
+        virtual ~file_sink() { }
+        // Creates or truncates the file.
+        virtual bool open(const char *name) = 0;
+        // Writes len bytes of pBuf at file offset pos; pBuf may be reused as soon as the call returns.
+        virtual bool write(long long pos, const void *pBuf, size_t len) = 0;
+        // Completes every write and closes the file. Returns false if any write failed.
+        virtual bool close() = 0;
+        // Makes every byte written so far reach the file, so it outlives the process (durable: the disk as
+        // well, as fdatasync does). For MjpegWriter::SetCheckpoints; sinks that write synchronously have
+        // nothing to do unless durable.
+        virtual bool flush(bool durable) { (void)durable; return true; }
+        // A new sink of the same kind and settings, for the other files of a segmented recording;
+        // 0 if the sink cannot make one (MjpegWriter::Open then refuses segments).
+        virtual file_sink *clone() const { return 0; }
+    };
+
+    // Default sink: buffered writes through the C library and the page cache.
+    class stdio_sink : public file_sink
+    {
+    public:
+        stdio_sink() : m_file(0) { }
+        virtual ~stdio_sink() { close(); }
+        virtual bool open(const char *name);
+        virtual bool write(long long pos, const void *pBuf, size_t len);
+        virtual bool close();
+        virtual bool flush(bool durable);
+        virtual file_sink *clone() const { return new stdio_sink(); }
+
+    private:
+        FILE *m_file;
+    };
+
+    // Linux sink that bypasses the page cache: appended data is copied into aligned blocks that are
+    // written with O_DIRECT, up to depth blocks at a time through io_uring (one by one with pwrite
+    // where io_uring is not available). Patches and the unaligned end of the file go through a
+    // buffered descriptor. open fails on other systems.
+    class direct_sink : public file_sink
+    {
+    public:
+        // block_size is rounded up to a multiple of 4096.
+        direct_sink(int depth = 8, size_t block_size = 1 << 20);
+        virtual ~direct_sink();
+        virtual bool open(const char *name);
+        virtual bool write(long long pos, const void *pBuf, size_t len);
+        virtual bool close();
+        // Writes the partly filled block through the page cache as well (it is written again once full).
+        virtual bool flush(bool durable);
+        virtual file_sink *clone() const { return new direct_sink(m_depth, m_block_size); }
+        // After open: true if blocks are written through io_uring.
+        bool uses_io_uring() const { return m_ring != 0; }
+
+    private:
+        direct_sink(const direct_sink &);
+        direct_sink &operator =(const direct_sink &);
+
+        struct ring;
+
+        int m_fd, m_direct_fd;      // buffered and O_DIRECT descriptors of the file
+        int m_depth;
+        size_t m_block_size;
+        vector<uchar*> m_blocks;
+        vector<char> m_pending;     // block is being written
+        int m_in_flight, m_cur;
+        size_t m_fill;              // bytes in the current block
+        long long m_block_pos;      // file offset of the current block
+        ring *m_ring;
+        bool m_ok;
+
+        void submit(int block);
+        bool reap();
+        void drain();
+    };
+
+    // Large aligned staging buffer for RIFF chunks that is written to the file in big batches.
+    // Encoders write straight into it through put_buf, right after the chunk header,
+    // and the chunk size is patched in place, so frames take no intermediate copy.
+    class staging_stream : public output_stream
+    {
+    public:
+        staging_stream();
+        virtual ~staging_stream();
+
+        // Starts staging at file offset pos of sink, which must be open.
+        bool open(file_sink *sink, long long pos, size_t capacity);
+        // Keeps a copy of the first size bytes of the file once they are written, so later
+        // patches to them are collected and written back at once by close().
+        // Must be called before those bytes leave the buffer.
+        void keep_head(size_t size);
+        // Writes out everything staged and the patched header region. Returns false if any write failed.
+        bool close();
+        // Writes nothing more until close(): the buffer grows to take what is staged next, and patches of
+        // bytes already written are kept as well. For a file finished on one thread and written on another.
+        void hold();
+        // Writes out everything staged and the patched header region and flushes the sink
+        // (file_sink::flush); durable: the header region only once the rest is on the disk. Only between chunks.
+        bool sync(bool durable);
+        // Exchanges the files and staged data of two streams; the io_cycles counters stay where they are.
+        void swap(staging_stream &other);
+        // Cycles spent writing to the file, counted from construction (take differences).
+        inline unsigned long long io_cycles() const { return m_io_cycles; }
+
+        virtual bool put_buf(const void* Pbuf, int len);
+
+        void start_chunk(int fourcc);
+        // Patches the size of the chunk opened by start_chunk and returns its payload size.
+        int end_chunk();
+        // Drops the chunk opened by start_chunk (e.g. when encoding failed).
+        void cancel_chunk();
+        // File offset of the next staged byte.
+        inline long long tell() const { return m_pos + (long long)m_len; }
+        // Overwrites 4 bytes at file offset pos: in the buffer if still staged,
+        // in the header copy if inside the head region, otherwise with a positioned write (at close if held).
+        void patch(long long pos, int value);
+
+    private:
+        staging_stream(const staging_stream &);
+        staging_stream &operator =(const staging_stream &);
+
+        file_sink *m_sink;
+        uchar *m_buf;
+        size_t m_capacity, m_len, m_chunk;
+        long long m_pos;
+        vector<uchar> m_head;
+        size_t m_head_size;
+        bool m_head_dirty;
+        vector<std::pair<long long, int> > m_patches;  // held by hold()
+        bool m_hold;
+        bool m_ok;
+        unsigned long long m_io_cycles;
+
+        void write_at(long long pos, const uchar *pBuf, size_t len);
+        void write_patches();
+        void flush_sink(bool durable);
+        bool flush(size_t len, bool hold_head = false);
+        bool reserve(size_t len);
     };
 
     class MjpegWriter
     {
     public:
         MjpegWriter();
+        ~MjpegWriter();
+        // Number of encoder threads used by the next Open().
+        // 1 (default) encodes and writes on the caller's thread;
+        // n > 1 encodes frames on n workers and appends them in order on a writer thread;
+        // 0 uses one worker per CPU.
+        void SetThreads(int nthreads);
+        // Number of restart-marker stripes each frame is split into and encoded in parallel
+        // (see params::m_stripes). Lowers per-frame latency; 1 (default) disables it.
+        void SetStripes(int nstripes);
+        // Shared Huffman tables for the next Open: built from the symbol statistics of the first
+        // nframes frames and used for every later frame; with rolling they are rebuilt every nframes
+        // frames from the previous nframes. Most of the two-pass gain at one-pass speed.
+        // 0 (default) keeps the standard tables.
+        void SetSharedHuffman(int nframes, bool rolling = false);
+        // Opens with the parameters of the last Open (quality 80, H2V2 by default).
         int Open(char* outfile, uchar fps, Size ImSize);
+        // p selects quality, subsampling (Y_ONLY writes grayscale JPEGs), stripes and two-pass
+        // (per-frame optimized Huffman tables) coding for the whole stream. Returns -5 if p is invalid.
+        int Open(char* outfile, uchar fps, Size ImSize, const params &p);
+        // Im must be CV_8UC1 (gray), CV_8UC3 (BGR) or CV_8UC4 (BGRA), or the CV_16U equivalent (see PF_16BIT),
+        // of the size passed to Open. Rows may be padded (any Mat step).
         int Write(const Mat &Im);
+        // Writes the roi part of Im without copying it first; roi must have the size passed to Open.
+        int Write(const Mat &Im, const Rect &roi);
+        // Im in the given layout (see pixel_format_t); YUV frames are coded without any colour conversion.
+        // I420 frames must be continuous. Returns -3 if Im does not match the format and the size passed to Open.
+        int Write(const Mat &Im, pixel_format_t format);
+        // Frame queue for the next Open: at most max_frames frames queued, being encoded or waiting
+        // for the disk (0, the default, allows two per encoder thread). When it is full, QUEUE_BLOCK
+        // (default) waits for a frame to be written, QUEUE_DROP_OLDEST throws away the oldest frame
+        // that is not being encoded or written to make room, and QUEUE_DROP_NEWEST refuses the new one;
+        // Write then returns 0 if its own frame was dropped. With SetRecorder the slots come out of the
+        // recorder's memory limit and max_frames (0 - none) only caps the stream's share of them.
+        void SetQueue(int max_frames, queue_policy_t policy = QUEUE_BLOCK);
+        // Queues Im (as Write(Im) or Write(Im, format) would take it) and returns at once: Im is not
+        // copied but referenced until the frame is written or dropped, so its pixels must stay unchanged
+        // until then (write a new Mat for each frame). The future gets the write_callback result, and
+        // done (optional) is called with it on the writer thread (for a frame dropped to make room, on the
+        // thread of the call that dropped it); done must not call into the writer.
+        // Rejected frames complete right away with the Write error code. With SetThreads(1) the first
+        // call starts one encoder thread and the writer thread.
+        std::future<int> WriteAsync(const Mat &Im, const write_callback &done = write_callback());
+        std::future<int> WriteAsync(const Mat &Im, pixel_format_t format, const write_callback &done = write_callback());
         int Close();
+        // Rate control for the next Open: the quantization scale adapts from frame to frame so the
+        // stream averages bitrate bits per second (0 = off: fixed quality). Frames of more than
+        // max_frame_bytes (0 = no cap) are coded again at a coarser scale, so only busy scenes pay
+        // for a second encode; a frame that cannot get under the cap is kept at the coarsest scale tried.
+        void SetRateControl(long long bitrate, int max_frame_bytes = 0);
+        // Where the next Open writes the file: a stdio_sink (default, also for 0), a direct_sink or any
+        // other file_sink. The sink is not owned and must stay alive until Close.
+        void SetSink(file_sink *sink);
+        // Encodes the frames of the next Open on the threads of recorder, shared with its other streams,
+        // instead of threads of its own (SetThreads is then ignored). priority (1 or more) weights the share
+        // of the threads the stream gets while they are all busy. 0 returns to threads of its own.
+        void SetRecorder(MjpegRecorder *recorder, int priority = 1);
+        // Segmented recording for the next Open: a new file starts at the first frame boundary where the
+        // current one holds max_frames frames, max_seconds of video or max_bytes bytes (0 - no such limit;
+        // all 0, the default, records a single file). A segment exceeds max_bytes by at most a frame and
+        // its index. The name passed to Open is then a printf pattern with one %d for the segment number
+        // (e.g. "cam1_%05d.avi"); a name without '%' gets "_%04d" before its extension. The next file is
+        // opened ahead of the switch, and the previous one written out and closed after it, on a thread of
+        // the writer's, so the frame path neither waits for the disk (unless it falls a whole segment behind)
+        // nor leaves a gap between segments.
+        // done (optional) is called on that thread as each segment is complete, and by Close for the last
+        // one; it must not call into the writer. Needs a sink that can clone itself (file_sink::clone).
+        void SetSegments(int max_frames, long long max_bytes = 0, double max_seconds = 0,
+            const segment_callback &done = segment_callback());
+        // Crash-safe writing for the next Open: every nframes frames (0 - off, the default) the frames since
+        // the last checkpoint get an OpenDML 'ix00' index in the 'movi' list, the header counts and chunk
+        // sizes are brought up to date and everything is handed to the file (durable: to the disk as well, to
+        // survive a power loss and not just the process). The file of a writer that dies before Close is
+        // then repaired in place by recover_avi (jcodec_recover), which reads the indexes of the checkpoints
+        // and only the data written after the last one.
+        void SetCheckpoints(int nframes, bool durable = false);
+        // Size at which the file rolls over into a new OpenDML 'AVIX' RIFF, for the next Open: 1 GB (the default,
+        // also for 0, and the most any RIFF gets), or less, e.g. to test readers and recover_avi on many RIFFs.
+        void SetRiffLimit(long long max_bytes);
+        // Cycles per stage_t spent on the frames since Open, summed over all encoder threads.
+        // The coding stages are only counted with params::m_stage_timing_flag, file I/O always.
+        void GetStageCycles(unsigned long long cycles[STAGE_COUNT]);
+        // Gathering of writer_stats. Off by default, when it costs nothing; enabling starts the
+        // statistics from zero, as does Open. GetStats may be called from any thread at any time.
+        void EnableStats(bool enable);
+        void GetStats(writer_stats &stats);
         bool isOpened();
     private:
+        struct FrameJob
+        {
+            FrameJob() : format(PF_BGR), size(0), state(0), async(false), cost(0) { }
+            Mat frame;
+            int format;
+            vector<uchar> buf;
+            int size;
+            int state; // 0 - queued, 1 - encoding, 2 - encoded, 3 - writing, -1 - failed
+            // WriteAsync frames: frame references the caller's image, which is released on completion
+            bool async;
+            std::promise<int> result;
+            write_callback done;
+            size_t cost; // bytes charged to the memory budget of a recorder
+        };
+        struct PoolEncoder;
+
+        friend class MjpegRecorder;
+
         const int NumOfChunks;
-        double tencoding;
-        FILE *outFile;
+        stdio_sink stdioSink;
+        file_sink *sink, *outSink; // sink of the next Open, sink of the open file
         char *outfileName;
-        int outformat, outfps, quality;
+        int outformat, outfps;
         int width, height, type, FrameNum;
-        int chunkPointer, moviPointer;
-        vector<int> FrameOffset, FrameSize, AVIChunkSizeIndex, FrameNumIndexes;
+        // Frames of the current RIFF (absolute file offsets of their chunks); the first ixFrames of
+        // them are in an 'ix00' of a checkpoint already. The RIFF's super index slots start at riffIndxBase.
+        vector<long long> FrameOffset;
+        vector<int> FrameSize;
+        size_t ixFrames;
+        vector<long long> AVIChunkSizeIndex;
+        vector<int> FrameNumIndexes;
+        long long chunkPointer, moviPointer, riffPointer, indxPointer;
+        int riffNum, firstRiffFrames, indxEntries, riffIndxBase;
+        long long riffLimit;
+        // Checkpoints (SetCheckpoints): every ckptFrames frames, 0 - off
+        int ckptFrames;
+        bool ckptDurable;
         bool isOpen;
+        params encParams;
+
+        // Pipelined mode: jobs are kept in submission order, workers pick the first queued one
+        // and the writer thread always waits for the head of the queue.
+        int nThreads;
+        vector<std::thread> workers;
+        std::thread writer;
+        std::deque<FrameJob*> jobs, freeJobs;
+        std::mutex jobsMutex;
+        std::condition_variable jobQueued, jobEncoded, jobWritten;
+        bool stopPipeline, pipelineFailed;
+        // Frame slots (jobs and freeJobs together; 0 - two per worker) and what happens when none is free
+        int queueFrames;
+        queue_policy_t queuePolicy;
+        long long droppedOldest, droppedNewest;
+
+        // Recorder mode: the recorder's threads encode the queued frames with the stream's idle encoders,
+        // and the thread that finds the head encoded writes it (headWriting: one at a time).
+        // The rec* members belong to the recorder and are guarded by its locks.
+        MjpegRecorder *recorder, *openRecorder; // of the next Open, of the open file
+        int recorderPriority;
+        std::deque<PoolEncoder*> idleEncoders;
+        bool headWriting;
+        int recHome, recQueued, recInFlight, recBusy;
+        double recPass, recStride;
+
+        // Shared Huffman tables: counts of the frames sampled so far and the published table set.
+        // Version 0 is the standard tables; each encoder remembers the version it has loaded.
+        int huffFrames;
+        bool huffRolling;
+        int huffPicked, huffSampled, huffVersion, encoderHuffVersion;
+        huffman_counts huffCounts, huffTables;
+
+        // Encoder session of the caller's thread; it lives for the whole writer,
+        // so frames of an unchanged size are encoded without any allocation.
+        jpeg_encoder *encoder;
+        // 'movi' frame chunks are staged here and written in batches
+        staging_stream stage;
+        unsigned long long stageCycles[STAGE_COUNT];
+        std::atomic<bool> statsEnabled;
+        writer_stats stats; // guarded by jobsMutex
+
+        // Rate control state (jobsMutex): scale of the next frame, bytes over (positive) or under the
+        // budget so far. Peak of the bytes of any outfps consecutive frames, for dwMaxBytesPerSec.
+        long long rcBitrate;
+        int rcMaxFrameBytes;
+        double rcScale, rcDebt;
+        std::deque<int> rateWindow;
+        long long rateWindowBytes, maxBytesPerSec, maxBytesPerSecPos;
 
-        int toJPGframe(const uchar * data, uint width, uint height, int step, void *& pBuf);
+        // Segmented recording: limits for the next Open. For the open file, the frame limit (0 - none) and
+        // the current segment; the segment thread opens segNextSink ahead of the switch and closes
+        // segClosingSink (with closingStage, the staging buffer it was written through) behind it.
+        // The seg*Sink/segSpare/segStop/segFailed/segNextFailed members are guarded by segMutex.
+        int segMaxFrames;
+        long long segMaxBytes;
+        double segMaxSeconds;
+        segment_callback segDone;
+        bool segmented;
+        int segFrameLimit, segIndex;
+        string segPattern, segName, segNextName, segClosingName;
+        vector<file_sink*> segSinks, segSpare; // all sinks (owned), those not in use
+        file_sink *segNextSink, *segClosingSink;
+        bool segStop, segFailed, segNextFailed;
+        staging_stream closingStage;
+        std::thread segThread;
+        std::mutex segMutex;
+        std::condition_variable segCond;
+
+        int RateScale();
+        void RateUpdate(int scale, int size, bool reencoded);
+        void TrackRate(int size);
+        int toJPGframe(jpeg_encoder &enc, const uchar * data, uint width, uint height, int format, int step, const params &p, vector<uchar> &buf);
+        int ImageFormat(const Mat &Im, const Rect &roi);
+        bool MatchesFormat(const Mat &Im, pixel_format_t format);
+        int WriteImage(const Mat &frame, int format, std::promise<int> *result = 0, const write_callback *done = 0);
+        std::future<int> WriteAsyncImage(const Mat &Im, int format, const write_callback &done);
+        FrameJob *DropJob();
+        FrameJob *NextQueuedJob();
+        void EncodeJob(FrameJob *job, jpeg_encoder &enc, int &huffVersion, std::unique_lock<std::mutex> &lock);
+        void WriteHead(std::unique_lock<std::mutex> &lock);
+        bool EncodeQueued();
+        bool HuffSampleFrame();
+        void HuffAddSample(const jpeg_encoder &enc);
+        void HuffUpdateTables(jpeg_encoder &enc, int &version);
+        void AddStageCycles(jpeg_encoder &enc, unsigned long long io);
+        void AddFrameStats(double ticks, int size);
+        void StartPipeline();
+        void StartWorkers(int n);
+        void StopPipeline();
+        void EncodeLoop();
+        void WriteLoop();
+        int OpenSegments(const char *outfile);
+        string SegmentName(int index);
+        void SegmentLoop();
+        bool SegmentFull();
+        void NextSegment();
+        void FinishSegment();
+        void StopSegments();
+        void FreeSegmentSinks();
+        void StartFile();
         void StartWriteAVI();
         void WriteStreamHeader();
         void WriteIndex();
-        bool WriteFrame(const Mat & Im);
-        void WriteODMLIndex();
+        bool WriteFrame(const Mat & Im, int format);
+        void WriteFrameData(const void *pBuf, int pBufSize);
+        void StartFrameChunk();
+        void EndFrameChunk();
+        void WriteODMLIndex(bool whole);
+        void Checkpoint();
+        void StartRiff();
+        void EndRiff();
         void FinishWriteAVI();
         void PutInt(int elem);
         void PutShort(short elem);
+        void PutInt64(long long elem);
         void StartWriteChunk(int fourcc);
         void EndWriteChunk();
     };
 
+    // Records many streams on one pool of encoder threads: MjpegWriters opened with SetRecorder queue
+    // their frames here instead of encoding them on threads of their own. Each thread serves a share of
+    // the streams first, taking the next frame from the one furthest behind its priority (stride
+    // scheduling); a thread with nothing to do steals from the thread with the most frames waiting, so
+    // the cores go where the load is. A stream's frames are written in order by whichever thread finds
+    // the oldest one encoded. The frame slots of all streams come out of one memory budget.
+    class MjpegRecorder
+    {
+    public:
+        // nthreads encoder threads (0 = one per CPU). memory_limit bounds the bytes of the frame slots of
+        // all streams (a frame and its compressed buffer each); once it is reached, a stream with the
+        // QUEUE_BLOCK policy waits for a slot and the others drop frames (see MjpegWriter::SetQueue).
+        MjpegRecorder(int nthreads = 0, size_t memory_limit = (size_t)512 << 20);
+        // Every stream must be closed first.
+        ~MjpegRecorder();
+        int GetThreads() const { return (int)workers.size(); }
+        // Bytes of the frame slots allocated now, in use or kept for reuse.
+        size_t GetMemoryUsed();
+
+    private:
+        MjpegRecorder(const MjpegRecorder &);
+        MjpegRecorder &operator =(const MjpegRecorder &);
+
+        friend class MjpegWriter;
+
+        struct Worker
+        {
+            Worker() : queued(0), vtime(0) { }
+            std::mutex mutex;
+            vector<MjpegWriter*> streams;   // served by this thread first
+            std::atomic<int> queued;        // frames queued on them
+            double vtime;                   // pass of the last frame taken from them
+            std::thread thread;
+        };
+
+        vector<Worker*> workers;
+        std::mutex sleepMutex;
+        std::condition_variable workQueued;
+        std::atomic<int> pending;           // frames queued on all streams
+        bool stop;
+
+        std::mutex slotMutex;
+        std::condition_variable slotFreed;
+        std::deque<MjpegWriter::FrameJob*> freeSlots;
+        size_t memoryLimit, memoryUsed;
+
+        void AddStream(MjpegWriter *w, int priority);
+        void RemoveStream(MjpegWriter *w);
+        void FrameQueued(MjpegWriter *w);
+        MjpegWriter *TakeFrame(int id);
+        MjpegWriter *TakeFrom(Worker *w);
+        void WorkLoop(int id);
+        MjpegWriter::FrameJob *AcquireSlot(MjpegWriter *w, size_t bytes, bool wait, int64 &stall);
+        MjpegWriter::FrameJob *TakeSlot(size_t bytes);
+        void ReleaseSlot(MjpegWriter *w, MjpegWriter::FrameJob *job);
+    };
+
+    // What recover_avi found.
+    struct recover_info
+    {
+        long long frames;           // in the repaired file
+        long long indexed_frames;   // of them, found in the indexes of the last checkpoint (or of Close)
+        long long scanned_bytes;    // read after the last checkpoint
+        long long cut_bytes;        // dropped from the end: a partly written frame, stale index chunks
+        int riffs;
+    };
+
+    // Repairs in place an AVI file of an MjpegWriter that did not get to Close, preferably one written with
+    // checkpoints (see MjpegWriter::SetCheckpoints; without them all of 'movi' is read). The frames known
+    // from the last checkpoint are taken from its indexes, the chunks after it are read up to the first
+    // incomplete one, and the file is cut there and given its final indexes and header counts, as Close
+    // would have written them. A file that was closed is left as it is. Returns 1, or -1 if the file
+    // cannot be read or written, -2 if it has no frame, -3 if it is not an AVI of MjpegWriter.
+    int recover_avi(const char *name, recover_info *info = 0);
+
     class jpeg_encoder
     {
     public:
         jpeg_encoder();
         ~jpeg_encoder();
 
-        // Initializes the compressor.
+        // Initializes the compressor. Buffers and tables of a previous init are kept
+        // and only rebuilt when the image size or the parameters change.
         // pStream: The stream object to use for writing compressed data.
         // params - Compression parameters structure, defined above.
         // width, height  - Image dimensions.
-        // channels - May be 1, or 3. 1 indicates grayscale, 3 indicates RGB source data.
-        // Returns false on out of memory or if a stream write fails.
-        bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
+        // src_format - A pixel_format_t: 1 (PF_GRAY), 3 (PF_BGR), 4 (PF_BGRA), PF_RGBA, their PF_16BIT variants
+        //              or one of the YUV layouts.
+        // Returns false on out of memory, unsupported formats or sizes, or if a stream write fails.
+        bool init(output_stream *pStream, int width, int height, int src_format, const params &comp_params = params());
 
         const params &get_params() const { return m_params; }
 
+        // Cycles per stage_t of the images coded with params::m_stage_timing_flag since the last reset,
+        // stripe encoders included.
+        inline const unsigned long long *get_stage_cycles() const { return m_stage_cycles; }
+        inline void reset_stage_cycles() { memset(m_stage_cycles, 0, sizeof(m_stage_cycles)); }
+
+        // Adds the Huffman symbol counts of the last image (coded with params::m_huff_stats_flag) to counts.
+        void add_huffman_counts(huffman_counts &counts) const;
+        // One-pass images are coded with tables optimized for counts from now on; every baseline symbol
+        // keeps a code, so any image can be coded with them. 0 returns to the standard tables.
+        void set_huffman_tables(const huffman_counts *counts);
+
         // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
+        // Not needed between images: the destructor frees everything.
         void deinit();
 
         uint get_total_passes() const { return m_params.m_two_pass_flag ? 2 : 1; }
         inline uint get_cur_pass() { return m_pass_num; }
 
         // Call this method with each source scanline.
-        // width * src_channels bytes per scanline is expected (RGB or Y format).
+        // width * src_channels bytes per scanline is expected (gray, BGR or YUYV; I420 and NV12 need compress_image).
         // You must call with 0 after all scanlines are processed to finish compression.
         // Returns false on out of memory or if a stream write fails.
         bool process_scanline(const void* pScanline);
         // Writes JPEG image to memory buffer. 
         // On entry, buf_size is the size of the output buffer pointed at by pBuf, which should be at least ~1024 bytes. 
         // If return value is true, buf_size will be set to the size of the compressed data.
-        bool compress_image_to_jpeg_file_in_memory(void *&pBuf, int &buf_size, int width, int height, int num_channels, const uchar *pImage_data, const params &comp_params = params());
+        // format is a pixel_format_t (or a channel count, see init). step is the distance between
+        // scanlines in bytes (of the Y plane for I420 and NV12); 0 means packed rows.
+        bool compress_image_to_jpeg_file_in_memory(void *&pBuf, int &buf_size, int width, int height, int format, const uchar *pImage_data, const params &comp_params = params(), int step = 0);
+        // Writes JPEG image to pStream.
+        bool compress_image(output_stream *pStream, int width, int height, int format, const uchar *pImage_data, const params &comp_params = params(), int step = 0);
 
     private:
         jpeg_encoder(const jpeg_encoder &);
         jpeg_encoder &operator =(const jpeg_encoder &);
 
-        typedef int sample_array_t;
+        class stripe_encoder;
+
+        typedef short sample_array_t;
 
         output_stream *m_pStream;
         params m_params;
         uchar m_num_components;
         uchar m_comp_h_samp[3], m_comp_v_samp[3];
         int m_image_x, m_image_y, m_image_bpp, m_image_bpl;
+        int m_image_format;
+        // Cb/Cr lines hold chroma already at the output resolution (half width, 8 lines per MCU row)
+        bool m_chroma_ds;
+        vector<uchar> m_src_line;
+        // 8-bit copy of the current row of a PF_16BIT image
+        vector<uchar> m_src_row8;
         int m_image_x_mcu, m_image_y_mcu;
         int m_image_bpl_xlt, m_image_bpl_mcu;
         int m_mcus_per_row;
+        int m_restart_interval, m_stripe_rows;
         int m_mcu_x, m_mcu_y;
         uchar *m_mcu_linesY[16];
         uchar *m_mcu_linesCb[16];
         uchar *m_mcu_linesCr[16];
+        int m_mcu_lines_x;
         uchar m_mcu_y_ofs;
-        sample_array_t m_sample_array[64];
-        uchar m_sample_array_uchar[64];
+        // the 8x8 blocks of the current MCU (at most 4 Y + Cb + Cr), transformed together
+        enum { JPGE_MAX_MCU_BLOCKS = 6 };
+        sample_array_t m_sample_array[JPGE_MAX_MCU_BLOCKS][64];
+        uchar m_sample_array_uchar[JPGE_MAX_MCU_BLOCKS][64];
+        uchar m_mcu_block_comp[JPGE_MAX_MCU_BLOCKS];
+        int m_mcu_blocks;
         short m_coefficient_array[64];
         int m_quantization_tables[2][64];
+        ushort m_quant_recip[2][3 * 64]; // rounding bias, multiplier and scale per zig-zag position
+        int m_quant_scale; // of the current tables, -1 = none
+        bool m_quant_no_chroma_discrim;
         uint m_huff_codes[4][256];
         uchar m_huff_code_sizes[4][256];
         uchar m_huff_bits[4][17];
         uchar m_huff_val[4][256];
         uint m_huff_count[4][256];
+        bool m_huff_tables_std;
+        bool m_huff_tables_fixed;
         int m_last_dc_val[3];
         enum { JPGE_OUT_BUF_SIZE = 2048 };
         uchar m_out_buf[JPGE_OUT_BUF_SIZE];
         uchar *m_pOut_buf;
         uint m_out_buf_left;
-        uint m_bit_buffer;
+        unsigned long long m_bit_buffer; // m_bits_in pending bits, right-aligned
         uint m_bits_in;
         uchar m_pass_num;
         bool m_all_stream_writes_succeeded;
+        bool m_scan_only;
+        bool m_stage_timing;
+        unsigned long long m_stage_cycles[STAGE_COUNT], m_stage_mark;
+        vector<jpeg_encoder*> m_stripe_encoders;
+        vector<vector<uchar> > m_stripe_bufs;
+        vector<int> m_stripe_sizes;
 
+        inline void stage_lap(int stage);
         void emit_byte(uchar i);
         void emit_word(uint i);
         void emit_marker(int marker);
@@ -156,26 +752,41 @@ namespace jcodec
         void emit_dht(uchar *bits, uchar *val, int index, bool ac_flag);
         void emit_dhts();
         void emit_sos();
+        void emit_dri();
         void emit_markers();
         void compute_huffman_table(uint *codes, uchar *code_sizes, uchar *bits, uchar *val);
+        void optimize_huffman_table(int table_num, int table_len);
+        void optimize_huffman_tables(bool chroma);
+        void copy_huffman_tables(const jpeg_encoder &src);
         void compute_quant_table(int *dst, short *src);
+        void compute_quant_recip(ushort *pDst, const int *pSrc);
         void adjust_quant_table(int *dst, int *src);
         void first_pass_init();
         bool second_pass_init();
-        bool jpg_open(int p_x_res, int p_y_res, int src_channels);
-        void load_block_8_8(int x, int y);
+        bool jpg_open(int p_x_res, int p_y_res, int src_format);
+        void load_block_8_8(int x, int y, int c);
+        void load_block_16_8_8(int x, int c);
         void load_block_16_8(int x, int comp);
-        void DCT2D(int component_num);
-        void load_quantized_coefficients(int component_num);
+        uchar *add_block(int component_num);
+        void DCT2D(int num_blocks);
+        void load_quantized_coefficients(int block_num);
         void flush_output_buffer();
         void put_bits(uint bits, uint len);
+        void put_bit_word(unsigned long long w);
+        void flush_bits();
+        unsigned long long nonzero_ac_mask() const;
         void code_coefficients_pass_one(int component_num);
         void code_coefficients_pass_two(int component_num);
-        void code_block(int component_num);
+        void code_mcu();
         void process_mcu_row();
         bool terminate_pass_two();
         bool process_end_of_image();
-        void load_mcu(const void* src);
+        void load_mcu(const uchar * const *pRows);
+        void load_yuv_chroma(const uchar *pU, const uchar *pV);
+        void get_source_rows(const uchar *pImage_data, int step, int y, const uchar **pRows) const;
+        bool process_rows(const uchar * const *pRows);
+        bool merge_stripe_counts(int num_stripes);
+        bool encode_stripes(const uchar *pImage_data, int step);
         void clear();
         void init();
     };
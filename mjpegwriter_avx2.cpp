@@ -0,0 +1,292 @@
+
+#include "mjpegwriter_simd.hpp"
+#include <immintrin.h>
+
+// AVX2 kernels: the SSE2 algorithms of mjpegwriter.cpp on two 128-bit lanes at once.
+// Built with -mavx2 (/arch:AVX2), called only when the CPU reports AVX2.
+
+namespace jcodec
+{
+    typedef unsigned char uchar;
+
+    // 8 bytes at p0 in the low lane, 8 bytes at p1 in the high lane
+    static inline __m256i load_2x8(const uchar *p0, const uchar *p1)
+    {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadl_epi64((const __m128i*)p0)), _mm_loadl_epi64((const __m128i*)p1), 1);
+    }
+
+    static inline __m256i load_2x16(const uchar *p0, const uchar *p1)
+    {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p0)), _mm_loadu_si128((const __m128i*)p1), 1);
+    }
+
+    // low 8 bytes of both lanes -> 16 bytes at p
+    static inline void store_2x8(uchar *p, __m256i v)
+    {
+        _mm_storeu_si128((__m128i*)p, _mm256_castsi256_si128(_mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+
+    // Two pixels per lane (? b0 g0 r0 b1 g1 r1 ?) -> V0 U0 Y0 0 V1 U1 Y1 0
+    static inline __m256i ycc_2px(__m256i v, __m256i m0, __m256i m1, __m256i m2, __m256i m3)
+    {
+        const __m256i z = _mm256_setzero_si256();
+        __m256i t0 = _mm256_madd_epi16(v, m0); // a0 b0 a1 b1
+        __m256i t1 = _mm256_madd_epi16(v, m1); // c0 d0 c1 d1
+        __m256i t2 = _mm256_madd_epi16(v, m2); // e0 f0 e1 f1
+        v = _mm256_unpacklo_epi32(t0, t1);     // a0 c0 b0 d0
+        t0 = _mm256_unpackhi_epi32(t0, t1);    // a1 c1 b1 d1
+        t1 = _mm256_unpacklo_epi32(t2, z);     // e0 0 f0 0
+        t2 = _mm256_unpackhi_epi32(t2, z);     // e1 0 f1 0
+        __m256i r0 = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpacklo_epi64(v, t1), _mm256_unpackhi_epi64(v, t1)), m3);
+        __m256i r1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpacklo_epi64(t0, t2), _mm256_unpackhi_epi64(t0, t2)), m3);
+        return _mm256_packs_epi32(_mm256_srai_epi32(r0, BITS), _mm256_srai_epi32(r1, BITS));
+    }
+
+    // Two pixels per lane -> Y0 Y1 ? ? (32-bit)
+    static inline __m256i y_2px(__m256i v, __m256i m2)
+    {
+        __m256i t = _mm256_madd_epi16(v, m2); // e0 f0 e1 f1
+        return _mm256_shuffle_epi32(_mm256_add_epi32(t, _mm256_srli_epi64(t, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+    }
+
+    // 8 BGR pixels per lane as four registers of two pixels each (see BGR_to_YCC in mjpegwriter.cpp)
+    static inline void split_8px(const uchar *pSrc, __m256i &v0, __m256i &v1, __m256i &v2, __m256i &v3)
+    {
+        const __m256i z = _mm256_setzero_si256();
+        v0 = _mm256_unpacklo_epi8(load_2x8(pSrc, pSrc + 24), z);      // b0 g0 r0 b1 g1 r1 b2 g2
+        v1 = _mm256_unpacklo_epi8(load_2x8(pSrc + 8, pSrc + 32), z);  // r2 b3 g3 r3 b4 g4 r4 b5
+        v2 = _mm256_unpacklo_epi8(load_2x8(pSrc + 16, pSrc + 40), z); // g5 r5 b6 g6 r6 b7 g7 r7
+
+        v3 = _mm256_srli_si256(v2, 2); // ? b6 g6 r6 b7 g7 r7 0
+        v2 = _mm256_or_si256(_mm256_slli_si256(v2, 10), _mm256_srli_si256(v1, 6)); // ? b4 g4 r4 b5 g5 r5 ?
+        v1 = _mm256_or_si256(_mm256_slli_si256(v1, 6), _mm256_srli_si256(v0, 10)); // ? b2 g2 r2 b3 g3 r3 ?
+        v0 = _mm256_slli_si256(v0, 2); // 0 b0 g0 r0 b1 g1 r1 ?
+    }
+
+    static int BGR_to_YCC_avx2(uchar *pDstY, uchar *pDstCb, uchar *pDstCr, const uchar *pSrc, int num_pixels)
+    {
+        const __m256i m0 = _mm256_broadcastsi128_si256(_mm_setr_epi16(0, m00, m01, m02, m00, m01, m02, 0));
+        const __m256i m1 = _mm256_broadcastsi128_si256(_mm_setr_epi16(0, m10, m11, m12, m10, m11, m12, 0));
+        const __m256i m2 = _mm256_broadcastsi128_si256(_mm_setr_epi16(0, m20, m21, m22, m20, m21, m22, 0));
+        const __m256i m3 = _mm256_broadcastsi128_si256(_mm_setr_epi32(m03, m13, m23, 0));
+        __m256i v0, v1, v2, v3, r0, t0, t1, t2;
+        int n = 0;
+
+        for (; n <= num_pixels - 16; n += 16, pSrc += 16 * 3)
+        {
+            split_8px(pSrc, v0, v1, v2, v3);
+            v0 = ycc_2px(v0, m0, m1, m2, m3); // V0 U0 Y0 0 V1 U1 Y1 0
+            v1 = ycc_2px(v1, m0, m1, m2, m3); // V2 U2 Y2 0 V3 U3 Y3 0
+            v2 = ycc_2px(v2, m0, m1, m2, m3); // V4 U4 Y4 0 V5 U5 Y5 0
+            v3 = ycc_2px(v3, m0, m1, m2, m3); // V6 U6 Y6 0 V7 U7 Y7 0
+
+            r0 = _mm256_unpacklo_epi16(v0, v1); // V0 V2 U0 U2 Y0 Y2 0 0
+            v1 = _mm256_unpackhi_epi16(v0, v1); // V1 V3 U1 U3 Y1 Y3 0 0
+            v0 = _mm256_unpacklo_epi16(r0, v1); // V0 V1 V2 V3 U0 U1 U2 U3
+            v1 = _mm256_unpackhi_epi16(r0, v1); // Y0 Y1 Y2 Y3 0 0 0 0
+            r0 = _mm256_unpacklo_epi16(v2, v3); // V4 V6 U4 U6 Y4 Y6 0 0
+            v3 = _mm256_unpackhi_epi16(v2, v3); // V5 V7 U5 U7 Y5 Y7 0 0
+            v2 = _mm256_unpacklo_epi16(r0, v3); // V4 V5 V6 V7 U4 U5 U6 U7
+            v3 = _mm256_unpackhi_epi16(r0, v3); // Y4 Y5 Y6 Y7 0 0 0 0
+
+            t0 = _mm256_unpacklo_epi64(v0, v2); // V0 ... V7
+            t1 = _mm256_unpackhi_epi64(v0, v2); // U0 ... U7
+            t2 = _mm256_unpacklo_epi64(v1, v3); // Y0 ... Y7
+
+            store_2x8(pDstCr + n, _mm256_packus_epi16(t0, t0));
+            store_2x8(pDstCb + n, _mm256_packus_epi16(t1, t1));
+            store_2x8(pDstY + n, _mm256_packus_epi16(t2, t2));
+        }
+        return n;
+    }
+
+    static int BGR_to_Y_avx2(uchar *pDstY, const uchar *pSrc, int num_pixels)
+    {
+        const __m256i m2 = _mm256_broadcastsi128_si256(_mm_setr_epi16(0, m20, m21, m22, m20, m21, m22, 0));
+        const __m256i m3 = _mm256_set1_epi32(m23);
+        __m256i v0, v1, v2, v3;
+        int n = 0;
+
+        for (; n <= num_pixels - 16; n += 16, pSrc += 16 * 3)
+        {
+            split_8px(pSrc, v0, v1, v2, v3);
+            v0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi64(y_2px(v0, m2), y_2px(v1, m2)), m3), BITS); // Y0 ... Y3
+            v2 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi64(y_2px(v2, m2), y_2px(v3, m2)), m3), BITS); // Y4 ... Y7
+            v0 = _mm256_packs_epi32(v0, v2);
+            store_2x8(pDstY + n, _mm256_packus_epi16(v0, v0));
+        }
+        return n;
+    }
+
+    // One channel of 16 four-byte pixels (a: 0..7, c: 8..15) with word coefficients k = (c0 c1 c2 0) per pixel
+    static inline __m128i channel_16px(__m256i a, __m256i c, __m256i k, __m256i round)
+    {
+        const __m256i z = _mm256_setzero_si256();
+        // per lane: pixels (0 1 4 5) from unpacklo and (2 3 6 7) from unpackhi, so hadd restores the order
+        __m256i lo = _mm256_hadd_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi8(a, z), k), _mm256_madd_epi16(_mm256_unpackhi_epi8(a, z), k));
+        __m256i hi = _mm256_hadd_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi8(c, z), k), _mm256_madd_epi16(_mm256_unpackhi_epi8(c, z), k));
+        lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), BITS);
+        hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), BITS);
+        __m256i v = _mm256_packs_epi32(lo, hi);  // 0..3 8..11 | 4..7 12..15
+        v = _mm256_packus_epi16(v, v);
+        return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 5, 0, 4, 1, 5)));
+    }
+
+    static inline __m256i bgra_coefs(short c0, short c1, short c2, int rgba)
+    {
+        return rgba ? _mm256_setr_epi16(c2, c1, c0, 0, c2, c1, c0, 0, c2, c1, c0, 0, c2, c1, c0, 0) :
+            _mm256_setr_epi16(c0, c1, c2, 0, c0, c1, c2, 0, c0, c1, c2, 0, c0, c1, c2, 0);
+    }
+
+    static int BGRA_to_YCC_avx2(uchar *pDstY, uchar *pDstCb, uchar *pDstCr, const uchar *pSrc, int num_pixels, int rgba)
+    {
+        const __m256i k0 = bgra_coefs(m00, m01, m02, rgba), k1 = bgra_coefs(m10, m11, m12, rgba), k2 = bgra_coefs(m20, m21, m22, rgba);
+        const __m256i r0 = _mm256_set1_epi32(m03), r1 = _mm256_set1_epi32(m13), r2 = _mm256_set1_epi32(m23);
+        int n = 0;
+
+        for (; n <= num_pixels - 16; n += 16, pSrc += 16 * 4)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i*)pSrc), c = _mm256_loadu_si256((const __m256i*)(pSrc + 32));
+            _mm_storeu_si128((__m128i*)(pDstCr + n), channel_16px(a, c, k0, r0));
+            _mm_storeu_si128((__m128i*)(pDstCb + n), channel_16px(a, c, k1, r1));
+            _mm_storeu_si128((__m128i*)(pDstY + n), channel_16px(a, c, k2, r2));
+        }
+        return n;
+    }
+
+    static int BGRA_to_Y_avx2(uchar *pDstY, const uchar *pSrc, int num_pixels, int rgba)
+    {
+        const __m256i k2 = bgra_coefs(m20, m21, m22, rgba), r2 = _mm256_set1_epi32(m23);
+        int n = 0;
+
+        for (; n <= num_pixels - 16; n += 16, pSrc += 16 * 4)
+            _mm_storeu_si128((__m128i*)(pDstY + n), channel_16px(_mm256_loadu_si256((const __m256i*)pSrc), _mm256_loadu_si256((const __m256i*)(pSrc + 32)), k2, r2));
+        return n;
+    }
+
+    // Sum of horizontal byte pairs as 16-bit values
+    static inline __m256i hsum_u8(__m256i r)
+    {
+        return _mm256_add_epi16(_mm256_and_si256(r, _mm256_set1_epi16(255)), _mm256_srli_epi16(r, 8));
+    }
+
+    static void downsample_h2v2_avx2(uchar *pDst, uchar * const *pSrc, int x)
+    {
+        x <<= 4;
+        // output rows 2k (low lane) and 2k + 1 (high lane); the bias alternates 0/2 and flips every row
+        const __m256i delta = _mm256_setr_epi16(0, 2, 0, 2, 0, 2, 0, 2, 2, 0, 2, 0, 2, 0, 2, 0);
+        for (int i = 0; i < 16; i += 8, pDst += 32)
+        {
+            __m256i res0 = _mm256_add_epi16(hsum_u8(load_2x16(pSrc[i + 0] + x, pSrc[i + 2] + x)), hsum_u8(load_2x16(pSrc[i + 1] + x, pSrc[i + 3] + x)));
+            __m256i res1 = _mm256_add_epi16(hsum_u8(load_2x16(pSrc[i + 4] + x, pSrc[i + 6] + x)), hsum_u8(load_2x16(pSrc[i + 5] + x, pSrc[i + 7] + x)));
+            res0 = _mm256_srli_epi16(_mm256_add_epi16(res0, delta), 2);
+            res1 = _mm256_srli_epi16(_mm256_add_epi16(res1, delta), 2);
+            // lanes hold rows (0, 2) and (1, 3) of this group
+            _mm256_storeu_si256((__m256i*)pDst, _mm256_permute4x64_epi64(_mm256_packus_epi16(res0, res1), _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+    }
+
+    static void downsample_h2v1_avx2(uchar *pDst, uchar * const *pSrc, int x)
+    {
+        x <<= 4;
+        const __m256i delta = _mm256_setr_epi16(0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1);
+        for (int i = 0; i < 8; i += 4, pDst += 32)
+        {
+            __m256i res0 = _mm256_srli_epi16(_mm256_add_epi16(hsum_u8(load_2x16(pSrc[i + 0] + x, pSrc[i + 1] + x)), delta), 1);
+            __m256i res1 = _mm256_srli_epi16(_mm256_add_epi16(hsum_u8(load_2x16(pSrc[i + 2] + x, pSrc[i + 3] + x)), delta), 1);
+            _mm256_storeu_si256((__m256i*)pDst, _mm256_permute4x64_epi64(_mm256_packus_epi16(res0, res1), _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+    }
+
+    // Forward DCT of two blocks, one per 128-bit lane (see DCT2D_sse2 in mjpegwriter.cpp)
+    static inline void transpose_8x8(__m256i *v)
+    {
+        __m256i a0 = _mm256_unpacklo_epi16(v[0], v[1]), a1 = _mm256_unpackhi_epi16(v[0], v[1]);
+        __m256i a2 = _mm256_unpacklo_epi16(v[2], v[3]), a3 = _mm256_unpackhi_epi16(v[2], v[3]);
+        __m256i a4 = _mm256_unpacklo_epi16(v[4], v[5]), a5 = _mm256_unpackhi_epi16(v[4], v[5]);
+        __m256i a6 = _mm256_unpacklo_epi16(v[6], v[7]), a7 = _mm256_unpackhi_epi16(v[6], v[7]);
+        __m256i b0 = _mm256_unpacklo_epi32(a0, a2), b1 = _mm256_unpackhi_epi32(a0, a2);
+        __m256i b2 = _mm256_unpacklo_epi32(a1, a3), b3 = _mm256_unpackhi_epi32(a1, a3);
+        __m256i b4 = _mm256_unpacklo_epi32(a4, a6), b5 = _mm256_unpackhi_epi32(a4, a6);
+        __m256i b6 = _mm256_unpacklo_epi32(a5, a7), b7 = _mm256_unpackhi_epi32(a5, a7);
+        v[0] = _mm256_unpacklo_epi64(b0, b4); v[1] = _mm256_unpackhi_epi64(b0, b4);
+        v[2] = _mm256_unpacklo_epi64(b1, b5); v[3] = _mm256_unpackhi_epi64(b1, b5);
+        v[4] = _mm256_unpacklo_epi64(b2, b6); v[5] = _mm256_unpackhi_epi64(b2, b6);
+        v[6] = _mm256_unpacklo_epi64(b3, b7); v[7] = _mm256_unpackhi_epi64(b3, b7);
+    }
+
+    // pmaddwd constant: ka for the first operand, kb for the second
+    static inline __m256i dct_k(int ka, int kb)
+    {
+        return _mm256_set1_epi32(static_cast<int>((ka & 0xffff) | (static_cast<unsigned>(kb) << 16)));
+    }
+
+    static inline __m256i dct_madd(__m256i a, __m256i b, __m256i k, __m256i addlo, __m256i addhi, __m256i round, __m128i shift)
+    {
+        __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), k), addlo);
+        __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), k), addhi);
+        return _mm256_packs_epi32(_mm256_sra_epi32(_mm256_add_epi32(lo, round), shift), _mm256_sra_epi32(_mm256_add_epi32(hi, round), shift));
+    }
+
+    static inline void DCT1D_avx2(__m256i *v, bool cols)
+    {
+        const __m256i z = _mm256_setzero_si256();
+        const int n = cols ? CONST_BITS + ROW_BITS + 3 : CONST_BITS - ROW_BITS;
+        const __m256i round = _mm256_set1_epi32(1 << (n - 1));
+        const __m128i shift = _mm_cvtsi32_si128(n);
+        __m256i t0 = _mm256_add_epi16(v[0], v[7]), t7 = _mm256_sub_epi16(v[0], v[7]), t1 = _mm256_add_epi16(v[1], v[6]), t6 = _mm256_sub_epi16(v[1], v[6]);
+        __m256i t2 = _mm256_add_epi16(v[2], v[5]), t5 = _mm256_sub_epi16(v[2], v[5]), t3 = _mm256_add_epi16(v[3], v[4]), t4 = _mm256_sub_epi16(v[3], v[4]);
+        __m256i t10 = _mm256_add_epi16(t0, t3), t13 = _mm256_sub_epi16(t0, t3), t11 = _mm256_add_epi16(t1, t2), t12 = _mm256_sub_epi16(t1, t2);
+
+        if (cols)
+        {
+            const __m256i r = _mm256_set1_epi16(1 << (ROW_BITS + 2));
+            v[0] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(t10, t11), r), ROW_BITS + 3);
+            v[4] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_sub_epi16(t10, t11), r), ROW_BITS + 3);
+        }
+        else
+        {
+            v[0] = _mm256_slli_epi16(_mm256_add_epi16(t10, t11), ROW_BITS);
+            v[4] = _mm256_slli_epi16(_mm256_sub_epi16(t10, t11), ROW_BITS);
+        }
+        v[2] = dct_madd(t12, t13, dct_k(4433, 10703), z, z, round, shift);
+        v[6] = dct_madd(t12, t13, dct_k(-10704, 4433), z, z, round, shift);
+
+        __m256i u3 = _mm256_add_epi16(t4, t6), u4 = _mm256_add_epi16(t5, t7);
+        const __m256i k3 = dct_k(-6436, 9633), k4 = dct_k(9633, 6437);
+        __m256i z3lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(u3, u4), k3), z3hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(u3, u4), k3);
+        __m256i z4lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(u3, u4), k4), z4hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(u3, u4), k4);
+        v[1] = dct_madd(t4, t7, dct_k(-7373, 4926), z4lo, z4hi, round, shift);
+        v[7] = dct_madd(t4, t7, dct_k(-4927, -7373), z3lo, z3hi, round, shift);
+        v[3] = dct_madd(t5, t6, dct_k(-20995, 4177), z3lo, z3hi, round, shift);
+        v[5] = dct_madd(t5, t6, dct_k(-4176, -20995), z4lo, z4hi, round, shift);
+    }
+
+    static void fdct_8x8_x2_avx2(short *pDst, const uchar *pSrc)
+    {
+        const __m256i z = _mm256_setzero_si256(), c128 = _mm256_set1_epi16(128);
+        __m256i v[8];
+        for (int i = 0; i < 8; i++)
+            v[i] = _mm256_sub_epi16(_mm256_unpacklo_epi8(load_2x8(pSrc + i * 8, pSrc + 64 + i * 8), z), c128);
+        transpose_8x8(v);
+        DCT1D_avx2(v, false);
+        transpose_8x8(v);
+        DCT1D_avx2(v, true);
+        for (int i = 0; i < 8; i++)
+        {
+            _mm_storeu_si128((__m128i*)(pDst + i * 8), _mm256_castsi256_si128(v[i]));
+            _mm_storeu_si128((__m128i*)(pDst + 64 + i * 8), _mm256_extracti128_si256(v[i], 1));
+        }
+    }
+
+    void get_avx2_kernels(encoder_kernels &k)
+    {
+        k.bgr_to_ycc = BGR_to_YCC_avx2;
+        k.bgr_to_y = BGR_to_Y_avx2;
+        k.bgra_to_ycc = BGRA_to_YCC_avx2;
+        k.bgra_to_y = BGRA_to_Y_avx2;
+        k.downsample_h2v2 = downsample_h2v2_avx2;
+        k.downsample_h2v1 = downsample_h2v1_avx2;
+        k.fdct_8x8_x2 = fdct_8x8_x2_avx2;
+    }
+}
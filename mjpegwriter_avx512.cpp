@@ -0,0 +1,264 @@
+
+#include "mjpegwriter_simd.hpp"
+#include <immintrin.h>
+
+// AVX-512 (F + BW) kernels: the SSE2 algorithms of mjpegwriter.cpp on four 128-bit lanes at once.
+// Built with -mavx512f -mavx512bw (/arch:AVX512), called only when the CPU reports both.
+
+namespace jcodec
+{
+    typedef unsigned char uchar;
+
+    // 8 bytes at p, p + step, p + 2 * step, p + 3 * step in lanes 0..3
+    static inline __m512i load_4x8(const uchar *p, int step)
+    {
+        __m512i r = _mm512_castsi128_si512(_mm_loadl_epi64((const __m128i*)p));
+        r = _mm512_inserti32x4(r, _mm_loadl_epi64((const __m128i*)(p + step)), 1);
+        r = _mm512_inserti32x4(r, _mm_loadl_epi64((const __m128i*)(p + 2 * step)), 2);
+        return _mm512_inserti32x4(r, _mm_loadl_epi64((const __m128i*)(p + 3 * step)), 3);
+    }
+
+    static inline __m512i load_4x16(const uchar *p0, const uchar *p1, const uchar *p2, const uchar *p3)
+    {
+        __m512i r = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)p0));
+        r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)p1), 1);
+        r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)p2), 2);
+        return _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)p3), 3);
+    }
+
+    // low 8 bytes of the four lanes -> 32 bytes at p
+    static inline void store_4x8(uchar *p, __m512i v)
+    {
+        _mm256_storeu_si256((__m256i*)p, _mm512_castsi512_si256(_mm512_permutexvar_epi64(_mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7), v)));
+    }
+
+    // Two pixels per lane (? b0 g0 r0 b1 g1 r1 ?) -> V0 U0 Y0 0 V1 U1 Y1 0
+    static inline __m512i ycc_2px(__m512i v, __m512i m0, __m512i m1, __m512i m2, __m512i m3)
+    {
+        const __m512i z = _mm512_setzero_si512();
+        __m512i t0 = _mm512_madd_epi16(v, m0); // a0 b0 a1 b1
+        __m512i t1 = _mm512_madd_epi16(v, m1); // c0 d0 c1 d1
+        __m512i t2 = _mm512_madd_epi16(v, m2); // e0 f0 e1 f1
+        v = _mm512_unpacklo_epi32(t0, t1);     // a0 c0 b0 d0
+        t0 = _mm512_unpackhi_epi32(t0, t1);    // a1 c1 b1 d1
+        t1 = _mm512_unpacklo_epi32(t2, z);     // e0 0 f0 0
+        t2 = _mm512_unpackhi_epi32(t2, z);     // e1 0 f1 0
+        __m512i r0 = _mm512_add_epi32(_mm512_add_epi32(_mm512_unpacklo_epi64(v, t1), _mm512_unpackhi_epi64(v, t1)), m3);
+        __m512i r1 = _mm512_add_epi32(_mm512_add_epi32(_mm512_unpacklo_epi64(t0, t2), _mm512_unpackhi_epi64(t0, t2)), m3);
+        return _mm512_packs_epi32(_mm512_srai_epi32(r0, BITS), _mm512_srai_epi32(r1, BITS));
+    }
+
+    // Two pixels per lane -> Y0 Y1 ? ? (32-bit)
+    static inline __m512i y_2px(__m512i v, __m512i m2)
+    {
+        __m512i t = _mm512_madd_epi16(v, m2); // e0 f0 e1 f1
+        return _mm512_shuffle_epi32(_mm512_add_epi32(t, _mm512_srli_epi64(t, 32)), _MM_PERM_DBCA);
+    }
+
+    // 8 BGR pixels per lane as four registers of two pixels each (see BGR_to_YCC in mjpegwriter.cpp)
+    static inline void split_8px(const uchar *pSrc, __m512i &v0, __m512i &v1, __m512i &v2, __m512i &v3)
+    {
+        const __m512i z = _mm512_setzero_si512();
+        v0 = _mm512_unpacklo_epi8(load_4x8(pSrc, 24), z);      // b0 g0 r0 b1 g1 r1 b2 g2
+        v1 = _mm512_unpacklo_epi8(load_4x8(pSrc + 8, 24), z);  // r2 b3 g3 r3 b4 g4 r4 b5
+        v2 = _mm512_unpacklo_epi8(load_4x8(pSrc + 16, 24), z); // g5 r5 b6 g6 r6 b7 g7 r7
+
+        v3 = _mm512_bsrli_epi128(v2, 2); // ? b6 g6 r6 b7 g7 r7 0
+        v2 = _mm512_or_si512(_mm512_bslli_epi128(v2, 10), _mm512_bsrli_epi128(v1, 6)); // ? b4 g4 r4 b5 g5 r5 ?
+        v1 = _mm512_or_si512(_mm512_bslli_epi128(v1, 6), _mm512_bsrli_epi128(v0, 10)); // ? b2 g2 r2 b3 g3 r3 ?
+        v0 = _mm512_bslli_epi128(v0, 2); // 0 b0 g0 r0 b1 g1 r1 ?
+    }
+
+    static int BGR_to_YCC_avx512(uchar *pDstY, uchar *pDstCb, uchar *pDstCr, const uchar *pSrc, int num_pixels)
+    {
+        const __m512i m0 = _mm512_broadcast_i32x4(_mm_setr_epi16(0, m00, m01, m02, m00, m01, m02, 0));
+        const __m512i m1 = _mm512_broadcast_i32x4(_mm_setr_epi16(0, m10, m11, m12, m10, m11, m12, 0));
+        const __m512i m2 = _mm512_broadcast_i32x4(_mm_setr_epi16(0, m20, m21, m22, m20, m21, m22, 0));
+        const __m512i m3 = _mm512_broadcast_i32x4(_mm_setr_epi32(m03, m13, m23, 0));
+        __m512i v0, v1, v2, v3, r0, t0, t1, t2;
+        int n = 0;
+
+        for (; n <= num_pixels - 32; n += 32, pSrc += 32 * 3)
+        {
+            split_8px(pSrc, v0, v1, v2, v3);
+            v0 = ycc_2px(v0, m0, m1, m2, m3); // V0 U0 Y0 0 V1 U1 Y1 0
+            v1 = ycc_2px(v1, m0, m1, m2, m3); // V2 U2 Y2 0 V3 U3 Y3 0
+            v2 = ycc_2px(v2, m0, m1, m2, m3); // V4 U4 Y4 0 V5 U5 Y5 0
+            v3 = ycc_2px(v3, m0, m1, m2, m3); // V6 U6 Y6 0 V7 U7 Y7 0
+
+            r0 = _mm512_unpacklo_epi16(v0, v1); // V0 V2 U0 U2 Y0 Y2 0 0
+            v1 = _mm512_unpackhi_epi16(v0, v1); // V1 V3 U1 U3 Y1 Y3 0 0
+            v0 = _mm512_unpacklo_epi16(r0, v1); // V0 V1 V2 V3 U0 U1 U2 U3
+            v1 = _mm512_unpackhi_epi16(r0, v1); // Y0 Y1 Y2 Y3 0 0 0 0
+            r0 = _mm512_unpacklo_epi16(v2, v3); // V4 V6 U4 U6 Y4 Y6 0 0
+            v3 = _mm512_unpackhi_epi16(v2, v3); // V5 V7 U5 U7 Y5 Y7 0 0
+            v2 = _mm512_unpacklo_epi16(r0, v3); // V4 V5 V6 V7 U4 U5 U6 U7
+            v3 = _mm512_unpackhi_epi16(r0, v3); // Y4 Y5 Y6 Y7 0 0 0 0
+
+            t0 = _mm512_unpacklo_epi64(v0, v2); // V0 ... V7
+            t1 = _mm512_unpackhi_epi64(v0, v2); // U0 ... U7
+            t2 = _mm512_unpacklo_epi64(v1, v3); // Y0 ... Y7
+
+            store_4x8(pDstCr + n, _mm512_packus_epi16(t0, t0));
+            store_4x8(pDstCb + n, _mm512_packus_epi16(t1, t1));
+            store_4x8(pDstY + n, _mm512_packus_epi16(t2, t2));
+        }
+        return n;
+    }
+
+    static int BGR_to_Y_avx512(uchar *pDstY, const uchar *pSrc, int num_pixels)
+    {
+        const __m512i m2 = _mm512_broadcast_i32x4(_mm_setr_epi16(0, m20, m21, m22, m20, m21, m22, 0));
+        const __m512i m3 = _mm512_set1_epi32(m23);
+        __m512i v0, v1, v2, v3;
+        int n = 0;
+
+        for (; n <= num_pixels - 32; n += 32, pSrc += 32 * 3)
+        {
+            split_8px(pSrc, v0, v1, v2, v3);
+            v0 = _mm512_srai_epi32(_mm512_add_epi32(_mm512_unpacklo_epi64(y_2px(v0, m2), y_2px(v1, m2)), m3), BITS); // Y0 ... Y3
+            v2 = _mm512_srai_epi32(_mm512_add_epi32(_mm512_unpacklo_epi64(y_2px(v2, m2), y_2px(v3, m2)), m3), BITS); // Y4 ... Y7
+            v0 = _mm512_packs_epi32(v0, v2);
+            store_4x8(pDstY + n, _mm512_packus_epi16(v0, v0));
+        }
+        return n;
+    }
+
+    // Sum of horizontal byte pairs as 16-bit values
+    static inline __m512i hsum_u8(__m512i r)
+    {
+        return _mm512_add_epi16(_mm512_and_si512(r, _mm512_set1_epi16(255)), _mm512_srli_epi16(r, 8));
+    }
+
+    static void downsample_h2v2_avx512(uchar *pDst, uchar * const *pSrc, int x)
+    {
+        x <<= 4;
+        // output rows 0..3 and 4..7 in lanes 0..3; the bias alternates 0/2 and flips every row
+        const __m512i delta = _mm512_broadcast_i64x4(_mm256_setr_epi16(0, 2, 0, 2, 0, 2, 0, 2, 2, 0, 2, 0, 2, 0, 2, 0));
+        __m512i res0 = _mm512_add_epi16(hsum_u8(load_4x16(pSrc[0] + x, pSrc[2] + x, pSrc[4] + x, pSrc[6] + x)),
+            hsum_u8(load_4x16(pSrc[1] + x, pSrc[3] + x, pSrc[5] + x, pSrc[7] + x)));
+        __m512i res1 = _mm512_add_epi16(hsum_u8(load_4x16(pSrc[8] + x, pSrc[10] + x, pSrc[12] + x, pSrc[14] + x)),
+            hsum_u8(load_4x16(pSrc[9] + x, pSrc[11] + x, pSrc[13] + x, pSrc[15] + x)));
+        res0 = _mm512_srli_epi16(_mm512_add_epi16(res0, delta), 2);
+        res1 = _mm512_srli_epi16(_mm512_add_epi16(res1, delta), 2);
+        // lane j holds rows j and 4 + j
+        _mm512_storeu_si512(pDst, _mm512_permutexvar_epi64(_mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7), _mm512_packus_epi16(res0, res1)));
+    }
+
+    static void downsample_h2v1_avx512(uchar *pDst, uchar * const *pSrc, int x)
+    {
+        x <<= 4;
+        const __m512i delta = _mm512_set1_epi32(1 << 16);
+        __m512i res0 = _mm512_srli_epi16(_mm512_add_epi16(hsum_u8(load_4x16(pSrc[0] + x, pSrc[1] + x, pSrc[2] + x, pSrc[3] + x)), delta), 1);
+        __m512i res1 = _mm512_srli_epi16(_mm512_add_epi16(hsum_u8(load_4x16(pSrc[4] + x, pSrc[5] + x, pSrc[6] + x, pSrc[7] + x)), delta), 1);
+        _mm512_storeu_si512(pDst, _mm512_permutexvar_epi64(_mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7), _mm512_packus_epi16(res0, res1)));
+    }
+
+    // Forward DCT of four blocks, one per 128-bit lane (see DCT2D_sse2 in mjpegwriter.cpp)
+    static inline void transpose_8x8(__m512i *v)
+    {
+        __m512i a0 = _mm512_unpacklo_epi16(v[0], v[1]), a1 = _mm512_unpackhi_epi16(v[0], v[1]);
+        __m512i a2 = _mm512_unpacklo_epi16(v[2], v[3]), a3 = _mm512_unpackhi_epi16(v[2], v[3]);
+        __m512i a4 = _mm512_unpacklo_epi16(v[4], v[5]), a5 = _mm512_unpackhi_epi16(v[4], v[5]);
+        __m512i a6 = _mm512_unpacklo_epi16(v[6], v[7]), a7 = _mm512_unpackhi_epi16(v[6], v[7]);
+        __m512i b0 = _mm512_unpacklo_epi32(a0, a2), b1 = _mm512_unpackhi_epi32(a0, a2);
+        __m512i b2 = _mm512_unpacklo_epi32(a1, a3), b3 = _mm512_unpackhi_epi32(a1, a3);
+        __m512i b4 = _mm512_unpacklo_epi32(a4, a6), b5 = _mm512_unpackhi_epi32(a4, a6);
+        __m512i b6 = _mm512_unpacklo_epi32(a5, a7), b7 = _mm512_unpackhi_epi32(a5, a7);
+        v[0] = _mm512_unpacklo_epi64(b0, b4); v[1] = _mm512_unpackhi_epi64(b0, b4);
+        v[2] = _mm512_unpacklo_epi64(b1, b5); v[3] = _mm512_unpackhi_epi64(b1, b5);
+        v[4] = _mm512_unpacklo_epi64(b2, b6); v[5] = _mm512_unpackhi_epi64(b2, b6);
+        v[6] = _mm512_unpacklo_epi64(b3, b7); v[7] = _mm512_unpackhi_epi64(b3, b7);
+    }
+
+    // pmaddwd constant: ka for the first operand, kb for the second
+    static inline __m512i dct_k(int ka, int kb)
+    {
+        return _mm512_set1_epi32(static_cast<int>((ka & 0xffff) | (static_cast<unsigned>(kb) << 16)));
+    }
+
+    static inline __m512i dct_madd(__m512i a, __m512i b, __m512i k, __m512i addlo, __m512i addhi, __m512i round, __m128i shift)
+    {
+        __m512i lo = _mm512_add_epi32(_mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), k), addlo);
+        __m512i hi = _mm512_add_epi32(_mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), k), addhi);
+        return _mm512_packs_epi32(_mm512_sra_epi32(_mm512_add_epi32(lo, round), shift), _mm512_sra_epi32(_mm512_add_epi32(hi, round), shift));
+    }
+
+    static inline void DCT1D_avx512(__m512i *v, bool cols)
+    {
+        const __m512i z = _mm512_setzero_si512();
+        const int n = cols ? CONST_BITS + ROW_BITS + 3 : CONST_BITS - ROW_BITS;
+        const __m512i round = _mm512_set1_epi32(1 << (n - 1));
+        const __m128i shift = _mm_cvtsi32_si128(n);
+        __m512i t0 = _mm512_add_epi16(v[0], v[7]), t7 = _mm512_sub_epi16(v[0], v[7]), t1 = _mm512_add_epi16(v[1], v[6]), t6 = _mm512_sub_epi16(v[1], v[6]);
+        __m512i t2 = _mm512_add_epi16(v[2], v[5]), t5 = _mm512_sub_epi16(v[2], v[5]), t3 = _mm512_add_epi16(v[3], v[4]), t4 = _mm512_sub_epi16(v[3], v[4]);
+        __m512i t10 = _mm512_add_epi16(t0, t3), t13 = _mm512_sub_epi16(t0, t3), t11 = _mm512_add_epi16(t1, t2), t12 = _mm512_sub_epi16(t1, t2);
+
+        if (cols)
+        {
+            const __m512i r = _mm512_set1_epi16(1 << (ROW_BITS + 2));
+            v[0] = _mm512_srai_epi16(_mm512_add_epi16(_mm512_add_epi16(t10, t11), r), ROW_BITS + 3);
+            v[4] = _mm512_srai_epi16(_mm512_add_epi16(_mm512_sub_epi16(t10, t11), r), ROW_BITS + 3);
+        }
+        else
+        {
+            v[0] = _mm512_slli_epi16(_mm512_add_epi16(t10, t11), ROW_BITS);
+            v[4] = _mm512_slli_epi16(_mm512_sub_epi16(t10, t11), ROW_BITS);
+        }
+        v[2] = dct_madd(t12, t13, dct_k(4433, 10703), z, z, round, shift);
+        v[6] = dct_madd(t12, t13, dct_k(-10704, 4433), z, z, round, shift);
+
+        __m512i u3 = _mm512_add_epi16(t4, t6), u4 = _mm512_add_epi16(t5, t7);
+        const __m512i k3 = dct_k(-6436, 9633), k4 = dct_k(9633, 6437);
+        __m512i z3lo = _mm512_madd_epi16(_mm512_unpacklo_epi16(u3, u4), k3), z3hi = _mm512_madd_epi16(_mm512_unpackhi_epi16(u3, u4), k3);
+        __m512i z4lo = _mm512_madd_epi16(_mm512_unpacklo_epi16(u3, u4), k4), z4hi = _mm512_madd_epi16(_mm512_unpackhi_epi16(u3, u4), k4);
+        v[1] = dct_madd(t4, t7, dct_k(-7373, 4926), z4lo, z4hi, round, shift);
+        v[7] = dct_madd(t4, t7, dct_k(-4927, -7373), z3lo, z3hi, round, shift);
+        v[3] = dct_madd(t5, t6, dct_k(-20995, 4177), z3lo, z3hi, round, shift);
+        v[5] = dct_madd(t5, t6, dct_k(-4176, -20995), z4lo, z4hi, round, shift);
+    }
+
+    static void fdct_8x8_x4_avx512(short *pDst, const uchar *pSrc)
+    {
+        const __m512i z = _mm512_setzero_si512(), c128 = _mm512_set1_epi16(128);
+        __m512i v[8];
+        for (int i = 0; i < 8; i++)
+            v[i] = _mm512_sub_epi16(_mm512_unpacklo_epi8(load_4x8(pSrc + i * 8, 64), z), c128);
+        transpose_8x8(v);
+        DCT1D_avx512(v, false);
+        transpose_8x8(v);
+        DCT1D_avx512(v, true);
+        for (int i = 0; i < 8; i++)
+        {
+            _mm_storeu_si128((__m128i*)(pDst + i * 8), _mm512_castsi512_si128(v[i]));
+            _mm_storeu_si128((__m128i*)(pDst + 64 + i * 8), _mm512_extracti32x4_epi32(v[i], 1));
+            _mm_storeu_si128((__m128i*)(pDst + 128 + i * 8), _mm512_extracti32x4_epi32(v[i], 2));
+            _mm_storeu_si128((__m128i*)(pDst + 192 + i * 8), _mm512_extracti32x4_epi32(v[i], 3));
+        }
+    }
+
+    // Zig-zag order with two-source word permutes, then quantize_sse2 of mjpegwriter.cpp 32 coefficients at a time
+    static void quantize_8x8_avx512(short *pDst, const short *pSrc, const unsigned short *pRecip)
+    {
+        const __m512i lo = _mm512_loadu_si512(pSrc), hi = _mm512_loadu_si512(pSrc + 32);
+        for (int i = 0; i < 64; i += 32)
+        {
+            __m512i v = _mm512_permutex2var_epi16(lo, _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(s_zag + i))), hi);
+            __m512i sign = _mm512_srai_epi16(v, 15);
+            v = _mm512_add_epi16(_mm512_sub_epi16(_mm512_xor_si512(v, sign), sign), _mm512_loadu_si512(pRecip + i));
+            v = _mm512_mulhi_epu16(_mm512_slli_epi16(v, 2), _mm512_loadu_si512(pRecip + 64 + i));
+            v = _mm512_mulhi_epu16(v, _mm512_loadu_si512(pRecip + 128 + i));
+            _mm512_storeu_si512(pDst + i, _mm512_sub_epi16(_mm512_xor_si512(v, sign), sign));
+        }
+    }
+
+    void get_avx512_kernels(encoder_kernels &k)
+    {
+        k.bgr_to_ycc = BGR_to_YCC_avx512;
+        k.bgr_to_y = BGR_to_Y_avx512;
+        k.downsample_h2v2 = downsample_h2v2_avx512;
+        k.downsample_h2v1 = downsample_h2v1_avx512;
+        k.fdct_8x8_x4 = fdct_8x8_x4_avx512;
+        k.quantize_8x8 = quantize_8x8_avx512;
+    }
+}
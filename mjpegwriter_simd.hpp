@@ -0,0 +1,51 @@
+#ifndef MJPEGWRITER_SIMD_HPP
+#define MJPEGWRITER_SIMD_HPP
+
+// Per-pixel encoder kernels shared by the instruction set translation units.
+// mjpegwriter_avx2.cpp and mjpegwriter_avx512.cpp are built with their own ISA flags, so they
+// include nothing but this header and the intrinsics (no inline library code may be compiled
+// with wider instructions than the CPU is known to have).
+
+namespace jcodec
+{
+    // BGR -> YCbCr in BITS-bit fixed point, the same in every kernel
+    static const int BITS = 10, SCALE = 1 << BITS;
+    static const short m00 = static_cast<short>(-0.081f * SCALE), m01 = static_cast<short>(-0.419f * SCALE),
+        m02 = static_cast<short>(0.5f * SCALE), m10 = static_cast<short>(0.5f * SCALE),
+        m11 = static_cast<short>(-0.331f * SCALE), m12 = static_cast<short>(-0.169f * SCALE),
+        m20 = static_cast<short>(0.114f * SCALE), m21 = static_cast<short>(0.587f  * SCALE),
+        m22 = static_cast<short>(0.299f * SCALE);
+    static const int m03 = static_cast<int>((128 + 0.5f) * SCALE), m13 = static_cast<int>((0.5f + 128) * SCALE),
+        m23 = static_cast<int>(0.5f * SCALE);
+
+    static const unsigned char s_zag[64] = { 0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+    // jfdctint fixed point: CONST_BITS fraction bits, ROW_BITS kept between the passes
+    static const int CONST_BITS = 13, ROW_BITS = 2;
+
+    // Wide kernels; 0 entries fall back to the SSE2/scalar code of mjpegwriter.cpp.
+    struct encoder_kernels
+    {
+        // Convert the leading multiple of the kernel width of num_pixels and return how many were done.
+        int (*bgr_to_ycc)(unsigned char *pDstY, unsigned char *pDstCb, unsigned char *pDstCr, const unsigned char *pSrc, int num_pixels);
+        int (*bgr_to_y)(unsigned char *pDstY, const unsigned char *pSrc, int num_pixels);
+        // The same for four-byte pixels, BGRA or (rgba != 0) RGBA; alpha is ignored.
+        int (*bgra_to_ycc)(unsigned char *pDstY, unsigned char *pDstCb, unsigned char *pDstCr, const unsigned char *pSrc, int num_pixels, int rgba);
+        int (*bgra_to_y)(unsigned char *pDstY, const unsigned char *pSrc, int num_pixels, int rgba);
+        // 8x8 block at pDst averaged from the 16x16 (h2v2) or 16x8 (h2v1) area at column x of the lines pSrc.
+        // The rounding bias alternates per pixel (and per row for h2v2), like the scalar code.
+        void (*downsample_h2v2)(unsigned char *pDst, unsigned char * const *pSrc, int x);
+        void (*downsample_h2v1)(unsigned char *pDst, unsigned char * const *pSrc, int x);
+        // Forward DCT (jfdctint, level shift included) of 2 or 4 consecutive 8x8 blocks, bit-exact with DCT2D.
+        void (*fdct_8x8_x2)(short *pDst, const unsigned char *pSrc);
+        void (*fdct_8x8_x4)(short *pDst, const unsigned char *pSrc);
+        // Quantize a block into zig-zag order with the reciprocal table of jpeg_encoder::compute_quant_recip.
+        void (*quantize_8x8)(short *pDst, const short *pSrc, const unsigned short *pRecip);
+    };
+
+    // Fill in the kernels the translation unit implements and leave the others alone.
+    void get_avx2_kernels(encoder_kernels &k);
+    void get_avx512_kernels(encoder_kernels &k);
+}
+
+#endif
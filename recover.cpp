@@ -0,0 +1,34 @@
+// recover.cpp - repairs in place the AVI files of MjpegWriters that did not get to Close (a crash, a power
+// loss, a killed process), so players and editors can open them; see recover_avi and MjpegWriter::SetCheckpoints.
+//
+// jcodec_recover file.avi ...
+//
+// Prints the frames kept per file and how much of the file had to be read past the last checkpoint. Files that
+// were closed are left untouched. The exit status is 1 if any file could not be repaired.
+#include <stdio.h>
+#include "mjpegwriter.hpp"
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: jcodec_recover file.avi ...\n");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        jcodec::recover_info info;
+        int result = jcodec::recover_avi(argv[i], &info);
+        if (result > 0)
+            printf("%s: %lld frames in %d RIFF, %lld of them indexed, %lld bytes scanned, %lld bytes cut\n", argv[i],
+                info.frames, info.riffs, info.indexed_frames, info.scanned_bytes, info.cut_bytes);
+        else
+        {
+            printf("%s: %s\n", argv[i], result == -1 ? "cannot read or write the file" :
+                result == -2 ? "no complete frame" : "not an AVI file of MjpegWriter");
+            status = 1;
+        }
+    }
+    return status;
+}
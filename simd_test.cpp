@@ -0,0 +1,210 @@
+// simd_test.cpp - checks that every kernel level (set_simd_level) writes the same file, byte for byte, over
+// odd and even frame sizes, input formats and 16-bit depths, subsamplings, stripes, one and two pass and
+// shared Huffman tables.
+//
+// jcodec_simd_test [-v]
+//   -v  print every configuration, not only the ones that differ
+//
+// Levels the CPU does not have are skipped. The exit status is 1 if any level differs from SIMD_SCALAR.
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "mjpegwriter.hpp"
+
+using namespace cv;
+using namespace std;
+
+#define DIM(arr) (sizeof(arr)/sizeof(arr[0]))
+
+static char OUT_FILE[] = "simd_test.avi";
+static const int FRAMES = 3;
+
+static bool read_file(const char *name, vector<char> &data)
+{
+    data.clear();
+    FILE *f = fopen(name, "rb");
+    if (!f)
+        return false;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return true;
+}
+
+// Gradients, edges and noise, shifted per frame; planes and channels of the layout of format. 16-bit samples
+// take the whole range: the picture in the high byte and noise in the low one, every third sample below 256.
+static Mat make_frame(Size size, jcodec::pixel_format_t format, int f)
+{
+    const int w = size.width, h = size.height;
+    Mat bgr(h, w, CV_8UC3);
+    unsigned seed = 777u + f;
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            uchar *p = bgr.ptr(y) + x * 3;
+            int noise = (int)((seed >> 16) & 31);
+            p[0] = saturate_cast<uchar>((x * 7 + f * 5) % 256 + noise - 16);
+            p[1] = saturate_cast<uchar>(y * 255 / h + noise - 16);
+            p[2] = (((x + f) / 4 + y / 4) & 1) ? 230 : 20;
+        }
+    switch (format)
+    {
+    case jcodec::PF_YUYV:
+    {
+        // the channels taken as Y, U and V directly: the kernels see the same bytes either way
+        Mat m(h, w, CV_8UC2);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+            {
+                m.ptr(y)[x * 2] = bgr.ptr(y)[x * 3 + 1];
+                m.ptr(y)[x * 2 + 1] = bgr.ptr(y)[x * 3 + ((x & 1) ? 2 : 0)];
+            }
+        return m;
+    }
+    case jcodec::PF_I420:
+    case jcodec::PF_NV12:
+    {
+        Mat m(h * 3 / 2, w, CV_8UC1);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                m.ptr(y)[x] = bgr.ptr(y)[x * 3 + 1];
+        uchar *c = m.ptr(h);
+        for (int y = 0; y < h / 2; y++)
+            for (int x = 0; x < w / 2; x++)
+            {
+                const uchar *p = bgr.ptr(y * 2) + x * 6;
+                if (format == jcodec::PF_I420)
+                {
+                    c[y * (w / 2) + x] = p[0];
+                    c[(h / 2) * (w / 2) + y * (w / 2) + x] = p[2];
+                }
+                else
+                {
+                    c[y * w + x * 2] = p[0];
+                    c[y * w + x * 2 + 1] = p[2];
+                }
+            }
+        return m;
+    }
+    default:
+    {
+        const bool wide = (format & jcodec::PF_16BIT) != 0;
+        const int layout = format & ~jcodec::PF_16BIT, cn = layout == jcodec::PF_GRAY ? 1 : layout == jcodec::PF_BGR ? 3 : 4;
+        Mat m(h, w, CV_MAKETYPE(wide ? CV_16U : CV_8U, cn));
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+            {
+                const uchar *p = bgr.ptr(y) + x * 3;
+                const int v[4] = { layout == jcodec::PF_GRAY ? p[1] : layout == jcodec::PF_RGBA ? p[2] : p[0], p[1],
+                    layout == jcodec::PF_RGBA ? p[0] : p[2], (x + y) & 255 };
+                for (int c = 0; c < cn; c++)
+                {
+                    if (!wide)
+                        m.ptr(y)[x * cn + c] = (uchar)v[c];
+                    else if ((x + y + c) % 3)
+                        reinterpret_cast<ushort*>(m.ptr(y))[x * cn + c] = (ushort)((v[c] << 8) | ((x * 13 + y * 5 + c * 7) & 255));
+                    else
+                        reinterpret_cast<ushort*>(m.ptr(y))[x * cn + c] = (ushort)v[c];
+                }
+            }
+        return m;
+    }
+    }
+}
+
+// Writes FRAMES frames at the current level; the result of Open or of the first failed Write, else 1.
+static int encode(const vector<Mat> &frames, Size size, jcodec::pixel_format_t format, const jcodec::params &p, bool shared)
+{
+    jcodec::MjpegWriter w;
+    if (shared)
+        w.SetSharedHuffman(2);
+    int result = w.Open(OUT_FILE, (uchar)30, size, p);
+    for (size_t i = 0; (i < frames.size()) && (result >= 0); i++)
+        result = w.Write(frames[i], format);
+    int closed = w.Close();
+    return result < 0 ? result : closed;
+}
+
+int main(int argc, char** argv)
+{
+    const bool verbose = (argc > 1) && !strcmp(argv[1], "-v");
+    const Size sizes[] = { Size(1, 1), Size(17, 13), Size(33, 7), Size(15, 31), Size(64, 48), Size(642, 482) };
+    const jcodec::pixel_format_t formats[] = { jcodec::PF_BGR, jcodec::PF_GRAY, jcodec::PF_BGRA, jcodec::PF_RGBA, jcodec::PF_BGR16,
+        jcodec::PF_GRAY16, jcodec::PF_BGRA16, jcodec::PF_RGBA16, jcodec::PF_YUYV, jcodec::PF_I420, jcodec::PF_NV12 };
+    const char *format_names[] = { "bgr", "gray", "bgra", "rgba", "bgr16", "gray16", "bgra16", "rgba16", "yuyv", "i420", "nv12" };
+    // params::m_src_depth of the 16-bit formats: 8 keeps the low byte (and clamps), 16 the high one
+    const int depths[] = { 8, 16 };
+    const jcodec::subsampling_t subs[] = { jcodec::Y_ONLY, jcodec::H1V1, jcodec::H2V1, jcodec::H2V2 };
+    const char *level_names[] = { "scalar", "sse2", "avx2", "avx512" };
+
+    const jcodec::simd_level_t best = jcodec::get_simd_level();
+    for (int l = jcodec::SIMD_SSE2; l <= jcodec::SIMD_AVX512; l++)
+        if (l > best)
+            printf("%s: not supported by this CPU, skipped\n", level_names[l]);
+
+    int configs = 0, failures = 0;
+    for (size_t s = 0; s < DIM(sizes); s++)
+        for (size_t f = 0; f < DIM(formats); f++)
+        {
+            // the YUV layouts take even sizes only
+            const bool wide = (formats[f] & jcodec::PF_16BIT) != 0;
+            Size size = sizes[s];
+            if (!wide && (formats[f] >= jcodec::PF_YUYV))
+                size = Size(size.width & ~1, size.height & ~1);
+            if (!size.area())
+                continue;
+            vector<Mat> frames;
+            for (int i = 0; i < FRAMES; i++)
+                frames.push_back(make_frame(size, formats[f], i));
+            for (size_t d = 0; d < (wide ? DIM(depths) : 1); d++)
+                for (size_t k = 0; k < DIM(subs); k++)
+                    for (int stripes = 1; stripes <= 4; stripes += 3)
+                        for (int two_pass = 0; two_pass < 2; two_pass++)
+                            for (int shared = 0; shared < 2; shared++)
+                            {
+                                jcodec::params p;
+                                p.m_quality = 85;
+                                p.m_subsampling = subs[k];
+                                p.m_stripes = stripes;
+                                p.m_two_pass_flag = two_pass != 0;
+                                if (wide)
+                                    p.m_src_depth = depths[d];
+                                char name[128];
+                                int n = sprintf(name, "%dx%d %s", size.width, size.height, format_names[f]);
+                                if (wide)
+                                    n += sprintf(name + n, " depth %d", p.m_src_depth);
+                                sprintf(name + n, " sub %d stripes %d%s%s", (int)subs[k], stripes, two_pass ? " two-pass" : "", shared ? " shared" : "");
+                                configs++;
+
+                                vector<char> ref, out;
+                                jcodec::set_simd_level(jcodec::SIMD_SCALAR);
+                                int ref_result = encode(frames, size, formats[f], p, shared != 0);
+                                if ((ref_result > 0) && !read_file(OUT_FILE, ref))
+                                    ref_result = -1;
+                                bool same = true;
+                                for (int l = jcodec::SIMD_SSE2; l <= best; l++)
+                                {
+                                    jcodec::set_simd_level((jcodec::simd_level_t)l);
+                                    int result = encode(frames, size, formats[f], p, shared != 0);
+                                    if ((result > 0) && !read_file(OUT_FILE, out))
+                                        result = -1;
+                                    if ((result != ref_result) || ((result > 0) && (out != ref)))
+                                    {
+                                        printf("%s: %s differs from scalar (result %d, %d)\n", name, level_names[l], result, ref_result);
+                                        same = false;
+                                    }
+                                }
+                                if (!same)
+                                    failures++;
+                                else if (verbose)
+                                    printf("%s: same (result %d)\n", name, ref_result);
+                            }
+        }
+    jcodec::set_simd_level(best);
+    remove(OUT_FILE);
+    printf("%d configurations, %d differ\n", configs, failures);
+    return failures ? 1 : 0;
+}